@@ -20,18 +20,27 @@ defmodule PicamHTTP.Streamer do
   end
 
   defp send_pictures(conn) do
-    send_picture(conn)
-    send_pictures(conn)
+    :ok = Picam.subscribe()
+    stream_pictures(conn)
   end
 
-  defp send_picture(conn) do
-    jpg = Picam.next_frame
+  defp stream_pictures(conn) do
+    receive do
+      {:picam_frame, _stream, jpg} ->
+        case send_picture(conn, jpg) do
+          {:ok, conn} -> stream_pictures(conn)
+          {:error, _reason} -> conn
+        end
+    end
+  end
+
+  defp send_picture(conn, jpg) do
     size = byte_size(jpg)
     header = "------#{@boundary}\r\nContent-Type: image/jpeg\r\nContent-length: #{size}\r\n\r\n"
     footer = "\r\n"
     with {:ok, conn} <- chunk(conn, header),
          {:ok, conn} <- chunk(conn, jpg),
          {:ok, conn} <- chunk(conn, footer),
-      do: conn
+      do: {:ok, conn}
   end
 end
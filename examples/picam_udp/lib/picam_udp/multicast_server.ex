@@ -8,25 +8,24 @@ defmodule PicamUDP.MulticastServer do
   end
 
   def init([port, broadcast]) do
-    {:ok, socket} = :gen_udp.open(port, [{:broadcast, true}, {:reuseaddr, true}, {:add_membership, {broadcast, {0,0,0,0}}}])
     send(self(), :start_streaming)
-    {:ok, %{socket: socket,
-      port: port,
+    {:ok, %{port: port,
       broadcast: broadcast,
-      stream_pid: nil}}
+      streaming: false}}
   end
 
+  # raspijpgs packetizes the frames itself, so nothing goes through here.
   def handle_info(:start_streaming, state) do
     Logger.debug "Starting stream"
-    {:ok, stream_pid} = Task.start_link(fn -> stream(state.socket, state.broadcast, state.port) end)
-    {:noreply, %{state | stream_pid: stream_pid}}
+    :ok = Picam.set_restart_interval(8)
+    :ok = Picam.set_rtp("#{:inet.ntoa(state.broadcast)}:#{state.port}")
+    {:noreply, %{state | streaming: true}}
   end
 
-  def handle_info(:stop_streaming, %{stream_pid: stream_pid} = state) when not is_nil(stream_pid) do
+  def handle_info(:stop_streaming, %{streaming: true} = state) do
     Logger.debug "Stopping stream"
-    Process.unlink(stream_pid)
-    Process.exit(stream_pid, :kill)
-    {:noreply, %{state | stream_pid: nil}}
+    :ok = Picam.set_rtp("")
+    {:noreply, %{state | streaming: false}}
   end
 
   def handle_info(:stop_streaming, state) do
@@ -37,14 +36,8 @@ defmodule PicamUDP.MulticastServer do
     {:noreply, state}
   end
 
-  def terminate(_reason, %{socket: socket}) do
+  def terminate(_reason, _state) do
     Logger.warn "Terminating #{__MODULE__}"
-    :gen_udp.close(socket)
-  end
-
-  defp stream(socket, broadcast, port) do
-    frame = Picam.next_frame
-    :gen_udp.send(socket, broadcast, port, frame)
-    stream(socket, broadcast, port)
+    Picam.set_rtp("")
   end
 end
@@ -2,13 +2,215 @@ defmodule Picam do
   @moduledoc """
   This module contains functions to manipulate, capture, and stream
   MJPEG video on a Raspberry Pi using the camera module.
+
+  On boards with more than one camera connector, such as the Compute
+  Module, start `Picam.Camera` with the `:cameras` option and use
+  `put_camera/1` to pick which camera the functions below apply to.
+  """
+
+  @doc """
+  Select the camera that this process's calls apply to.
+
+  Frames, stills, statistics and settings from the calling process go to
+  camera `num` until this is called again. Defaults to camera 0.
+  """
+  def put_camera(num) when num in 0..3 do
+    Process.put(:picam_camera, num)
+    :ok
+  end
+
+  def put_camera(_other), do: {:error, :invalid_camera}
+
+  @doc """
+  Returns the camera selected with `put_camera/1`.
   """
+  def get_camera do
+    Process.get(:picam_camera, 0)
+  end
+
+  @doc """
+  Apply the settings made by `fun` together.
+
+  The `set_*` calls made while `fun` runs are sent to the camera as one
+  batch. Settings that are already in effect are skipped, and the pipeline
+  is rebuilt at most once, however many of them need it. Commands in the
+  batch, like starting a recording, run in order after the settings made
+  before them. For example:
+
+  ```elixir
+  Picam.batch(fn ->
+    Picam.set_size(1280, 720)
+    Picam.set_streams([{320, 0}])
+    Picam.set_fps(30)
+  end)
+  ```
+
+  Returns `{:ok, result}` once the batch has been applied, where `result`
+  is a map with:
+
+    * `:applied` - settings that were changed
+    * `:unchanged` - settings that already had the requested value
+    * `:unknown` - settings that `raspijpgs` didn't recognize
+    * `:rebuilds` - times the camera pipeline had to be rebuilt
+  """
+  def batch(fun) when is_function(fun, 0) do
+    Process.put(:picam_batch, [])
+
+    messages =
+      try do
+        fun.()
+        Process.get(:picam_batch)
+      after
+        Process.delete(:picam_batch)
+      end
+
+    GenServer.call(camera(), {:batch, messages |> Enum.reverse() |> Enum.join("\n")}, 10_000)
+  end
+
+  @doc """
+  Send settings to the camera in one compact binary packet and wait for the
+  result.
+
+  `settings` is a keyword list of `raspijpgs` option names and values, for
+  example `[shutter: 8000, ISO: 400, ev: -1]`. Integers, floats, booleans
+  and strings (or atoms for named values like `exposure: :night`) are sent
+  as such, so nothing is formatted or parsed as text. This suits control
+  loops that send many updates a second, like an auto-exposure tuner. The
+  settings are applied together like `batch/1`, to the camera selected
+  with `put_camera/1` unless `camera` is given.
+
+  Returns `{:ok, result}` with `:applied`, `:unchanged` and `:rebuilds`
+  counts like `batch/1`, or `{:error, result}` with an `:errors` list of
+  `{name, reason}` too. The reason is one of `:unknown_option`,
+  `:invalid_type`, `:invalid_value` or `:malformed`. The other settings are
+  still applied.
+  """
+  def configure(settings, camera \\ get_camera())
+
+  def configure(settings, camera) when is_list(settings) and camera in 0..3,
+    do: GenServer.call(camera(), {:configure, camera, settings}, 10_000)
+
+  def configure(_settings, _camera), do: {:error, :invalid_settings}
 
   @doc """
   Returns a binary with the contents of a single JPEG frame from the camera.
+
+  When the codec is set to `:h264` with `set_codec/1`, the main stream returns
+  H.264 access units instead.
+
+  `stream` selects one of the scaled streams added with `set_streams/1`.
+  Stream 0 is the main stream at the size set with `set_size/2`.
+  """
+  def next_frame(stream \\ 0) when is_integer(stream) and stream >= 0 do
+    GenServer.call(camera(), {:next_frame, {get_camera(), stream}})
+  end
+
+  @doc """
+  Send each frame from `stream` to the calling process.
+
+  Frames arrive as `{:picam_frame, {camera, stream}, jpg}` messages, where
+  `camera` is the one selected with `put_camera/1`. This avoids a call per
+  frame, so it scales to many viewers better than `next_frame/1`. The
+  frames are shared binaries rather than copies.
+
+  A subscriber that falls behind skips frames. Frames aren't sent while
+  more than `max_queue` messages are waiting in its mailbox. Defaults to 2.
+
+  The subscription ends when the process exits or calls `unsubscribe/1`.
   """
-  def next_frame do
-    GenServer.call(camera(), :next_frame)
+  def subscribe(stream \\ 0, max_queue \\ 2)
+      when is_integer(stream) and stream >= 0 and is_integer(max_queue) and max_queue > 0 do
+    GenServer.call(camera(), {:subscribe, self(), {get_camera(), stream}, max_queue})
+  end
+
+  @doc """
+  Stop sending frames from `stream` to the calling process.
+  """
+  def unsubscribe(stream \\ 0) when is_integer(stream) and stream >= 0 do
+    GenServer.call(camera(), {:unsubscribe, self(), {get_camera(), stream}})
+  end
+
+  @doc """
+  Captures a single JPEG at the sensor's full resolution.
+
+  The video stream keeps running at its current size. The quality is set
+  with `set_still_quality/1`. The first capture takes longer while the
+  still encoder is set up.
+  """
+  def capture_still do
+    GenServer.call(camera(), {:capture_still, get_camera()}, 10_000)
+  end
+
+  @doc """
+  Set the JPEG quality of stills taken with `capture_still/0`.
+
+  The accepted range is [1, 100].
+  """
+  def set_still_quality(quality \\ 90)
+  def set_still_quality(quality) when quality in 1..100, do: set("still_quality=#{quality}")
+  def set_still_quality(_other), do: {:error, :invalid_quality}
+
+  @doc """
+  Like `next_frame/1`, but also returns the frame's metadata.
+
+  Returns `{frame, metadata}` where `metadata` is a map with:
+
+    * `:pts` - presentation timestamp in microseconds from the camera's
+      clock, or `nil` if it isn't known
+    * `:sequence` - frame number within the stream
+    * `:dropped_frames` - frames for this stream dropped so far
+    * `:exposure` - exposure time in microseconds
+    * `:analog_gain` - sensor analog gain
+    * `:digital_gain` - digital gain
+
+  The exposure and gains are 0 until the camera reports them. The first call
+  turns on metadata reporting and so may take an extra frame to return.
+  """
+  def next_frame_with_metadata(stream \\ 0) when is_integer(stream) and stream >= 0 do
+    GenServer.call(camera(), {:next_frame_with_metadata, {get_camera(), stream}})
+  end
+
+  @doc """
+  Returns a map of statistics reported by the camera.
+
+    * `:frame_buffer_size` - bytes reserved for assembling fragmented frames
+    * `:peak_frame_size` - size in bytes of the largest frame seen
+    * `:frames_dropped` - frames dropped because they were too large or
+      abandoned when the pipeline was reconfigured
+    * `:frames_oversized` - frames dropped for being over the size limit
+    * `:pool_buffers` - output buffers in the encoder's pool
+    * `:pool_starvations` - times the encoder was left without a buffer to fill
+    * `:frames` and `:bytes` - totals sent since starting
+    * `:fps` and `:bytes_per_second` - rates since the previous call
+    * `:callback_latency_*`, `:assembly_*` and `:write_*` - `_count`,
+      `_avg_us`, `_p50_us`, `_p99_us` and `_max_us` of the time from an
+      encoder callback to the main loop picking it up, of handling each
+      buffer, and of writing each frame. These cover the time since the
+      previous call.
+    * `:paused` - 1 while encoding is paused in demand mode
+    * `:stdout_queue_length` - packets waiting for the port to read them
+    * `:stdout_frames_dropped` - frames dropped because the port fell behind
+    * `:stdout_reports_replaced` - stats and motion reports superseded by a newer one
+      before the port read them
+    * `:socket_clients` - clients connected to the socket set with `set_socket/1`
+    * `:socket_frames_dropped` - frames skipped because a socket client fell behind
+    * `:http_clients` - clients connected to the port set with `set_http/1`
+    * `:http_frames_dropped` - frames skipped because an HTTP client fell behind
+    * `:rtp_packets_sent` - packets sent to the destination set with `set_rtp/1`
+    * `:rtp_frames_dropped` - frames that couldn't be sent as RTP/JPEG
+    * `:shm_frames_dropped` - frames too large for a slot in the ring set with `set_shm/1`
+    * `:recording` - 1 while a recording is being written
+    * `:record_preroll_frames` - frames held for the pre-roll
+    * `:record_frames_dropped` - frames lost because the disk fell behind
+    * `:record_segments`, `:record_bytes_written`, `:record_write_errors` -
+      recording files opened, bytes written and failed writes
+
+  Per-stream keys for scaled streams are prefixed with `stream<id>_`, for
+  example `:stream1_fps`. Keys for cameras other than camera 0 are also
+  prefixed with `camera<num>_`, for example `:camera1_stream1_fps`.
+  """
+  def stats do
+    GenServer.call(camera(), :stats)
   end
 
   @doc """
@@ -23,7 +225,44 @@ defmodule Picam do
   def set_size(_width, _height), do: {:error, :invalid_size}
 
   @doc """
-  Annotate the JPEG frames with the text in `annotation`.
+  Add scaled copies of the main stream, each with its own size and JPEG quality.
+
+  `streams` is a list of `{width, height}` or `{width, height, quality}`
+  tuples. One of the dimensions may be 0 to keep the aspect ratio of the main
+  stream, and `quality` defaults to the main stream's quality. Up to three
+  scaled streams are supported. They're numbered from 1 in the order given and
+  their frames are returned by `next_frame/1`.
+
+  Pass an empty list to go back to only the main stream.
+
+  ## Examples
+
+      iex> Picam.set_streams([{320, 0, 10}])
+      :ok
+
+  """
+  def set_streams(streams) when is_list(streams) and length(streams) <= 3 do
+    if Enum.all?(streams, &valid_stream?/1) do
+      spec =
+        streams
+        |> Enum.map(fn stream -> stream |> Tuple.to_list() |> Enum.join(",") end)
+        |> Enum.join(";")
+
+      set("streams=#{spec}")
+    else
+      {:error, :invalid_streams}
+    end
+  end
+
+  def set_streams(_other), do: {:error, :invalid_streams}
+
+  @doc """
+  Annotate the frames with the text in `annotation`.
+
+  The camera draws the text, so it costs nothing per frame. `strftime`
+  codes are replaced with the local time and updated once a second, e.g.
+  `"Front door %Y-%m-%d %H:%M:%S"`. Use `%%` for a literal `%`. An empty
+  string turns the annotation off.
   """
   def set_annotation_text(annotation \\ "")
 
@@ -364,12 +603,51 @@ defmodule Picam do
   @doc """
   Set the JPEG quality.
 
-  The accepted range is [1, 100].
+  The accepted range is [1, 100]. With `set_target_bitrate/1` or
+  `set_max_frame_size/1`, this is the highest quality they'll use.
   """
   def set_quality(quality \\ 15)
   def set_quality(quality) when quality in 1..100, do: set("quality=#{quality}")
   def set_quality(_other), do: {:error, :invalid_quality}
 
+  @doc """
+  Adjust the JPEG quality every frame so the main stream averages this many
+  bits per second.
+
+  The quality stays between `set_min_quality/1` and `set_quality/1`. If the
+  `bitrate` given is 0, the quality is fixed.
+  """
+  def set_target_bitrate(bitrate \\ 0)
+
+  def set_target_bitrate(bitrate) when is_integer(bitrate) and bitrate >= 0,
+    do: set("target_bitrate=#{bitrate}")
+
+  def set_target_bitrate(_other), do: {:error, :invalid_target_bitrate}
+
+  @doc """
+  Adjust the JPEG quality every frame to keep the main stream's frames
+  under this many bytes.
+
+  Frames are aimed a bit below the limit, and it's capped at 16 MiB. If the
+  `size` given is 0, there's no limit besides that cap.
+  """
+  def set_max_frame_size(size \\ 0)
+
+  def set_max_frame_size(size) when is_integer(size) and size >= 0,
+    do: set("max_frame_size=#{size}")
+
+  def set_max_frame_size(_other), do: {:error, :invalid_max_frame_size}
+
+  @doc """
+  Set the lowest JPEG quality that `set_target_bitrate/1` and
+  `set_max_frame_size/1` can go down to.
+
+  The accepted range is [1, 100].
+  """
+  def set_min_quality(quality \\ 5)
+  def set_min_quality(quality) when quality in 1..100, do: set("min_quality=#{quality}")
+  def set_min_quality(_other), do: {:error, :invalid_min_quality}
+
   @doc """
   Set the JPEG restart interval.
 
@@ -382,6 +660,272 @@ defmodule Picam do
 
   def set_restart_interval(_other), do: {:error, :invalid_restart_interval}
 
+  @doc """
+  Set the codec used for the main stream.
+
+  The accepted codecs are:
+
+    * `:mjpeg` - each frame is a JPEG (the default)
+    * `:h264` - each frame is an H.264 access unit in Annex B byte stream format
+
+  Scaled streams added with `set_streams/1` are always MJPEG.
+  """
+  def set_codec(codec \\ :mjpeg)
+  def set_codec(codec) when codec in [:mjpeg, :h264], do: set("codec=#{codec}")
+  def set_codec(_other), do: {:error, :unknown_codec}
+
+  @doc """
+  Set the number of output buffers each encoder gets.
+
+  More buffers absorb jitter at high frame rates. Fewer buffers keep
+  latency down. The accepted range is [0, 32]. If `count` is 0, the
+  encoder's recommendation is used, raised to 6 for the high frame rate
+  sensor modes or above 60 fps. The `:pool_starvations` count in
+  `stats/0` shows whether the encoders are running out.
+  """
+  def set_buffers(count \\ 0)
+  def set_buffers(count) when count in 0..32, do: set("buffers=#{count}")
+  def set_buffers(_other), do: {:error, :invalid_buffers}
+
+  @doc """
+  Set the number of frames the camera queues up for the encoders.
+
+  The accepted range is [0, 16]. If `count` is 0, the default is 3, or 4
+  for the high frame rate sensor modes or above 60 fps. Changing this
+  restarts the camera.
+  """
+  def set_camera_frames(count \\ 0)
+  def set_camera_frames(count) when count in 0..16, do: set("camera_frames=#{count}")
+  def set_camera_frames(_other), do: {:error, :invalid_camera_frames}
+
+  @doc """
+  Serve frames to local clients on a Unix domain socket at `path`.
+
+  Clients that connect to the socket receive the same length-prefixed
+  packets as the port, without a round trip through the BEAM. Clients
+  that fall behind skip frames rather than slowing down the camera.
+  Pass an empty string to stop serving.
+  """
+  def set_socket(path \\ "")
+  def set_socket(path) when is_binary(path), do: set("socket=#{path}")
+  def set_socket(_other), do: {:error, :invalid_socket}
+
+  @doc """
+  Serve MJPEG streams over HTTP on `port`.
+
+  `raspijpgs` answers `GET /` with the main stream as a
+  `multipart/x-mixed-replace` response that browsers show as video.
+  `GET /camera/stream` picks another camera or scaled stream. Frames go
+  straight from the encoder to the clients without passing through the
+  BEAM. Clients that fall behind skip frames. Pass 0 to stop serving.
+  """
+  def set_http(port \\ 0)
+  def set_http(port) when port in 0..65535, do: set("http=#{port}")
+  def set_http(_other), do: {:error, :invalid_http}
+
+  @doc """
+  Send the main stream as RTP/JPEG (RFC 2435) to `destination`.
+
+  `destination` is `"address:port"`, where the address can be a unicast or
+  multicast IPv4 address. Frames are split into packets of at most
+  `set_rtp_mtu/1` bytes, so they don't depend on IP fragmentation. With
+  `set_restart_interval/1`, packets end on restart markers and a lost packet
+  only spoils part of a frame. Pass an empty string to stop sending.
+  """
+  def set_rtp(destination \\ "")
+  def set_rtp(destination) when is_binary(destination), do: set("rtp=#{destination}")
+  def set_rtp(_other), do: {:error, :invalid_rtp}
+
+  @doc """
+  Set the largest RTP packet that `set_rtp/1` sends, in bytes.
+  """
+  def set_rtp_mtu(mtu \\ 1400)
+  def set_rtp_mtu(mtu) when is_integer(mtu) and mtu >= 256, do: set("rtp_mtu=#{mtu}")
+  def set_rtp_mtu(_other), do: {:error, :invalid_rtp_mtu}
+
+  @doc """
+  Publish frames to a POSIX shared memory ring called `name` (e.g. `"/picam"`).
+
+  Local readers can map the ring read-only and use frames in place instead
+  of copying them through a pipe or socket. The layout is described in
+  `src/picam_shm_ring.h`. Pass an empty string to remove the ring.
+  """
+  def set_shm(name \\ "")
+  def set_shm(name) when is_binary(name), do: set("shm=#{name}")
+  def set_shm(_other), do: {:error, :invalid_shm}
+
+  @doc """
+  Set the size in bytes of each slot in the shared memory ring.
+
+  A frame that doesn't fit in a slot is skipped. Raise this for large raw
+  frames from `set_raw_stream/3`. Defaults to 1 MiB.
+  """
+  def set_shm_slot_size(size \\ 1_048_576)
+  def set_shm_slot_size(size) when is_integer(size) and size > 64, do: set("shm_slot_size=#{size}")
+  def set_shm_slot_size(_other), do: {:error, :invalid_shm_slot_size}
+
+  @doc """
+  Send uncompressed frames to the socket and shared memory ring.
+
+  The frames are scaled like the streams added with `set_streams/1`, so
+  `width` or `height` may be 0 to keep the aspect ratio. `format` is
+  `:i420` (planar YUV 4:2:0, as produced by the camera) or `:rgb` (packed
+  RGB24). Rows are padded to a multiple of 32 pixels and the height to a
+  multiple of 16.
+
+  Raw frames aren't sent to the BEAM. They're only published to the sinks
+  set up with `set_socket/1` and `set_shm/1`, with the stream id after the
+  scaled streams. The raw stream uses a splitter output, so at most two
+  scaled streams can be used with it. Call `set_raw_stream(nil)` to turn
+  it off.
+  """
+  def set_raw_stream(width, height, format \\ :i420)
+
+  def set_raw_stream(width, height, format)
+      when is_integer(width) and width >= 0 and is_integer(height) and height >= 0 and
+             format in [:i420, :rgb],
+      do: set("raw=#{width},#{height},#{format}")
+
+  def set_raw_stream(_width, _height, _format), do: {:error, :invalid_raw_stream}
+
+  def set_raw_stream(nil), do: set("raw=")
+
+  @doc """
+  Keep a pre-roll of the main stream for recording into `dir`.
+
+  `raspijpgs` holds the last few seconds of encoded frames in memory
+  (see `set_record_preroll/1`) so that `start_recording/0` can include
+  what happened just before it was called. Recordings are written by a
+  thread in `raspijpgs`, so frames never pass through the BEAM. MJPEG is
+  saved as `.mjpeg` files of concatenated JPEGs and H.264 as `.h264`
+  Annex B streams. H.264 files need `set_inline_headers(true)`, the
+  default, so that each one starts with SPS/PPS. Pass an empty string to
+  stop keeping a pre-roll.
+  """
+  def set_record_dir(dir \\ "")
+  def set_record_dir(dir) when is_binary(dir), do: set("record_dir=#{dir}")
+  def set_record_dir(_other), do: {:error, :invalid_record_dir}
+
+  @doc """
+  Set how many bytes of frames are kept for the pre-roll. Defaults to 16 MiB.
+
+  This has to be large enough for the pre-roll at the current size and
+  quality. It also holds frames while the disk catches up.
+  """
+  def set_record_buffer(size \\ 16_777_216)
+  def set_record_buffer(size) when is_integer(size) and size >= 1_048_576, do: set("record_buffer=#{size}")
+  def set_record_buffer(_other), do: {:error, :invalid_record_buffer}
+
+  @doc """
+  Set how many seconds before `start_recording/0` recordings begin.
+  """
+  def set_record_preroll(seconds \\ 5)
+  def set_record_preroll(seconds) when is_integer(seconds) and seconds >= 0, do: set("record_preroll=#{seconds}")
+  def set_record_preroll(_other), do: {:error, :invalid_record_preroll}
+
+  @doc """
+  Start a new recording file every `seconds`.
+  """
+  def set_record_segment(seconds \\ 60)
+  def set_record_segment(seconds) when is_integer(seconds) and seconds > 0, do: set("record_segment=#{seconds}")
+  def set_record_segment(_other), do: {:error, :invalid_record_segment}
+
+  @doc """
+  Start recording into the directory set with `set_record_dir/1`.
+
+  The recording starts with the pre-roll and continues until
+  `stop_recording/0`.
+  """
+  def start_recording, do: set("record_start")
+
+  @doc """
+  Stop recording. Frames already queued are still written out.
+  """
+  def stop_recording, do: set("record_stop")
+
+  @doc """
+  Set the H.264 bitrate in bits per second.
+
+  The accepted range is [0, 25000000]. If the `bitrate` given is 0, the
+  encoder uses a variable bitrate.
+  """
+  def set_bitrate(bitrate \\ 17_000_000)
+  def set_bitrate(bitrate) when bitrate in 0..25_000_000, do: set("bitrate=#{bitrate}")
+  def set_bitrate(_other), do: {:error, :invalid_bitrate}
+
+  @doc """
+  Set the number of frames between H.264 I-frames (the GOP length).
+
+  If the `period` given is 0, the encoder's default is used.
+  """
+  def set_intra_period(period \\ 0)
+  def set_intra_period(period) when is_integer(period) and period >= 0, do: set("intra_period=#{period}")
+  def set_intra_period(_other), do: {:error, :invalid_intra_period}
+
+  @doc """
+  Enable or disable inserting the H.264 SPS and PPS headers before every I-frame.
+
+  Defaults to `true` so that a client can start decoding at any I-frame.
+  """
+  def set_inline_headers(false), do: set("inline_headers=off")
+  def set_inline_headers(true), do: set("inline_headers=on")
+  def set_inline_headers(_other), do: {:error, :invalid_inline_headers}
+
+  @doc """
+  Enable or disable motion detection.
+
+  Motion is detected from the H.264 encoder's motion vectors, so the codec
+  must be set to `:h264` with `set_codec/1`. See `subscribe_motion/1` for
+  how motion is reported.
+
+  Defaults to `false`.
+  """
+  def set_motion_detection(false), do: set("motion=off")
+  def set_motion_detection(true), do: set("motion=on")
+  def set_motion_detection(_other), do: {:error, :invalid_motion_detection}
+
+  @doc """
+  Set how far a 16x16 macroblock has to move between frames, in pixels,
+  to count as moving.
+
+  Defaults to 4.
+  """
+  def set_motion_threshold(threshold \\ 4)
+  def set_motion_threshold(threshold) when threshold in 1..181, do: set("motion_threshold=#{threshold}")
+  def set_motion_threshold(_other), do: {:error, :invalid_motion_threshold}
+
+  @doc """
+  Set how many macroblocks have to move for a frame to have motion.
+
+  Defaults to 10.
+  """
+  def set_motion_blocks(blocks \\ 10)
+  def set_motion_blocks(blocks) when is_integer(blocks) and blocks > 0, do: set("motion_blocks=#{blocks}")
+  def set_motion_blocks(_other), do: {:error, :invalid_motion_blocks}
+
+  @doc """
+  Send motion events to `pid`.
+
+  While motion detection is enabled, each frame with motion sends
+  `{:picam_motion, event}` to `pid`, and one more is sent when the motion
+  stops. If the port falls behind, events for frames with motion are
+  skipped in favor of the latest one, but the one for the motion stopping
+  always arrives. Events come from every camera. `event` is a map with:
+
+    * `:camera` - camera that saw the motion
+    * `:sequence` - sequence number of the frame
+    * `:active` - macroblocks that moved
+    * `:total` - macroblocks in the frame
+    * `:bounds` - `{left, top, right, bottom}` of the moving area in macroblocks
+    * `:grid` - 64-bit bitmap over an 8x8 grid of where things moved, with
+      bit `row * 8 + column` set for each cell with motion
+
+  The subscription ends when `pid` exits.
+  """
+  def subscribe_motion(pid \\ self()) do
+    GenServer.call(camera(), {:subscribe_motion, pid})
+  end
+
   @doc """
   Enable or disable video preview output to the attached display(s).
 
@@ -418,10 +962,33 @@ defmodule Picam do
 
   # Private helper functions
 
+  defp valid_stream?({width, height})
+       when is_integer(width) and is_integer(height) and width >= 0 and height >= 0 and
+              (width > 0 or height > 0),
+       do: true
+
+  defp valid_stream?({width, height, quality}) when quality in 1..100,
+    do: valid_stream?({width, height})
+
+  defp valid_stream?(_other), do: false
+
   defp set(msg) do
-    GenServer.cast(camera(), {:set, msg})
+    case Process.get(:picam_batch) do
+      nil ->
+        GenServer.cast(camera(), {:set, for_camera(get_camera(), msg)})
+
+      # Batched settings name their camera since they share a packet
+      batch ->
+        Process.put(:picam_batch, ["camera=#{get_camera()}\n#{msg}" | batch])
+        :ok
+    end
   end
 
+  # raspijpgs applies lines to camera 0 unless the packet says otherwise
+  @doc false
+  def for_camera(0, msg), do: msg
+  def for_camera(num, msg), do: "camera=#{num}\n#{msg}"
+
   defp camera() do
     Application.get_env(:picam, :camera, Picam.Camera)
   end
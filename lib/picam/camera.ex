@@ -1,40 +1,184 @@
 defmodule Picam.Camera do
   @moduledoc """
   GenServer which starts and manages the `raspijpgs` application as a port.
+
+  Options:
+
+    * `:offline_image` - image in `priv/fake_camera_images` to return while
+      the camera is offline
+    * `:port_restart_interval` - milliseconds to wait before restarting
+      `raspijpgs` after it exits
+    * `:demand` - when `true`, `raspijpgs` is paused whenever there are no
+      outstanding `Picam.next_frame/1` calls or `Picam.subscribe/2`
+      subscribers, which saves encoding frames that nobody wants. Defaults
+      to `false`.
+    * `:cameras` - list of camera numbers to run. Defaults to `[0]`. See
+      `Picam.put_camera/1`.
+    * `:fast_start` - when `true`, `raspijpgs` saves the camera's exposure,
+      gains and white balance to a file in `System.tmp_dir!/0` and starts
+      from them after a restart, so the first frames after a crash aren't
+      dark or tinted. Defaults to `false`.
+    * `:fake` - path to a clip to replay instead of using the camera, either
+      a file of concatenated JPEGs (like the `.mjpeg` files that
+      `Picam.start_recording/0` writes) or a directory of `.jpg` files.
+      `raspijpgs` plays it on a loop at `Picam.set_fps/1` (30 fps when that's
+      0) through its normal output, so everything from the port onwards
+      gets exercised without a Raspberry Pi camera. `raspijpgs` itself still
+      has to be built. Camera settings are accepted but have no effect.
   """
 
   use GenServer
   require Logger
 
+  # Same as the timeout on Picam.capture_still/0's call. A still that was
+  # asked for longer ago than this is taken to be lost, so the next caller
+  # asks again.
+  @still_timeout 10_000
+
   def start_link(opts \\ []) do
     GenServer.start_link(__MODULE__, opts, name: __MODULE__)
   end
 
   def init(opts) do
-    port = spawn_port()
+    cameras = Keyword.get(opts, :cameras, [0])
+    fast_start = Keyword.get(opts, :fast_start, false)
+    fake = Keyword.get(opts, :fake)
+    port = spawn_port(cameras, fast_start, fake)
 
     offline_image = Keyword.get(opts, :offline_image, "offline_1280_720.jpg") |> image_data()
 
     port_restart_interval = Keyword.get(opts, :port_restart_interval, 10_000)
 
-    {:ok, %{port: port, requests: [], offline: false, offline_image: offline_image, port_restart_interval: port_restart_interval}}
+    demand = Keyword.get(opts, :demand, false)
+    if demand, do: send(port, {self(), {:command, "pause"}})
+
+    {:ok, %{port: port, requests: %{}, stats_requests: [], still_requests: %{}, ack_requests: [], frame_subscribers: %{}, motion_subscribers: %{}, metadata: false, demand: demand, paused: demand, offline: false, offline_image: offline_image, port_restart_interval: port_restart_interval, cameras: cameras, fast_start: fast_start, fake: fake, options: %{}, next_seq: 0, configure_requests: %{}}}
   end
 
-  defp spawn_port() do
+  defp spawn_port(cameras, fast_start, fake) do
     executable = Path.join(:code.priv_dir(:picam), "raspijpgs")
-    Port.open({:spawn_executable, executable}, [{:packet, 4}, :use_stdio, :binary, :exit_status])
+    args = ["--cameras", Enum.join(cameras, ",")] ++ fast_start_args(cameras, fast_start) ++ fake_args(fake)
+    Port.open({:spawn_executable, executable}, [{:packet, 4}, :use_stdio, :binary, :exit_status, args: args])
   end
 
   # GenServer callbacks
 
-  def handle_call(:next_frame, _from, state = %{offline: true, offline_image: offline_image}) do
-    Task.start(fn -> dispatch(state.requests, offline_image) end)
-    {:reply, offline_image, %{state | requests: []}}
+  def handle_call({kind, _stream}, _from, state = %{offline: true, offline_image: offline_image})
+      when kind in [:next_frame, :next_frame_with_metadata] do
+    requests = state.requests |> Map.values() |> List.flatten()
+    Task.start(fn -> dispatch_frame(requests, offline_image, %{}) end)
+    {:reply, frame_reply(kind, offline_image, %{}), %{state | requests: %{}}}
   end
 
-  def handle_call(:next_frame, from, state) do
-    state = %{state | requests: [from | state.requests]}
-    {:noreply, state}
+  def handle_call({:next_frame, stream}, from, state) do
+    {:noreply, add_request(state, stream, {from, :next_frame})}
+  end
+
+  def handle_call({:next_frame_with_metadata, stream}, from, state) do
+    unless state.metadata, do: send(state.port, {self(), {:command, "metadata=on"}})
+    {:noreply, %{add_request(state, stream, {from, :next_frame_with_metadata}) | metadata: true}}
+  end
+
+  def handle_call({:subscribe, pid, stream, max_queue}, _from, state) do
+    subscribers =
+      Map.update(state.frame_subscribers, pid, {Process.monitor(pid), %{stream => max_queue}}, fn {ref, streams} ->
+        {ref, Map.put(streams, stream, max_queue)}
+      end)
+
+    {:reply, :ok, update_demand(%{state | frame_subscribers: subscribers})}
+  end
+
+  def handle_call({:unsubscribe, pid, stream}, _from, state) do
+    subscribers =
+      case Map.fetch(state.frame_subscribers, pid) do
+        {:ok, {ref, streams}} ->
+          case Map.delete(streams, stream) do
+            remaining when map_size(remaining) == 0 ->
+              Process.demonitor(ref, [:flush])
+              Map.delete(state.frame_subscribers, pid)
+
+            remaining ->
+              Map.put(state.frame_subscribers, pid, {ref, remaining})
+          end
+
+        :error ->
+          state.frame_subscribers
+      end
+
+    {:reply, :ok, update_demand(%{state | frame_subscribers: subscribers})}
+  end
+
+  def handle_call({:subscribe_motion, pid}, _from, state) do
+    subscribers =
+      Map.put_new_lazy(state.motion_subscribers, pid, fn -> Process.monitor(pid) end)
+
+    {:reply, :ok, %{state | motion_subscribers: subscribers}}
+  end
+
+  def handle_call({:capture_still, _camera}, _from, state = %{offline: true}) do
+    {:reply, {:error, :offline}, state}
+  end
+
+  def handle_call({:capture_still, camera}, from, state) do
+    now = System.monotonic_time(:millisecond)
+    {requested_at, requests} = Map.get(state.still_requests, camera, {nil, []})
+
+    requested_at =
+      if requested_at && now - requested_at < @still_timeout do
+        requested_at
+      else
+        send(state.port, {self(), {:command, Picam.for_camera(camera, "capture_still")}})
+        now
+      end
+
+    still_requests = Map.put(state.still_requests, camera, {requested_at, [from | requests]})
+    {:noreply, %{state | still_requests: still_requests}}
+  end
+
+  def handle_call(:stats, _from, state = %{offline: true}) do
+    {:reply, {:error, :offline}, state}
+  end
+
+  def handle_call(:stats, from, state) do
+    send(state.port, {self(), {:command, "stats"}})
+    {:noreply, %{state | stats_requests: [from | state.stats_requests]}}
+  end
+
+  def handle_call({:batch, _messages}, _from, state = %{offline: true}) do
+    {:reply, {:error, :offline}, state}
+  end
+
+  def handle_call({:batch, messages}, from, state) do
+    send(state.port, {self(), {:command, messages <> "\nack"}})
+    {:noreply, %{state | ack_requests: state.ack_requests ++ [from]}}
+  end
+
+  def handle_call({:configure, _camera, _settings}, _from, state = %{offline: true}) do
+    {:reply, {:error, :offline}, state}
+  end
+
+  # raspijpgs announces its option ids as soon as it starts
+  def handle_call({:configure, _camera, _settings}, _from, state = %{options: options}) when map_size(options) == 0 do
+    {:reply, {:error, :not_ready}, state}
+  end
+
+  def handle_call({:configure, camera, settings}, from, state) do
+    settings = if camera == 0, do: settings, else: [{:camera, "#{camera}"} | settings]
+
+    {records, names, unknown} =
+      Enum.reduce(settings, {[], [], []}, fn {name, value}, {records, names, unknown} ->
+        case Map.fetch(state.options, to_string(name)) do
+          {:ok, id} -> {[encode_setting(id, value) | records], [name | names], unknown}
+          :error -> {records, names, [{name, :unknown_option} | unknown]}
+        end
+      end)
+
+    seq = state.next_seq
+    packet = IO.iodata_to_binary([<<0xFF, ?B, seq::32>> | Enum.reverse(records)])
+    send(state.port, {self(), {:command, packet}})
+
+    requests = Map.put(state.configure_requests, seq, {from, Enum.reverse(names), Enum.reverse(unknown)})
+    {:noreply, %{state | next_seq: rem(seq + 1, 4_294_967_296), configure_requests: requests}}
   end
 
   def handle_cast({:set, message}, state) do
@@ -42,14 +186,77 @@ defmodule Picam.Camera do
     {:noreply, state}
   end
 
+  def handle_info({_, {:data, <<0xFF, ?s, report::binary>>}}, state) do
+    stats = parse_stats(report)
+    dispatch(state.stats_requests, stats)
+    {:noreply, %{state | stats_requests: []}}
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?a, report::binary>>}}, state = %{ack_requests: [from | rest]}) do
+    GenServer.reply(from, {:ok, parse_stats(report)})
+    {:noreply, %{state | ack_requests: rest}}
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?a, _report::binary>>}}, state) do
+    {:noreply, state}
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?o, table::binary>>}}, state) do
+    {:noreply, %{state | options: parse_options(table)}}
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?r, seq::32, applied::16, unchanged::16, rebuilds::16, _count::16, errors::binary>>}}, state) do
+    case Map.pop(state.configure_requests, seq) do
+      {{from, names, unknown}, requests} ->
+        result = %{applied: applied, unchanged: unchanged, rebuilds: rebuilds}
+        errors = for(<<index::16, code <- errors>>, do: {Enum.at(names, index), tlv_error(code)}) ++ unknown
+        GenServer.reply(from, if(errors == [], do: {:ok, result}, else: {:error, Map.put(result, :errors, errors)}))
+        {:noreply, %{state | configure_requests: requests}}
+
+      {nil, _} ->
+        {:noreply, state}
+    end
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?v, camera, motion::binary-size(20)>>}}, state) do
+    event = motion |> parse_motion() |> Map.put(:camera, camera)
+    for pid <- Map.keys(state.motion_subscribers), do: send(pid, {:picam_motion, event})
+    {:noreply, state}
+  end
+
+  def handle_info({:DOWN, _ref, :process, pid, _reason}, state) do
+    state = %{
+      state
+      | motion_subscribers: Map.delete(state.motion_subscribers, pid),
+        frame_subscribers: Map.delete(state.frame_subscribers, pid)
+    }
+
+    {:noreply, update_demand(state)}
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?c, camera, jpg::binary>>}}, state) do
+    {{_, requests}, still_requests} = Map.pop(state.still_requests, camera, {0, []})
+    Task.start(fn -> dispatch(requests, jpg) end)
+    {:noreply, %{state | still_requests: still_requests}}
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?m, tag, metadata::binary-size(28), jpg::binary>>}}, state) do
+    {:noreply, frame_received(parse_tag(tag), jpg, parse_metadata(metadata), state)}
+  end
+
+  def handle_info({_, {:data, <<0xFF, ?f, tag, jpg::binary>>}}, state) do
+    {:noreply, frame_received(parse_tag(tag), jpg, nil, state)}
+  end
+
   def handle_info({_, {:data, jpg}}, state) do
-    Task.start(fn -> dispatch(state.requests, jpg) end)
-    {:noreply, %{state | requests: [], offline: false}}
+    {:noreply, frame_received({0, 0}, jpg, nil, state)}
   end
 
   def handle_info(:reconnect_port, state = %{port_restart_interval: port_restart_interval}) do
-    with port when is_port(port) <- spawn_port() do
-      {:noreply, %{state | port: port}}
+    with port when is_port(port) <- spawn_port(state.cameras, state.fast_start, state.fake) do
+      if state.metadata, do: send(port, {self(), {:command, "metadata=on"}})
+      state = %{state | port: port, paused: false}
+      {:noreply, update_demand(state)}
     else
       _ ->
         Process.send_after(self(), :reconnect_port, port_restart_interval)
@@ -59,7 +266,13 @@ defmodule Picam.Camera do
 
   def handle_info({_, {:exit_status, _}}, state = %{port_restart_interval: port_restart_interval}) do
     Process.send_after(self(), :reconnect_port, port_restart_interval)
-    {:noreply, %{state | offline: true}}
+    for from <- state.ack_requests, do: GenServer.reply(from, {:error, :offline})
+    for {from, _, _} <- Map.values(state.configure_requests), do: GenServer.reply(from, {:error, :offline})
+    for {_, requests} <- Map.values(state.still_requests), from <- requests, do: GenServer.reply(from, {:error, :offline})
+    for from <- state.stats_requests, do: GenServer.reply(from, {:error, :offline})
+
+    {:noreply,
+     %{state | offline: true, ack_requests: [], options: %{}, configure_requests: %{}, still_requests: %{}, stats_requests: []}}
   end
 
   def terminate(reason, _state) do
@@ -68,10 +281,138 @@ defmodule Picam.Camera do
 
   # Private helper functions
 
+  defp fast_start_args(_cameras, false), do: []
+
+  defp fast_start_args(cameras, true) do
+    Enum.flat_map(cameras, fn camera ->
+      path = Path.join(System.tmp_dir!(), "picam_settings_#{camera}")
+      ["--camera", "#{camera}", "--settings_file", path]
+    end)
+  end
+
+  defp fake_args(nil), do: []
+  defp fake_args(path), do: ["--fake", Path.expand(path)]
+
+  defp add_request(state, stream, request) do
+    %{state | requests: Map.update(state.requests, stream, [request], &[request | &1])}
+    |> update_demand()
+  end
+
+  # In demand mode, only run the encoders while someone is waiting on a frame.
+  defp update_demand(state = %{demand: false}), do: state
+
+  defp update_demand(state) do
+    wanted = map_size(state.requests) > 0 or map_size(state.frame_subscribers) > 0
+
+    cond do
+      wanted and state.paused ->
+        send(state.port, {self(), {:command, "resume"}})
+        %{state | paused: false}
+
+      not wanted and not state.paused ->
+        send(state.port, {self(), {:command, "pause"}})
+        %{state | paused: true}
+
+      true ->
+        state
+    end
+  end
+
+  # Frames that arrive before metadata reporting kicks in only satisfy the
+  # plain requests.
+  defp frame_received(stream, jpg, nil, state) do
+    broadcast(state.frame_subscribers, stream, jpg)
+    {requests, pending} = Map.pop(state.requests, stream, [])
+    {ready, waiting} = Enum.split_with(requests, &match?({_, :next_frame}, &1))
+    Task.start(fn -> dispatch_frame(ready, jpg, nil) end)
+    pending = if waiting == [], do: pending, else: Map.put(pending, stream, waiting)
+    update_demand(%{state | requests: pending, offline: false})
+  end
+
+  defp frame_received(stream, jpg, metadata, state) do
+    broadcast(state.frame_subscribers, stream, jpg)
+    {requests, pending} = Map.pop(state.requests, stream, [])
+    Task.start(fn -> dispatch_frame(requests, jpg, metadata) end)
+    update_demand(%{state | requests: pending, offline: false})
+  end
+
+  # Sending shares the frame binary. Subscribers that haven't kept up skip
+  # frames instead of piling them up.
+  defp broadcast(subscribers, stream, jpg) do
+    for {pid, {_ref, streams}} <- subscribers, max_queue = streams[stream], max_queue != nil do
+      case Process.info(pid, :message_queue_len) do
+        {:message_queue_len, len} when len < max_queue -> send(pid, {:picam_frame, stream, jpg})
+        _ -> :skip
+      end
+    end
+  end
+
+  defp dispatch_frame(requests, jpg, metadata) do
+    for {req, kind} <- Enum.reverse(requests), do: GenServer.reply(req, frame_reply(kind, jpg, metadata))
+  end
+
+  defp frame_reply(:next_frame, jpg, _metadata), do: jpg
+  defp frame_reply(:next_frame_with_metadata, jpg, metadata), do: {jpg, metadata}
+
+  # The camera number is in the upper 4 bits and the stream in the lower 4
+  defp parse_tag(tag), do: {div(tag, 16), rem(tag, 16)}
+
+  defp parse_motion(<<sequence::32, active::16, total::16, left, top, right, bottom, grid::64>>) do
+    %{
+      sequence: sequence,
+      active: active,
+      total: total,
+      bounds: {left, top, right, bottom},
+      grid: grid
+    }
+  end
+
+  defp parse_metadata(<<pts::signed-64, sequence::32, dropped::32, exposure::32, analog_gain::32, digital_gain::32>>) do
+    %{
+      pts: if(pts < 0, do: nil, else: pts),
+      sequence: sequence,
+      dropped_frames: dropped,
+      exposure: exposure,
+      analog_gain: analog_gain / 65536,
+      digital_gain: digital_gain / 65536
+    }
+  end
+
   defp dispatch(requests, jpg) do
     for req <- Enum.reverse(requests), do: GenServer.reply(req, jpg)
   end
 
+  defp parse_stats(report) do
+    for line <- String.split(report, "\n", trim: true), into: %{} do
+      [key, value] = String.split(line, "=", parts: 2)
+      {String.to_atom(key), String.to_integer(value)}
+    end
+  end
+
+  defp parse_options(table) do
+    for line <- String.split(table, "\n", trim: true), into: %{} do
+      [name, id_and_type] = String.split(line, "=", parts: 2)
+      [id, _type] = String.split(id_and_type, ",", parts: 2)
+      {name, String.to_integer(id)}
+    end
+  end
+
+  # Records are id, type, length, value
+  defp encode_setting(id, value) when is_integer(value), do: <<id, ?i, 4::16, value::signed-32>>
+  defp encode_setting(id, value) when is_float(value), do: <<id, ?d, 8::16, value::float-64>>
+  defp encode_setting(id, true), do: <<id, ?b, 1::16, 1>>
+  defp encode_setting(id, false), do: <<id, ?b, 1::16, 0>>
+
+  defp encode_setting(id, value) do
+    str = to_string(value)
+    <<id, ?s, byte_size(str)::16, str::binary>>
+  end
+
+  defp tlv_error(1), do: :unknown_option
+  defp tlv_error(2), do: :invalid_type
+  defp tlv_error(3), do: :invalid_value
+  defp tlv_error(_), do: :malformed
+
   defp image_data(filename) when is_binary(filename) do
     :code.priv_dir(:picam)
     |> Path.join("fake_camera_images/#{filename}")
@@ -26,7 +26,7 @@ defmodule Picam.FakeCamera do
 
   @doc false
   def init(_opts) do
-    state = %{jpg: image_data(1280, 720), fps: 30, requests: []}
+    state = %{jpg: image_data(1280, 720), fps: 30, requests: [], subscribers: %{}, sequence: 0}
     schedule_next_frame(state)
 
     {:ok, state}
@@ -52,11 +52,45 @@ defmodule Picam.FakeCamera do
   # GenServer callbacks
 
   @doc false
-  def handle_call(:next_frame, from, state) do
-    state = %{state | requests: [from | state.requests]}
+  def handle_call({kind, _stream}, from, state) when kind in [:next_frame, :next_frame_with_metadata] do
+    state = %{state | requests: [{from, kind} | state.requests]}
     {:noreply, state}
   end
 
+  def handle_call({:subscribe, pid, stream, _max_queue}, _from, state) do
+    Process.monitor(pid)
+    {:reply, :ok, %{state | subscribers: Map.update(state.subscribers, pid, [stream], &[stream | &1])}}
+  end
+
+  def handle_call({:unsubscribe, pid, stream}, _from, state) do
+    {:reply, :ok, %{state | subscribers: Map.update(state.subscribers, pid, [], &List.delete(&1, stream))}}
+  end
+
+  def handle_call({:subscribe_motion, _pid}, _from, state) do
+    {:reply, :ok, state}
+  end
+
+  def handle_call({:capture_still, _camera}, _from, state) do
+    {:reply, state.jpg, state}
+  end
+
+  def handle_call({:batch, messages}, _from, state) do
+    lines = messages |> String.split("\n", trim: true) |> Enum.reject(&String.starts_with?(&1, "camera="))
+    state = Enum.reduce(lines, state, fn line, state -> elem(handle_cast({:set, line}, state), 1) end)
+    {:reply, {:ok, %{applied: length(lines), unchanged: 0, unknown: 0, rebuilds: 0}}, state}
+  end
+
+  def handle_call({:configure, _camera, settings}, _from, state) do
+    lines = for {name, value} <- settings, do: "#{name}=#{setting_text(value)}"
+    state = Enum.reduce(lines, state, fn line, state -> elem(handle_cast({:set, line}, state), 1) end)
+    {:reply, {:ok, %{applied: length(lines), unchanged: 0, rebuilds: 0}}, state}
+  end
+
+  def handle_call(:stats, _from, state) do
+    size = byte_size(state.jpg)
+    {:reply, %{frame_buffer_size: size, peak_frame_size: size, frames_dropped: 0}, state}
+  end
+
   @doc false
   def handle_cast({:set, "size=" <> size}, state) do
     [width, height] =
@@ -82,8 +116,15 @@ defmodule Picam.FakeCamera do
   @doc false
   def handle_info(:send_frame, state) do
     schedule_next_frame(state)
-    Task.start(fn -> dispatch(state.requests, state.jpg) end)
-    {:noreply, %{state | requests: []}}
+    sequence = state.sequence + 1
+    metadata = fake_metadata(sequence)
+    Task.start(fn -> dispatch(state.requests, state.jpg, metadata) end)
+    for {pid, streams} <- state.subscribers, stream <- streams, do: send(pid, {:picam_frame, stream, state.jpg})
+    {:noreply, %{state | requests: [], sequence: sequence}}
+  end
+
+  def handle_info({:DOWN, _ref, :process, pid, _reason}, state) do
+    {:noreply, %{state | subscribers: Map.delete(state.subscribers, pid)}}
   end
 
   @doc false
@@ -93,14 +134,34 @@ defmodule Picam.FakeCamera do
 
   # Private helper functions
 
-  defp dispatch(requests, jpg) do
-    for req <- Enum.reverse(requests), do: GenServer.reply(req, jpg)
+  defp dispatch(requests, jpg, metadata) do
+    for {req, kind} <- Enum.reverse(requests) do
+      case kind do
+        :next_frame -> GenServer.reply(req, jpg)
+        :next_frame_with_metadata -> GenServer.reply(req, {jpg, metadata})
+      end
+    end
+  end
+
+  defp fake_metadata(sequence) do
+    %{
+      pts: System.monotonic_time(:microsecond),
+      sequence: sequence,
+      dropped_frames: 0,
+      exposure: 0,
+      analog_gain: 1.0,
+      digital_gain: 1.0
+    }
   end
 
   defp schedule_next_frame(%{fps: fps}) do
     Process.send_after(self(), :send_frame, Integer.floor_div(1000, fps))
   end
 
+  defp setting_text(true), do: "on"
+  defp setting_text(false), do: "off"
+  defp setting_text(value), do: to_string(value)
+
   defp image_data(1920, 1080), do: image_data("1920_1080.jpg")
   defp image_data(640, 480), do: image_data("640_480.jpg")
   defp image_data(_, _), do: image_data("1280_720.jpg")
@@ -0,0 +1,516 @@
+// Drives raspijpgs on real hardware and reports how it keeps up.
+//
+// Bench mode runs every combination of the sizes, qualities and buffer
+// depths given and writes one JSON object per line for each: achieved fps,
+// encoder to main loop latency, CPU time per frame, RSS and dropped frames.
+// Soak mode keeps adding and removing a scaled stream, which tears the
+// pipeline down and builds it again, and fails if memory or file
+// descriptors keep growing.
+//
+// raspijpgs is talked to the same way Picam.Camera does: length-prefixed
+// packets of option lines on stdin, and length-prefixed frames and reports
+// on stdout.
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MSG_MARKER          0xff
+#define MSG_STATS           's'
+#define MSG_ACK             'a'
+
+#define MAX_LIST            16
+#define MAX_PACKET          (16 * 1024 * 1024 + 64)
+#define REPLY_TIMEOUT_MS    10000
+
+struct int_list
+{
+    int values[MAX_LIST];
+    int count;
+};
+
+struct bench_options
+{
+    const char *raspijpgs;
+    const char *output;
+    int duration_s;
+    int warmup_s;
+    struct int_list sizes;
+    struct int_list qualities;
+    struct int_list buffers;
+
+    // Soak mode
+    int soak_cycles;
+    long max_rss_growth_kb;
+};
+
+struct child
+{
+    pid_t pid;
+    int to_child;
+    int from_child;
+
+    char *packet;
+    uint32_t packet_len;
+};
+
+// What's measured over one run
+struct sample
+{
+    uint64_t elapsed_us;
+    uint64_t frames;
+    uint64_t cpu_ticks;
+    long rss_kb;
+};
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void parse_list(const char *str, struct int_list *list)
+{
+    list->count = 0;
+    char *copy = strdup(str);
+    char *saveptr;
+    char *token;
+    for (token = strtok_r(copy, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        if (list->count == MAX_LIST)
+            errx(EXIT_FAILURE, "Too many values in '%s'", str);
+        list->values[list->count++] = strtol(token, NULL, 0);
+    }
+    free(copy);
+    if (list->count == 0)
+        errx(EXIT_FAILURE, "Expecting a comma-separated list, got '%s'", str);
+}
+
+static void start_child(struct child *child, const char *path)
+{
+    int in[2];
+    int out[2];
+    if (pipe(in) < 0 || pipe(out) < 0)
+        err(EXIT_FAILURE, "pipe");
+
+    child->pid = fork();
+    if (child->pid < 0)
+        err(EXIT_FAILURE, "fork");
+
+    if (child->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl(path, path, (char *) NULL);
+        err(EXIT_FAILURE, "exec %s", path);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    child->to_child = in[1];
+    child->from_child = out[0];
+    child->packet = (char *) malloc(MAX_PACKET);
+    if (!child->packet)
+        err(EXIT_FAILURE, "malloc");
+}
+
+static void stop_child(struct child *child)
+{
+    // raspijpgs exits when stdin closes
+    close(child->to_child);
+    close(child->from_child);
+    int status;
+    if (waitpid(child->pid, &status, 0) < 0)
+        err(EXIT_FAILURE, "waitpid");
+    free(child->packet);
+}
+
+static void send_lines(struct child *child, const char *lines)
+{
+    uint32_t len = strlen(lines);
+    uint32_t len_be = htonl(len);
+    if (write(child->to_child, &len_be, sizeof(len_be)) != sizeof(len_be) ||
+            write(child->to_child, lines, len) != (ssize_t) len)
+        err(EXIT_FAILURE, "write to raspijpgs");
+}
+
+static bool read_fully(int fd, char *buf, size_t len)
+{
+    while (len) {
+        ssize_t amount = read(fd, buf, len);
+        if (amount < 0 && errno == EINTR)
+            continue;
+        if (amount <= 0)
+            return false;
+        buf += amount;
+        len -= amount;
+    }
+    return true;
+}
+
+// Returns 0 on timeout. raspijpgs exiting is fatal.
+static int read_packet(struct child *child, int timeout_ms)
+{
+    struct pollfd fd = {child->from_child, POLLIN, 0};
+    int rc = poll(&fd, 1, timeout_ms);
+    if (rc < 0)
+        err(EXIT_FAILURE, "poll");
+    if (rc == 0)
+        return 0;
+
+    uint32_t len_be;
+    if (!read_fully(child->from_child, (char *) &len_be, sizeof(len_be)))
+        errx(EXIT_FAILURE, "raspijpgs exited");
+    child->packet_len = ntohl(len_be);
+    if (child->packet_len >= MAX_PACKET)
+        errx(EXIT_FAILURE, "Packet of %u bytes from raspijpgs. Out of sync?", child->packet_len);
+    if (!read_fully(child->from_child, child->packet, child->packet_len))
+        errx(EXIT_FAILURE, "raspijpgs exited");
+    child->packet[child->packet_len] = '\0';
+    return 1;
+}
+
+static bool is_message(const struct child *child, char type)
+{
+    return child->packet_len >= 2 &&
+           (unsigned char) child->packet[0] == MSG_MARKER &&
+           child->packet[1] == type;
+}
+
+// Camera 0's main stream frames are plain JPEGs
+static bool is_main_frame(const struct child *child)
+{
+    return child->packet_len >= 2 &&
+           (unsigned char) child->packet[0] == 0xff &&
+           (unsigned char) child->packet[1] == 0xd8;
+}
+
+// Frames that arrive while waiting are counted
+static const char *wait_for_message(struct child *child, char type, uint64_t *frames)
+{
+    uint64_t deadline = monotonic_us() + REPLY_TIMEOUT_MS * 1000ULL;
+    while (monotonic_us() < deadline) {
+        if (!read_packet(child, REPLY_TIMEOUT_MS))
+            break;
+        if (is_message(child, type))
+            return child->packet + 2;
+        if (frames && is_main_frame(child))
+            (*frames)++;
+    }
+    errx(EXIT_FAILURE, "No reply from raspijpgs");
+}
+
+static uint64_t count_frames(struct child *child, uint64_t duration_us)
+{
+    uint64_t frames = 0;
+    uint64_t end = monotonic_us() + duration_us;
+    uint64_t now;
+    while ((now = monotonic_us()) < end) {
+        int timeout_ms = (end - now + 999) / 1000;
+        if (read_packet(child, timeout_ms) && is_main_frame(child))
+            frames++;
+    }
+    return frames;
+}
+
+static long stat_value(const char *report, const char *key)
+{
+    size_t key_len = strlen(key);
+    const char *line = report;
+    while (line && *line) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == '=')
+            return strtol(line + key_len + 1, NULL, 10);
+        line = strchr(line, '\n');
+        if (line)
+            line++;
+    }
+    return 0;
+}
+
+static uint64_t process_cpu_ticks(pid_t pid)
+{
+    char path[64];
+    sprintf(path, "/proc/%d/stat", (int) pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        err(EXIT_FAILURE, "%s", path);
+
+    char line[1024];
+    if (!fgets(line, sizeof(line), fp))
+        errx(EXIT_FAILURE, "Can't read %s", path);
+    fclose(fp);
+
+    // utime and stime are the 12th and 13th fields after the command name,
+    // which can have spaces, so start after its closing paren.
+    const char *p = strrchr(line, ')');
+    unsigned long long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        errx(EXIT_FAILURE, "Can't parse %s", path);
+    return utime + stime;
+}
+
+static long process_rss_kb(pid_t pid)
+{
+    char path[64];
+    sprintf(path, "/proc/%d/status", (int) pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        err(EXIT_FAILURE, "%s", path);
+
+    char line[256];
+    long rss = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+            break;
+    }
+    fclose(fp);
+    return rss;
+}
+
+static int process_fd_count(pid_t pid)
+{
+    char path[64];
+    sprintf(path, "/proc/%d/fd", (int) pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+        err(EXIT_FAILURE, "%s", path);
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] != '.')
+            count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+static void configure(struct child *child, int size, int quality, int buffers)
+{
+    char lines[256];
+    sprintf(lines, "size=%d,0\nquality=%d\nbuffers=%d\nack\n", size, quality, buffers);
+    send_lines(child, lines);
+
+    const char *ack = wait_for_message(child, MSG_ACK, NULL);
+    if (stat_value(ack, "unknown"))
+        errx(EXIT_FAILURE, "raspijpgs didn't take: %s", ack);
+}
+
+static void run_one(FILE *out, struct child *child, const struct bench_options *options,
+                    int size, int quality, int buffers)
+{
+    configure(child, size, quality, buffers);
+    count_frames(child, options->warmup_s * 1000000ULL);
+
+    // The first report starts the counters from here
+    send_lines(child, "stats\n");
+    wait_for_message(child, MSG_STATS, NULL);
+    long dropped_before = stat_value(child->packet + 2, "frames_dropped") +
+                          stat_value(child->packet + 2, "stdout_frames_dropped");
+
+    struct sample sample;
+    uint64_t start = monotonic_us();
+    uint64_t ticks_before = process_cpu_ticks(child->pid);
+    sample.frames = count_frames(child, options->duration_s * 1000000ULL);
+
+    send_lines(child, "stats\n");
+    const char *report = wait_for_message(child, MSG_STATS, &sample.frames);
+    sample.elapsed_us = monotonic_us() - start;
+    sample.cpu_ticks = process_cpu_ticks(child->pid) - ticks_before;
+    sample.rss_kb = process_rss_kb(child->pid);
+
+    long dropped = stat_value(report, "frames_dropped") + stat_value(report, "stdout_frames_dropped") - dropped_before;
+    double fps = sample.frames * 1000000.0 / sample.elapsed_us;
+    double cpu_us_per_frame = sample.frames ?
+                              sample.cpu_ticks * 1000000.0 / sysconf(_SC_CLK_TCK) / sample.frames : 0;
+
+    fprintf(out, "{\"size\":%d,\"quality\":%d,\"buffers\":%d,"
+                 "\"frames\":%llu,\"fps\":%.2f,"
+                 "\"latency_p50_us\":%ld,\"latency_p99_us\":%ld,\"latency_max_us\":%ld,"
+                 "\"write_p99_us\":%ld,\"cpu_us_per_frame\":%.1f,\"rss_kb\":%ld,"
+                 "\"frames_dropped\":%ld,\"frames_oversized\":%ld,\"pool_starvations\":%ld,"
+                 "\"peak_frame_size\":%ld}\n",
+            size, quality, buffers,
+            (unsigned long long) sample.frames, fps,
+            stat_value(report, "callback_latency_p50_us"),
+            stat_value(report, "callback_latency_p99_us"),
+            stat_value(report, "callback_latency_max_us"),
+            stat_value(report, "write_p99_us"),
+            cpu_us_per_frame, sample.rss_kb,
+            dropped > 0 ? dropped : 0,
+            stat_value(report, "frames_oversized"),
+            stat_value(report, "pool_starvations"),
+            stat_value(report, "peak_frame_size"));
+    fflush(out);
+}
+
+static int bench(FILE *out, const struct bench_options *options)
+{
+    struct child child;
+    start_child(&child, options->raspijpgs);
+
+    int s, q, b;
+    for (s = 0; s < options->sizes.count; s++)
+        for (q = 0; q < options->qualities.count; q++)
+            for (b = 0; b < options->buffers.count; b++)
+                run_one(out, &child, options,
+                        options->sizes.values[s],
+                        options->qualities.values[q],
+                        options->buffers.values[b]);
+
+    stop_child(&child);
+    return EXIT_SUCCESS;
+}
+
+static int soak(FILE *out, const struct bench_options *options)
+{
+    struct child child;
+    start_child(&child, options->raspijpgs);
+
+    // Settle at the first size so that the baseline includes everything
+    // that's only allocated once.
+    int size = options->sizes.values[0];
+    configure(&child, size, options->qualities.values[0], options->buffers.values[0]);
+    count_frames(&child, options->warmup_s * 1000000ULL);
+    long rss_start = process_rss_kb(child.pid);
+    int fds_start = process_fd_count(child.pid);
+
+    // Resizing the main stream is done in place, but adding or removing a
+    // scaled stream goes through stop_all and start_all. The ack comes
+    // after the rebuild, so the next frame shows the new pipeline ran.
+    int cycle;
+    uint64_t frames = 0;
+    long rss = rss_start;
+    int fds = fds_start;
+    for (cycle = 1; cycle <= options->soak_cycles; cycle++) {
+        char lines[64];
+        if (cycle % 2)
+            sprintf(lines, "streams=%d,0\nack\n", size / 2);
+        else
+            strcpy(lines, "streams=\nack\n");
+        send_lines(&child, lines);
+        const char *ack = wait_for_message(&child, MSG_ACK, NULL);
+        if (stat_value(ack, "rebuilds") != 1)
+            errx(EXIT_FAILURE, "The pipeline wasn't rebuilt on cycle %d: %s", cycle, ack);
+
+        uint64_t before = frames;
+        uint64_t deadline = monotonic_us() + REPLY_TIMEOUT_MS * 1000ULL;
+        while (frames == before) {
+            if (monotonic_us() > deadline)
+                errx(EXIT_FAILURE, "No frames after rebuilding on cycle %d", cycle);
+            if (read_packet(&child, REPLY_TIMEOUT_MS) && is_main_frame(&child))
+                frames++;
+        }
+
+        rss = process_rss_kb(child.pid);
+        fds = process_fd_count(child.pid);
+        if (cycle % 100 == 0 || cycle == options->soak_cycles) {
+            fprintf(out, "{\"cycle\":%d,\"rss_kb\":%ld,\"rss_growth_kb\":%ld,\"fds\":%d}\n",
+                    cycle, rss, rss - rss_start, fds);
+            fflush(out);
+        }
+    }
+
+    stop_child(&child);
+
+    bool leaked = rss - rss_start > options->max_rss_growth_kb || fds > fds_start;
+    fprintf(out, "{\"cycles\":%d,\"rss_start_kb\":%ld,\"rss_end_kb\":%ld,\"fds_start\":%d,\"fds_end\":%d,\"passed\":%s}\n",
+            options->soak_cycles, rss_start, rss, fds_start, fds, leaked ? "false" : "true");
+    return leaked ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void usage()
+{
+    fprintf(stderr, "picam_bench [options]\n");
+    fprintf(stderr, "  --raspijpgs <path>       raspijpgs to run (default ./raspijpgs)\n");
+    fprintf(stderr, "  --output <path>          write the report here instead of stdout\n");
+    fprintf(stderr, "  --duration <s>           seconds to measure each combination (default 10)\n");
+    fprintf(stderr, "  --warmup <s>             seconds to let each one settle first (default 2)\n");
+    fprintf(stderr, "  --sizes <w,...>          main stream widths (default 320,640,1280,1920)\n");
+    fprintf(stderr, "  --qualities <q,...>      JPEG qualities (default 15,50,90)\n");
+    fprintf(stderr, "  --buffers <n,...>        encoder buffers (default 0,3,8)\n");
+    fprintf(stderr, "  --soak <cycles>          rebuild this many times instead and check for leaks\n");
+    fprintf(stderr, "  --max-rss-growth <KiB>   how much RSS can grow in a soak (default 1024)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options options;
+    memset(&options, 0, sizeof(options));
+    options.raspijpgs = "./raspijpgs";
+    options.duration_s = 10;
+    options.warmup_s = 2;
+    options.max_rss_growth_kb = 1024;
+    parse_list("320,640,1280,1920", &options.sizes);
+    parse_list("15,50,90", &options.qualities);
+    parse_list("0,3,8", &options.buffers);
+
+    static const struct option long_options[] = {
+        {"raspijpgs",      required_argument, 0, 'r'},
+        {"output",         required_argument, 0, 'o'},
+        {"duration",       required_argument, 0, 'd'},
+        {"warmup",         required_argument, 0, 'w'},
+        {"sizes",          required_argument, 0, 's'},
+        {"qualities",      required_argument, 0, 'q'},
+        {"buffers",        required_argument, 0, 'b'},
+        {"soak",           required_argument, 0, 'k'},
+        {"max-rss-growth", required_argument, 0, 'g'},
+        {"help",           no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'r': options.raspijpgs = optarg; break;
+        case 'o': options.output = optarg; break;
+        case 'd': options.duration_s = atoi(optarg); break;
+        case 'w': options.warmup_s = atoi(optarg); break;
+        case 's': parse_list(optarg, &options.sizes); break;
+        case 'q': parse_list(optarg, &options.qualities); break;
+        case 'b': parse_list(optarg, &options.buffers); break;
+        case 'k': options.soak_cycles = atoi(optarg); break;
+        case 'g': options.max_rss_growth_kb = atol(optarg); break;
+        case 'h':
+            usage();
+            exit(EXIT_SUCCESS);
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.duration_s <= 0)
+        errx(EXIT_FAILURE, "--duration must be at least 1 second");
+
+    FILE *out = stdout;
+    if (options.output) {
+        out = fopen(options.output, "w");
+        if (!out)
+            err(EXIT_FAILURE, "%s", options.output);
+    }
+
+    // raspijpgs exiting shows up as a short read instead
+    signal(SIGPIPE, SIG_IGN);
+
+    int rc = options.soak_cycles > 0 ? soak(out, &options) : bench(out, &options);
+    if (out != stdout)
+        fclose(out);
+    return rc;
+}
@@ -1,3 +1,6 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include "bcm_host.h"
@@ -12,39 +15,164 @@
 
 #include "picam_camera.h"
 
+static uint32_t rational_to_q16(MMAL_RATIONAL_T r)
+{
+    if (r.den <= 0 || r.num <= 0)
+        return 0;
+    return (uint32_t) (((uint64_t) r.num << 16) / r.den);
+}
+
+static void update_settings(CAMERA_SETTINGS_T *settings, const MMAL_PARAMETER_CAMERA_SETTINGS_T *reported)
+{
+    __atomic_store_n(&settings->exposure, reported->exposure, __ATOMIC_RELAXED);
+    __atomic_store_n(&settings->analog_gain, rational_to_q16(reported->analog_gain), __ATOMIC_RELAXED);
+    __atomic_store_n(&settings->digital_gain, rational_to_q16(reported->digital_gain), __ATOMIC_RELAXED);
+    __atomic_store_n(&settings->awb_red_gain, rational_to_q16(reported->awb_red_gain), __ATOMIC_RELAXED);
+    __atomic_store_n(&settings->awb_blue_gain, rational_to_q16(reported->awb_blue_gain), __ATOMIC_RELAXED);
+}
+
 static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
-    // This is called from another thread. Don't access any data here.
+    // This is called from another thread. Only touch the settings, and only
+    // atomically.
     if (buffer->cmd == MMAL_EVENT_ERROR)
         errx(EXIT_FAILURE, "No data received from sensor. Check all connections, including the Sunny one on the camera board");
     else if(buffer->cmd != MMAL_EVENT_PARAMETER_CHANGED)
         errx(EXIT_FAILURE, "Camera sent invalid data: 0x%08x", buffer->cmd);
 
+    MMAL_EVENT_PARAMETER_CHANGED_T *param = (MMAL_EVENT_PARAMETER_CHANGED_T *) buffer->data;
+    if (param->hdr.id == MMAL_PARAMETER_CAMERA_SETTINGS && port->userdata)
+        update_settings((CAMERA_SETTINGS_T *) port->userdata, (MMAL_PARAMETER_CAMERA_SETTINGS_T *) param);
+
     mmal_buffer_header_release(buffer);
 }
 
-void picam_camera_init(MMAL_COMPONENT_T *camera, uint32_t max_width, uint32_t max_height)
+void picam_camera_get_settings(const CAMERA_SETTINGS_T *settings, CAMERA_SETTINGS_T *copy)
+{
+    // The fields may come from different reports, but they're only ever a
+    // frame or so apart.
+    copy->exposure = __atomic_load_n(&settings->exposure, __ATOMIC_RELAXED);
+    copy->analog_gain = __atomic_load_n(&settings->analog_gain, __ATOMIC_RELAXED);
+    copy->digital_gain = __atomic_load_n(&settings->digital_gain, __ATOMIC_RELAXED);
+    copy->awb_red_gain = __atomic_load_n(&settings->awb_red_gain, __ATOMIC_RELAXED);
+    copy->awb_blue_gain = __atomic_load_n(&settings->awb_blue_gain, __ATOMIC_RELAXED);
+}
+
+void picam_camera_init(MMAL_COMPONENT_T *camera, int camera_num, uint32_t max_width, uint32_t max_height, uint32_t num_frames, CAMERA_SETTINGS_T *settings)
 {
+    // Pick the sensor before anything else is configured
+    if (mmal_port_parameter_set_int32(camera->control, MMAL_PARAMETER_CAMERA_NUM, camera_num) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not select camera %d", camera_num);
+
+    camera->control->userdata = (struct MMAL_PORT_USERDATA_T *) settings;
     if (mmal_port_enable(camera->control, camera_control_callback) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not enable camera control port");
 
+    // Ask for the exposure and gains to be reported as they change
+    MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request = {
+        {MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(change_event_request)},
+        MMAL_PARAMETER_CAMERA_SETTINGS, 1
+    };
+    if (mmal_port_parameter_set(camera->control, &change_event_request.hdr) != MMAL_SUCCESS)
+        warnx("Camera settings change events not supported. Exposure metadata won't be available.");
+
     MMAL_PARAMETER_CAMERA_CONFIG_T cam_config = {
         {MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config)},
-        .max_stills_w = 0,
-        .max_stills_h = 0,
+        // Stills are always full resolution and taken one at a time
+        // without stopping the video port.
+        .max_stills_w = max_width,
+        .max_stills_h = max_height,
         .stills_yuv422 = 0,
-        .one_shot_stills = 0,
+        .one_shot_stills = 1,
         .max_preview_video_w = max_width,
         .max_preview_video_h = max_height,
-        .num_preview_video_frames = 3,
+        .num_preview_video_frames = num_frames,
         .stills_capture_circular_buffer_height = 0,
-        .fast_preview_resume = 0,
+        .fast_preview_resume = 1,
         .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
     };
     if (mmal_port_parameter_set(camera->control, &cam_config.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Error configuring camera");
 }
 
+static MMAL_RATIONAL_T q16_to_rational(uint32_t q16)
+{
+    MMAL_RATIONAL_T r = {(int32_t) q16, 65536};
+    return r;
+}
+
+void picam_camera_seed_settings(MMAL_COMPONENT_T *camera, const CAMERA_SETTINGS_T *seed)
+{
+    // These hold until picam_camera_release_seed(). Older firmware can't
+    // set the gains, and then AE just converges the slow way.
+    MMAL_PORT_T *control = camera->control;
+    if (seed->exposure)
+        mmal_port_parameter_set_uint32(control, MMAL_PARAMETER_SHUTTER_SPEED, seed->exposure);
+    if (seed->analog_gain)
+        mmal_port_parameter_set_rational(control, MMAL_PARAMETER_ANALOG_GAIN, q16_to_rational(seed->analog_gain));
+    if (seed->digital_gain)
+        mmal_port_parameter_set_rational(control, MMAL_PARAMETER_DIGITAL_GAIN, q16_to_rational(seed->digital_gain));
+
+    // Custom AWB gains only take effect with AWB off
+    if (seed->awb_red_gain && seed->awb_blue_gain) {
+        MMAL_PARAMETER_AWBMODE_T awb_mode = {{MMAL_PARAMETER_AWB_MODE, sizeof(awb_mode)}, MMAL_PARAM_AWBMODE_OFF};
+        MMAL_PARAMETER_AWB_GAINS_T awb_gains = {
+            {MMAL_PARAMETER_CUSTOM_AWB_GAINS, sizeof(awb_gains)},
+            q16_to_rational(seed->awb_red_gain),
+            q16_to_rational(seed->awb_blue_gain)
+        };
+        if (mmal_port_parameter_set(control, &awb_mode.hdr) == MMAL_SUCCESS)
+            mmal_port_parameter_set(control, &awb_gains.hdr);
+    }
+}
+
+void picam_camera_release_seed(MMAL_COMPONENT_T *camera)
+{
+    // A gain of 0 hands it back to AE, which carries on from the seeded
+    // value. The shutter speed and AWB mode are up to the caller to restore.
+    MMAL_RATIONAL_T automatic = {0, 65536};
+    mmal_port_parameter_set_rational(camera->control, MMAL_PARAMETER_ANALOG_GAIN, automatic);
+    mmal_port_parameter_set_rational(camera->control, MMAL_PARAMETER_DIGITAL_GAIN, automatic);
+}
+
+bool picam_camera_load_settings(const char *path, CAMERA_SETTINGS_T *settings)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    bool ok = fscanf(fp, "%u %u %u %u %u",
+                     &settings->exposure,
+                     &settings->analog_gain,
+                     &settings->digital_gain,
+                     &settings->awb_red_gain,
+                     &settings->awb_blue_gain) == 5;
+    fclose(fp);
+    return ok;
+}
+
+void picam_camera_save_settings(const char *path, const CAMERA_SETTINGS_T *settings)
+{
+    // Write a new file and rename it over the old one so that a crash
+    // never leaves half of one behind.
+    char tmp_path[strlen(path) + 5];
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        warn("Could not save camera settings to %s", tmp_path);
+        return;
+    }
+    fprintf(fp, "%u %u %u %u %u\n",
+            settings->exposure,
+            settings->analog_gain,
+            settings->digital_gain,
+            settings->awb_red_gain,
+            settings->awb_blue_gain);
+    if (fclose(fp) != 0 || rename(tmp_path, path) < 0)
+        warn("Could not save camera settings to %s", path);
+}
+
 void picam_camera_configure_format(MMAL_COMPONENT_T *camera, uint32_t width, uint32_t height, uint32_t fps256)
 {
     MMAL_ES_FORMAT_T *format;
@@ -80,3 +208,34 @@ void picam_camera_configure_format(MMAL_COMPONENT_T *camera, uint32_t width, uin
     if (mmal_port_parameter_set_boolean(camera->output[CAMERA_PORT_VIDEO], MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not enable video capture");
 }
+
+void picam_camera_configure_still_format(MMAL_COMPONENT_T *camera, uint32_t width, uint32_t height)
+{
+    MMAL_ES_FORMAT_T *format = camera->output[CAMERA_PORT_STILL]->format;
+    format->encoding = MMAL_ENCODING_OPAQUE;
+    format->encoding_variant = MMAL_ENCODING_I420;
+    format->es->video.width = VCOS_ALIGN_UP(width, 32);
+    format->es->video.height = VCOS_ALIGN_UP(height, 16);
+    format->es->video.crop.x = 0;
+    format->es->video.crop.y = 0;
+    format->es->video.crop.width = width;
+    format->es->video.crop.height = height;
+    format->es->video.frame_rate.num = 0;
+    format->es->video.frame_rate.den = 1;
+    if (mmal_port_format_commit(camera->output[CAMERA_PORT_STILL]) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set still format");
+}
+
+bool picam_camera_set_annotation(MMAL_COMPONENT_T *camera, const char *text, bool background)
+{
+    MMAL_PARAMETER_CAMERA_ANNOTATE_V3_T annotate;
+    memset(&annotate, 0, sizeof(annotate));
+    annotate.hdr.id = MMAL_PARAMETER_ANNOTATE;
+    annotate.hdr.size = sizeof(annotate);
+
+    // Empty text turns the overlay off
+    annotate.enable = (*text != '\0');
+    annotate.enable_text_background = background;
+    strncpy(annotate.text, text, MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3 - 1);
+    return mmal_port_parameter_set(camera->control, &annotate.hdr) == MMAL_SUCCESS;
+}
@@ -5,7 +5,33 @@
 #define CAMERA_PORT_VIDEO   1
 #define CAMERA_PORT_STILL   2
 
-void picam_camera_init(MMAL_COMPONENT_T *camera, uint32_t max_width, uint32_t max_height);
+// The most recent exposure settings reported by the camera. These are
+// updated from an MMAL thread, so read them with picam_camera_get_settings().
+// Gains are unsigned 16.16 fixed point. Everything is 0 until the camera
+// reports in.
+typedef struct
+{
+    uint32_t exposure; // microseconds
+    uint32_t analog_gain;
+    uint32_t digital_gain;
+    uint32_t awb_red_gain;
+    uint32_t awb_blue_gain;
+} CAMERA_SETTINGS_T;
+
+void picam_camera_init(MMAL_COMPONENT_T *camera, int camera_num, uint32_t max_width, uint32_t max_height, uint32_t num_frames, CAMERA_SETTINGS_T *settings);
+void picam_camera_get_settings(const CAMERA_SETTINGS_T *settings, CAMERA_SETTINGS_T *copy);
 void picam_camera_configure_format(MMAL_COMPONENT_T *camera, uint32_t width, uint32_t height, uint32_t fps256);
+void picam_camera_configure_still_format(MMAL_COMPONENT_T *camera, uint32_t width, uint32_t height);
+
+// Fast start. Settings saved from a previous run fix the camera's exposure,
+// gains and white balance until the first frames are out.
+void picam_camera_seed_settings(MMAL_COMPONENT_T *camera, const CAMERA_SETTINGS_T *seed);
+void picam_camera_release_seed(MMAL_COMPONENT_T *camera);
+bool picam_camera_load_settings(const char *path, CAMERA_SETTINGS_T *settings);
+void picam_camera_save_settings(const char *path, const CAMERA_SETTINGS_T *settings);
+
+// Text drawn over every frame by the firmware. Returns false if the
+// camera didn't take it.
+bool picam_camera_set_annotation(MMAL_COMPONENT_T *camera, const char *text, bool background);
 
 #endif
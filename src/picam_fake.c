@@ -0,0 +1,187 @@
+#include <dirent.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/stat.h>
+
+#include "picam_fake.h"
+
+static bool is_sof(uint8_t marker)
+{
+    return marker >= 0xc0 && marker <= 0xcf &&
+           marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+// Returns the length of the JPEG at p by walking its markers, or 0 if it
+// isn't a complete one. Looking for the first EOI isn't enough because
+// EXIF thumbnails have their own.
+static size_t jpeg_length(const uint8_t *p, size_t size, int *width, int *height)
+{
+    if (size < 4 || p[0] != 0xff || p[1] != 0xd8)
+        return 0;
+
+    size_t i = 2;
+    for (;;) {
+        if (i >= size || p[i] != 0xff)
+            return 0;
+        while (i < size && p[i] == 0xff)
+            i++;
+        if (i >= size)
+            return 0;
+
+        uint8_t marker = p[i++];
+        if (marker == 0xd9)
+            return i;
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+            continue;
+
+        if (i + 2 > size)
+            return 0;
+        size_t segment_len = (p[i] << 8) | p[i + 1];
+        if (segment_len < 2 || i + segment_len > size)
+            return 0;
+        if (is_sof(marker) && segment_len >= 7 && *width == 0) {
+            *height = (p[i + 3] << 8) | p[i + 4];
+            *width = (p[i + 5] << 8) | p[i + 6];
+        }
+        i += segment_len;
+
+        // Entropy-coded data runs until a marker that isn't byte stuffing
+        // or a restart marker.
+        if (marker == 0xda) {
+            while (i + 1 < size &&
+                    !(p[i] == 0xff && p[i + 1] != 0 && !(p[i + 1] >= 0xd0 && p[i + 1] <= 0xd7)))
+                i++;
+            if (i + 1 >= size)
+                return 0;
+        }
+    }
+}
+
+static void add_frame(FAKE_CLIP_T *clip, size_t offset, size_t len)
+{
+    if ((clip->count & (clip->count - 1)) == 0) {
+        int new_size = clip->count ? clip->count * 2 : 64;
+        clip->frames = (struct fake_frame *) realloc(clip->frames, new_size * sizeof(struct fake_frame));
+        if (!clip->frames)
+            err(EXIT_FAILURE, "realloc");
+    }
+    clip->frames[clip->count].offset = offset;
+    clip->frames[clip->count].len = len;
+    clip->count++;
+}
+
+// Appends the file to the clip's data and returns where it starts
+static size_t append_file(FAKE_CLIP_T *clip, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        err(EXIT_FAILURE, "%s", path);
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0)
+        err(EXIT_FAILURE, "%s", path);
+
+    size_t offset = clip->size;
+    clip->data = (char *) realloc(clip->data, clip->size + st.st_size);
+    if (!clip->data)
+        err(EXIT_FAILURE, "realloc");
+    if (fread(clip->data + offset, 1, st.st_size, fp) != (size_t) st.st_size)
+        errx(EXIT_FAILURE, "Could not read %s", path);
+    fclose(fp);
+
+    clip->size += st.st_size;
+    return offset;
+}
+
+static void load_mjpeg(FAKE_CLIP_T *clip, const char *path)
+{
+    append_file(clip, path);
+
+    // Anything between the frames is skipped
+    const uint8_t *p = (const uint8_t *) clip->data;
+    size_t offset = 0;
+    while (offset + 1 < clip->size) {
+        if (p[offset] != 0xff || p[offset + 1] != 0xd8) {
+            offset++;
+            continue;
+        }
+        size_t len = jpeg_length(p + offset, clip->size - offset, &clip->width, &clip->height);
+        if (len == 0)
+            break;
+        add_frame(clip, offset, len);
+        offset += len;
+    }
+}
+
+static int jpeg_file_filter(const struct dirent *entry)
+{
+    const char *extension = strrchr(entry->d_name, '.');
+    return extension && (strcasecmp(extension, ".jpg") == 0 || strcasecmp(extension, ".jpeg") == 0);
+}
+
+static void load_directory(FAKE_CLIP_T *clip, const char *path)
+{
+    struct dirent **entries;
+    int count = scandir(path, &entries, jpeg_file_filter, alphasort);
+    if (count < 0)
+        err(EXIT_FAILURE, "%s", path);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        char file[4096];
+        snprintf(file, sizeof(file), "%s/%s", path, entries[i]->d_name);
+        free(entries[i]);
+
+        size_t offset = append_file(clip, file);
+        size_t len = jpeg_length((const uint8_t *) clip->data + offset, clip->size - offset, &clip->width, &clip->height);
+        if (len == 0)
+            errx(EXIT_FAILURE, "%s isn't a complete JPEG", file);
+        add_frame(clip, offset, len);
+    }
+    free(entries);
+}
+
+void picam_fake_open(FAKE_CLIP_T *clip, const char *path)
+{
+    memset(clip, 0, sizeof(*clip));
+    clip->last = -1;
+
+    struct stat st;
+    if (stat(path, &st) < 0)
+        err(EXIT_FAILURE, "%s", path);
+    if (S_ISDIR(st.st_mode))
+        load_directory(clip, path);
+    else
+        load_mjpeg(clip, path);
+
+    if (clip->count == 0)
+        errx(EXIT_FAILURE, "No JPEGs in %s", path);
+}
+
+void picam_fake_close(FAKE_CLIP_T *clip)
+{
+    free(clip->data);
+    free(clip->frames);
+    memset(clip, 0, sizeof(*clip));
+}
+
+const char *picam_fake_next(FAKE_CLIP_T *clip, size_t *len)
+{
+    clip->last = clip->next;
+    clip->next = (clip->next + 1) % clip->count;
+    return picam_fake_last(clip, len);
+}
+
+const char *picam_fake_last(const FAKE_CLIP_T *clip, size_t *len)
+{
+    const struct fake_frame *frame = &clip->frames[clip->last >= 0 ? clip->last : 0];
+    *len = frame->len;
+    return clip->data + frame->offset;
+}
@@ -0,0 +1,36 @@
+#ifndef PICAM_FAKE_H
+#define PICAM_FAKE_H
+
+// A recorded clip to play back instead of the camera. It's either a file of
+// concatenated JPEGs, like the recorder's .mjpeg segments, or a directory
+// of .jpg files played in name order. The whole clip is read into memory so
+// playback doesn't wait on the disk.
+struct fake_frame
+{
+    size_t offset;
+    size_t len;
+};
+
+typedef struct
+{
+    char *data;
+    size_t size;
+
+    struct fake_frame *frames;
+    int count;
+    int next;
+    int last; // the frame most recently returned, -1 before the first
+
+    // From the first frame
+    int width;
+    int height;
+} FAKE_CLIP_T;
+
+void picam_fake_open(FAKE_CLIP_T *clip, const char *path);
+void picam_fake_close(FAKE_CLIP_T *clip);
+
+// Frames loop forever
+const char *picam_fake_next(FAKE_CLIP_T *clip, size_t *len);
+const char *picam_fake_last(const FAKE_CLIP_T *clip, size_t *len);
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "picam_histogram.h"
+
+void picam_histogram_reset(HISTOGRAM_T *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void picam_histogram_add(HISTOGRAM_T *histogram, uint32_t value)
+{
+    int bucket = value ? 32 - __builtin_clz(value) : 0;
+    if (bucket >= PICAM_HISTOGRAM_BUCKETS)
+        bucket = PICAM_HISTOGRAM_BUCKETS - 1;
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+uint32_t picam_histogram_percentile(const HISTOGRAM_T *histogram, int percent)
+{
+    if (histogram->count == 0)
+        return 0;
+
+    // Report the top of the bucket that the percentile lands in. That's
+    // within a factor of 2, which is plenty to tell where time is going.
+    uint32_t threshold = ((uint64_t) histogram->count * percent + 99) / 100;
+    uint32_t seen = 0;
+    int i;
+    for (i = 0; i < PICAM_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= threshold)
+            break;
+    }
+
+    uint32_t upper = (1u << i) - 1;
+    return upper < histogram->max ? upper : histogram->max;
+}
+
+void picam_histogram_report(const HISTOGRAM_T *histogram, FILE *fp, const char *name)
+{
+    fprintf(fp, "%s_count=%u\n", name, histogram->count);
+    fprintf(fp, "%s_avg_us=%u\n", name,
+            histogram->count ? (uint32_t) (histogram->sum / histogram->count) : 0);
+    fprintf(fp, "%s_p50_us=%u\n", name, picam_histogram_percentile(histogram, 50));
+    fprintf(fp, "%s_p99_us=%u\n", name, picam_histogram_percentile(histogram, 99));
+    fprintf(fp, "%s_max_us=%u\n", name, histogram->max);
+}
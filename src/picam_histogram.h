@@ -0,0 +1,21 @@
+#ifndef PICAM_HISTOGRAM_H
+#define PICAM_HISTOGRAM_H
+
+// Log2 histogram of durations in microseconds. Bucket i counts values that
+// need i bits, so the last bucket catches everything over ~1 second.
+#define PICAM_HISTOGRAM_BUCKETS 21
+
+typedef struct
+{
+    uint32_t buckets[PICAM_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+} HISTOGRAM_T;
+
+void picam_histogram_reset(HISTOGRAM_T *histogram);
+void picam_histogram_add(HISTOGRAM_T *histogram, uint32_t value);
+uint32_t picam_histogram_percentile(const HISTOGRAM_T *histogram, int percent);
+void picam_histogram_report(const HISTOGRAM_T *histogram, FILE *fp, const char *name);
+
+#endif
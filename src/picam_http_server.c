@@ -0,0 +1,411 @@
+#define _GNU_SOURCE // for accept4()
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "picam_http_server.h"
+
+#define BOUNDARY "picamframe"
+
+// epoll data for the listening socket. Clients use their slot index.
+#define LISTEN_TAG PICAM_HTTP_SERVER_MAX_CLIENTS
+
+static const char response_header[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Server: raspijpgs\r\n"
+    "Connection: close\r\n"
+    "Cache-Control: no-cache, private\r\n"
+    "Pragma: no-cache\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n"
+    "\r\n";
+
+static const char not_found[] =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char part_footer[] = "\r\n";
+
+void picam_http_server_init(HTTP_SERVER_T *server)
+{
+    memset(server, 0, sizeof(*server));
+    server->epoll_fd = -1;
+    server->listen_fd = -1;
+
+    int i;
+    for (i = 0; i < PICAM_HTTP_SERVER_MAX_CLIENTS; i++)
+        server->clients[i].fd = -1;
+}
+
+static void watch(HTTP_SERVER_T *server, int op, int fd, uint32_t events, uint32_t tag)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = tag;
+    if (epoll_ctl(server->epoll_fd, op, fd, &ev) < 0)
+        err(EXIT_FAILURE, "epoll_ctl");
+}
+
+void picam_http_server_open(HTTP_SERVER_T *server, int port)
+{
+    if (port <= 0 || port > 65535)
+        errx(EXIT_FAILURE, "Invalid HTTP port: %d", port);
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0)
+        err(EXIT_FAILURE, "socket");
+
+    // Allow restarting right away while old connections are in TIME_WAIT
+    int on = 1;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err(EXIT_FAILURE, "Could not bind to HTTP port %d", port);
+
+    if (listen(server->listen_fd, PICAM_HTTP_SERVER_MAX_CLIENTS) < 0)
+        err(EXIT_FAILURE, "listen");
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd < 0)
+        err(EXIT_FAILURE, "epoll_create1");
+    watch(server, EPOLL_CTL_ADD, server->listen_fd, EPOLLIN, LISTEN_TAG);
+
+    server->port = port;
+}
+
+static void close_client(HTTP_SERVER_T *server, HTTP_CLIENT_T *client)
+{
+    // Closing the fd also takes it out of the epoll set.
+    close(client->fd);
+    free(client->pending);
+    memset(client, 0, sizeof(HTTP_CLIENT_T));
+    client->fd = -1;
+    server->client_count--;
+}
+
+void picam_http_server_close(HTTP_SERVER_T *server)
+{
+    int i;
+    for (i = 0; i < PICAM_HTTP_SERVER_MAX_CLIENTS; i++) {
+        if (server->clients[i].fd >= 0)
+            close_client(server, &server->clients[i]);
+    }
+
+    if (server->listen_fd >= 0)
+        close(server->listen_fd);
+    if (server->epoll_fd >= 0)
+        close(server->epoll_fd);
+
+    picam_http_server_init(server);
+}
+
+int picam_http_server_add_pollfds(HTTP_SERVER_T *server, struct pollfd *fds)
+{
+    if (server->epoll_fd < 0)
+        return 0;
+
+    fds[0].fd = server->epoll_fd;
+    fds[0].events = POLLIN;
+    return 1;
+}
+
+// Returns the oldest client that's still sending its request, or -1.
+static int oldest_requesting_client(HTTP_SERVER_T *server)
+{
+    int oldest = -1;
+    int i;
+    for (i = 0; i < PICAM_HTTP_SERVER_MAX_CLIENTS; i++) {
+        HTTP_CLIENT_T *client = &server->clients[i];
+        if (client->fd >= 0 && !client->streaming &&
+                (oldest < 0 || client->accepted_us < server->clients[oldest].accepted_us))
+            oldest = i;
+    }
+    return oldest;
+}
+
+static void accept_client(HTTP_SERVER_T *server, uint64_t now_us)
+{
+    int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            warn("accept");
+        return;
+    }
+
+    int i;
+    for (i = 0; i < PICAM_HTTP_SERVER_MAX_CLIENTS; i++) {
+        if (server->clients[i].fd < 0)
+            break;
+    }
+    if (i == PICAM_HTTP_SERVER_MAX_CLIENTS) {
+        // Clients that never finish their request shouldn't lock out
+        // everyone else.
+        i = oldest_requesting_client(server);
+        if (i < 0) {
+            warnx("Too many HTTP clients. Rejecting new one.");
+            close(fd);
+            return;
+        }
+        close_client(server, &server->clients[i]);
+    }
+
+    HTTP_CLIENT_T *client = &server->clients[i];
+    client->fd = fd;
+    client->accepted_us = now_us;
+    server->client_count++;
+    watch(server, EPOLL_CTL_ADD, fd, EPOLLIN, i);
+}
+
+static void queue_remainder(HTTP_CLIENT_T *client, const struct iovec *iovs, int count, size_t sent, size_t len)
+{
+    size_t remaining = len - sent;
+    if (remaining > client->pending_size) {
+        char *new_pending = (char *) realloc(client->pending, remaining);
+        if (!new_pending)
+            err(EXIT_FAILURE, "realloc");
+        client->pending = new_pending;
+        client->pending_size = remaining;
+    }
+
+    size_t skip = sent;
+    size_t offset = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        const char *base = (const char *) iovs[i].iov_base;
+        size_t iov_len = iovs[i].iov_len;
+        if (skip >= iov_len) {
+            skip -= iov_len;
+            continue;
+        }
+        memcpy(client->pending + offset, base + skip, iov_len - skip);
+        offset += iov_len - skip;
+        skip = 0;
+    }
+
+    client->pending_len = remaining;
+    client->pending_offset = 0;
+}
+
+// Returns false if the client should be dropped.
+static bool write_client(HTTP_SERVER_T *server, int ix, const struct iovec *iovs, int count, size_t len)
+{
+    HTTP_CLIENT_T *client = &server->clients[ix];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iovs; // silence warning
+    msg.msg_iovlen = count;
+
+    ssize_t amount = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (amount < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            return false;
+        amount = 0;
+    }
+
+    if ((size_t) amount < len) {
+        queue_remainder(client, iovs, count, amount, len);
+        watch(server, EPOLL_CTL_MOD, client->fd, EPOLLIN | EPOLLOUT, ix);
+    }
+    return true;
+}
+
+static bool flush_client(HTTP_SERVER_T *server, int ix)
+{
+    HTTP_CLIENT_T *client = &server->clients[ix];
+    ssize_t amount = send(client->fd,
+                          client->pending + client->pending_offset,
+                          client->pending_len - client->pending_offset,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (amount < 0)
+        return errno == EAGAIN || errno == EINTR;
+
+    client->pending_offset += amount;
+    if (client->pending_offset == client->pending_len) {
+        client->pending_len = 0;
+        client->pending_offset = 0;
+        watch(server, EPOLL_CTL_MOD, client->fd, EPOLLIN, ix);
+    }
+    return true;
+}
+
+// Parses "/n" where n is 0 to 15 and only digits.
+static bool parse_index(const char **path, int *value)
+{
+    const char *p = *path;
+    if (*p++ != '/' || *p < '0' || *p > '9')
+        return false;
+
+    *value = 0;
+    while (*p >= '0' && *p <= '9') {
+        *value = *value * 10 + (*p++ - '0');
+        if (*value >= 16)
+            return false;
+    }
+    *path = p;
+    return true;
+}
+
+// Any path other than /, /camera or /camera/stream gets a 404.
+static bool parse_path(HTTP_CLIENT_T *client)
+{
+    char path[64];
+    if (sscanf(client->request, "GET %63s", path) != 1)
+        return false;
+
+    client->camera = 0;
+    client->stream = 0;
+    if (strcmp(path, "/") == 0)
+        return true;
+
+    const char *p = path;
+    if (!parse_index(&p, &client->camera))
+        return false;
+    if (*p && !parse_index(&p, &client->stream))
+        return false;
+    return *p == '\0';
+}
+
+// Returns false if the client should be dropped.
+static bool read_request(HTTP_SERVER_T *server, int ix)
+{
+    HTTP_CLIENT_T *client = &server->clients[ix];
+    char discard[64];
+    char *buffer = client->streaming ? discard : client->request + client->request_len;
+    size_t size = client->streaming ? sizeof(discard) : sizeof(client->request) - client->request_len - 1;
+
+    ssize_t amount = recv(client->fd, buffer, size, MSG_DONTWAIT);
+    if (amount < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (amount == 0)
+        return false;
+
+    // Streaming clients don't send anything that matters.
+    if (client->streaming)
+        return true;
+
+    client->request_len += amount;
+    client->request[client->request_len] = '\0';
+    if (!strstr(client->request, "\r\n\r\n"))
+        return client->request_len < sizeof(client->request) - 1;
+
+    if (!parse_path(client)) {
+        send(client->fd, not_found, sizeof(not_found) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return false;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (char *) response_header; // silence warning
+    iov.iov_len = sizeof(response_header) - 1;
+    client->streaming = true;
+    return write_client(server, ix, &iov, 1, iov.iov_len);
+}
+
+void picam_http_server_service(HTTP_SERVER_T *server, const struct pollfd *fds, uint64_t now_us)
+{
+    if (server->epoll_fd < 0)
+        return;
+
+    int i;
+    for (i = 0; i < PICAM_HTTP_SERVER_MAX_CLIENTS && server->client_count; i++) {
+        HTTP_CLIENT_T *client = &server->clients[i];
+        if (client->fd >= 0 && !client->streaming &&
+                now_us - client->accepted_us > PICAM_HTTP_REQUEST_TIMEOUT_US)
+            close_client(server, client);
+    }
+
+    if (!(fds[0].revents & POLLIN))
+        return;
+
+    struct epoll_event events[PICAM_HTTP_SERVER_MAX_CLIENTS + 1];
+    int ready = epoll_wait(server->epoll_fd, events, PICAM_HTTP_SERVER_MAX_CLIENTS + 1, 0);
+    if (ready < 0) {
+        if (errno != EINTR)
+            err(EXIT_FAILURE, "epoll_wait");
+        return;
+    }
+
+    // Accepting can evict a client, so it waits until the events for the
+    // slots have been handled.
+    bool accepting = false;
+    for (i = 0; i < ready; i++) {
+        uint32_t tag = events[i].data.u32;
+        if (tag == LISTEN_TAG) {
+            accepting = true;
+            continue;
+        }
+
+        HTTP_CLIENT_T *client = &server->clients[tag];
+        uint32_t revents = events[i].events;
+        bool ok = client->fd >= 0;
+        if (ok && (revents & (EPOLLERR | EPOLLHUP)))
+            ok = false;
+        if (ok && (revents & EPOLLIN))
+            ok = read_request(server, tag);
+        if (ok && (revents & EPOLLOUT) && client->pending_len)
+            ok = flush_client(server, tag);
+
+        if (!ok && client->fd >= 0)
+            close_client(server, client);
+    }
+
+    if (accepting)
+        accept_client(server, now_us);
+}
+
+void picam_http_server_send(HTTP_SERVER_T *server, int camera, int stream, const struct iovec *fragments, int count, size_t len)
+{
+    if (server->client_count == 0)
+        return;
+    if (count > PICAM_HTTP_MAX_FRAGMENTS)
+        errx(EXIT_FAILURE, "Too many fragments for an HTTP frame");
+
+    // The part header is built once per frame and shared by every client.
+    char part_header[128];
+    int header_len = snprintf(part_header, sizeof(part_header),
+                              "--" BOUNDARY "\r\n"
+                              "Content-Type: image/jpeg\r\n"
+                              "Content-Length: %zu\r\n"
+                              "\r\n", len);
+
+    struct iovec iovs[PICAM_HTTP_MAX_FRAGMENTS + 2];
+    iovs[0].iov_base = part_header;
+    iovs[0].iov_len = header_len;
+    memcpy(&iovs[1], fragments, count * sizeof(struct iovec));
+    iovs[count + 1].iov_base = (char *) part_footer; // silence warning
+    iovs[count + 1].iov_len = sizeof(part_footer) - 1;
+    size_t total = header_len + len + iovs[count + 1].iov_len;
+
+    int i;
+    for (i = 0; i < PICAM_HTTP_SERVER_MAX_CLIENTS; i++) {
+        HTTP_CLIENT_T *client = &server->clients[i];
+        if (client->fd < 0 || !client->streaming ||
+                client->camera != camera || client->stream != stream)
+            continue;
+
+        // Slow readers skip frames rather than holding up the encoder.
+        if (client->pending_len) {
+            server->frames_dropped++;
+            continue;
+        }
+
+        if (!write_client(server, i, iovs, count + 2, total))
+            close_client(server, client);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef PICAM_HTTP_SERVER_H
+#define PICAM_HTTP_SERVER_H
+
+#define PICAM_HTTP_SERVER_MAX_CLIENTS  64
+#define PICAM_HTTP_REQUEST_MAX         1024
+#define PICAM_HTTP_MAX_FRAGMENTS       16
+#define PICAM_HTTP_REQUEST_TIMEOUT_US  5000000
+
+// Clients GET /[camera[/stream]] and receive that stream's JPEGs as a
+// multipart/x-mixed-replace response, so browsers can show it directly.
+// Like the socket server, a client that can't take a whole frame gets the
+// rest queued here and skips frames until it drains. Clients that haven't
+// sent a whole request within PICAM_HTTP_REQUEST_TIMEOUT_US are dropped,
+// and so is the oldest of them when a new client needs its slot.
+typedef struct
+{
+    int fd; // -1 when the slot is free
+    bool streaming;
+    uint64_t accepted_us;
+    int camera;
+    int stream;
+
+    char request[PICAM_HTTP_REQUEST_MAX];
+    size_t request_len;
+
+    char *pending;
+    size_t pending_len;
+    size_t pending_offset;
+    size_t pending_size;
+} HTTP_CLIENT_T;
+
+// The listening socket and clients are watched by an epoll instance. Only
+// its fd goes into the main loop's poll set.
+typedef struct
+{
+    int epoll_fd;
+    int listen_fd;
+    int port;
+    HTTP_CLIENT_T clients[PICAM_HTTP_SERVER_MAX_CLIENTS];
+    int client_count;
+    unsigned long frames_dropped;
+} HTTP_SERVER_T;
+
+void picam_http_server_init(HTTP_SERVER_T *server);
+void picam_http_server_open(HTTP_SERVER_T *server, int port);
+void picam_http_server_close(HTTP_SERVER_T *server);
+int picam_http_server_add_pollfds(HTTP_SERVER_T *server, struct pollfd *fds);
+void picam_http_server_service(HTTP_SERVER_T *server, const struct pollfd *fds, uint64_t now_us);
+void picam_http_server_send(HTTP_SERVER_T *server, int camera, int stream, const struct iovec *fragments, int count, size_t len);
+
+#endif
@@ -0,0 +1,92 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "picam_motion.h"
+
+static void mark_active(MOTION_RESULT_T *result, int column, int row, int columns, int rows)
+{
+    result->active++;
+    if (column < result->left)
+        result->left = column;
+    if (column > result->right)
+        result->right = column;
+    if (row < result->top)
+        result->top = row;
+    if (row > result->bottom)
+        result->bottom = row;
+
+    int cell = (row * PICAM_MOTION_GRID / rows) * PICAM_MOTION_GRID + column * PICAM_MOTION_GRID / columns;
+    result->grid |= (uint64_t) 1 << cell;
+}
+
+static void analyze_row(const MOTION_VECTOR_T *row_vectors, int row, int columns, int rows, uint32_t threshold2, MOTION_RESULT_T *result)
+{
+    int column = 0;
+
+#ifdef __ARM_NEON
+    // 8 macroblocks at a time: deinterleave x, y and the two SAD bytes,
+    // square and sum the components, and compare against the threshold.
+    // The result is a byte mask that's only looked at when something moved.
+    uint16x8_t limit = vdupq_n_u16(threshold2);
+    for (; column + 8 <= columns; column += 8) {
+        uint8x8x4_t mb = vld4_u8((const uint8_t *) &row_vectors[column]);
+        int8x8_t x = vreinterpret_s8_u8(mb.val[0]);
+        int8x8_t y = vreinterpret_s8_u8(mb.val[1]);
+        uint16x8_t magnitude2 = vaddq_u16(vreinterpretq_u16_s16(vmull_s8(x, x)),
+                                          vreinterpretq_u16_s16(vmull_s8(y, y)));
+        uint8x8_t moved = vmovn_u16(vcgeq_u16(magnitude2, limit));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(moved), 0);
+        while (mask) {
+            int lane = __builtin_ctzll(mask) / 8;
+            mark_active(result, column + lane, row, columns, rows);
+            mask &= ~((uint64_t) 0xff << (lane * 8));
+        }
+    }
+#endif
+
+    for (; column < columns; column++) {
+        int x = row_vectors[column].x;
+        int y = row_vectors[column].y;
+        if ((uint32_t) (x * x + y * y) >= threshold2)
+            mark_active(result, column, row, columns, rows);
+    }
+}
+
+bool picam_motion_analyze(const void *vectors, size_t len, int width, int height, int threshold, MOTION_RESULT_T *result)
+{
+    int columns = (width + 15) / 16;
+    int rows = (height + 15) / 16;
+    int stride = columns + 1;
+    if (len != (size_t) (stride * rows) * sizeof(MOTION_VECTOR_T))
+        return false;
+
+    memset(result, 0, sizeof(*result));
+    result->total = columns * rows;
+    result->left = columns;
+    result->top = rows;
+    result->right = -1;
+    result->bottom = -1;
+
+    // Compare squared magnitudes to stay in integers. Vectors are at most
+    // 128 in each direction, so this fits in 16 bits.
+    uint32_t threshold2 = threshold * threshold;
+    if (threshold2 > 32768)
+        threshold2 = 32768;
+    if (threshold2 == 0)
+        threshold2 = 1;
+
+    const MOTION_VECTOR_T *mv = (const MOTION_VECTOR_T *) vectors;
+    int row;
+    for (row = 0; row < rows; row++)
+        analyze_row(&mv[row * stride], row, columns, rows, threshold2, result);
+
+    if (result->active == 0)
+        result->left = result->top = result->right = result->bottom = 0;
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef PICAM_MOTION_H
+#define PICAM_MOTION_H
+
+// Layout of the H.264 encoder's inline motion vectors. There's one per
+// 16x16 macroblock, plus an extra column at the right of each row.
+typedef struct
+{
+    int8_t x;
+    int8_t y;
+    uint16_t sad;
+} MOTION_VECTOR_T;
+
+// Active macroblocks are also summarized on a coarse grid. Bit
+// (row * PICAM_MOTION_GRID + column) is set if any macroblock in that cell
+// moved.
+#define PICAM_MOTION_GRID 8
+
+typedef struct
+{
+    int active;    // macroblocks that moved at least the threshold
+    int total;     // macroblocks in the frame
+    int left, top, right, bottom; // bounding box of the active macroblocks (inclusive)
+    uint64_t grid;
+} MOTION_RESULT_T;
+
+// Returns false if the vectors don't match the frame size.
+bool picam_motion_analyze(const void *vectors, size_t len, int width, int height, int threshold, MOTION_RESULT_T *result);
+
+#endif
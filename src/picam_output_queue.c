@@ -0,0 +1,158 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include "picam_output_queue.h"
+
+void picam_output_queue_init(OUTPUT_QUEUE_T *queue, int fd)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = fd;
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        err(EXIT_FAILURE, "Could not make output non-blocking");
+}
+
+void picam_output_queue_free(OUTPUT_QUEUE_T *queue)
+{
+    int i;
+    for (i = 0; i < queue->count; i++)
+        free(queue->packets[i].data);
+    free(queue->packets);
+    queue->packets = NULL;
+    queue->count = 0;
+    queue->capacity = 0;
+    queue->frame_count = 0;
+}
+
+static void remove_packet(OUTPUT_QUEUE_T *queue, int ix)
+{
+    if (queue->packets[ix].droppable)
+        queue->frame_count--;
+    free(queue->packets[ix].data);
+
+    queue->count--;
+    memmove(&queue->packets[ix], &queue->packets[ix + 1], (queue->count - ix) * sizeof(OUTPUT_PACKET_T));
+}
+
+static bool drop_oldest_frame(OUTPUT_QUEUE_T *queue)
+{
+    // The first packet can't be dropped once part of it has gone out.
+    int i;
+    for (i = queue->offset ? 1 : 0; i < queue->count; i++) {
+        if (queue->packets[i].droppable) {
+            remove_packet(queue, i);
+            queue->frames_dropped++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void replace_message(OUTPUT_QUEUE_T *queue, unsigned int replace_key)
+{
+    int i;
+    for (i = queue->offset ? 1 : 0; i < queue->count; i++) {
+        if (queue->packets[i].replace_key == replace_key) {
+            remove_packet(queue, i);
+            queue->messages_replaced++;
+            return;
+        }
+    }
+}
+
+static void enqueue(OUTPUT_QUEUE_T *queue, const struct iovec *iovs, int count, size_t skip, size_t len,
+                    bool droppable, unsigned int replace_key)
+{
+    if (droppable && queue->frame_count == PICAM_OUTPUT_QUEUE_MAX_FRAMES && !drop_oldest_frame(queue)) {
+        // Only the frame that's partially out is queued, so this one has to go.
+        queue->frames_dropped++;
+        return;
+    }
+    if (replace_key)
+        replace_message(queue, replace_key);
+
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : PICAM_OUTPUT_QUEUE_DEPTH;
+        OUTPUT_PACKET_T *packets = (OUTPUT_PACKET_T *) realloc(queue->packets, capacity * sizeof(OUTPUT_PACKET_T));
+        if (!packets)
+            err(EXIT_FAILURE, "realloc");
+        queue->packets = packets;
+        queue->capacity = capacity;
+    }
+
+    OUTPUT_PACKET_T *packet = &queue->packets[queue->count];
+    packet->len = len - skip;
+    packet->droppable = droppable;
+    packet->replace_key = skip ? 0 : replace_key;
+    packet->data = malloc(packet->len);
+    if (!packet->data)
+        err(EXIT_FAILURE, "malloc");
+
+    char *p = packet->data;
+    int i;
+    for (i = 0; i < count; i++) {
+        size_t n = iovs[i].iov_len;
+        const char *base = iovs[i].iov_base;
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        memcpy(p, base + skip, n - skip);
+        p += n - skip;
+        skip = 0;
+    }
+
+    queue->count++;
+    if (droppable)
+        queue->frame_count++;
+}
+
+void picam_output_queue_write(OUTPUT_QUEUE_T *queue, const struct iovec *iovs, int count, size_t len,
+                              bool droppable, unsigned int replace_key)
+{
+    size_t written = 0;
+    if (queue->count == 0) {
+        ssize_t rc = writev(queue->fd, iovs, count);
+        if (rc < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                err(EXIT_FAILURE, "Error writing to stdout");
+        } else {
+            written = rc;
+        }
+    }
+
+    if (written == len)
+        return;
+
+    // Once part of a packet is out, the rest has to follow, so only queue
+    // what's left and never drop it.
+    enqueue(queue, iovs, count, written, len, written == 0 && droppable, replace_key);
+}
+
+void picam_output_queue_service(OUTPUT_QUEUE_T *queue)
+{
+    while (queue->count > 0) {
+        OUTPUT_PACKET_T *packet = &queue->packets[0];
+        ssize_t rc = write(queue->fd, packet->data + queue->offset, packet->len - queue->offset);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+            err(EXIT_FAILURE, "Error writing to stdout");
+        }
+
+        queue->offset += rc;
+        if (queue->offset < packet->len)
+            return;
+
+        remove_packet(queue, 0);
+        queue->offset = 0;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef PICAM_OUTPUT_QUEUE_H
+#define PICAM_OUTPUT_QUEUE_H
+
+// Packets are written straight to the fd when it can take them. Whatever
+// doesn't fit is copied here and written as the fd drains. At most
+// PICAM_OUTPUT_QUEUE_MAX_FRAMES frames wait at once; when another one
+// arrives, the oldest one that hasn't started going out is dropped.
+//
+// Messages are never dropped, but a periodic one, like a stats report, has
+// a replace key. A newer message with the same key replaces a queued one
+// that hasn't started going out, and goes to the back, so only the latest
+// waits. Other messages are only sent in reply to requests, so the queue
+// grows to hold them rather than giving up on a slow reader.
+#define PICAM_OUTPUT_QUEUE_MAX_FRAMES   2
+#define PICAM_OUTPUT_QUEUE_DEPTH        16 // to start with
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    bool droppable;
+    unsigned int replace_key; // 0 for none
+} OUTPUT_PACKET_T;
+
+typedef struct
+{
+    int fd;
+    OUTPUT_PACKET_T *packets;
+    int count;
+    int capacity;
+    int frame_count;
+    size_t offset; // into packets[0]
+    unsigned long frames_dropped;
+    unsigned long messages_replaced;
+} OUTPUT_QUEUE_T;
+
+void picam_output_queue_init(OUTPUT_QUEUE_T *queue, int fd);
+void picam_output_queue_free(OUTPUT_QUEUE_T *queue);
+void picam_output_queue_write(OUTPUT_QUEUE_T *queue, const struct iovec *iovs, int count, size_t len,
+                              bool droppable, unsigned int replace_key);
+void picam_output_queue_service(OUTPUT_QUEUE_T *queue);
+
+static inline bool picam_output_queue_pending(const OUTPUT_QUEUE_T *queue)
+{
+    return queue->count > 0;
+}
+
+#endif
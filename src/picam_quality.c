@@ -0,0 +1,83 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "picam_quality.h"
+
+// Frame sizes are only aimed at this fraction of the limit so that the
+// frames in flight while the quality comes down still fit.
+#define MAX_FRAME_HEADROOM  0.75
+
+// Close enough, in doublings (about 7%). Avoids hunting around the target.
+#define DEADBAND            0.1
+
+#define GAIN                0.5
+#define MAX_STEP_DOWN       10.0
+#define MAX_STEP_UP         2.0
+
+static double clamp(double min, double value, double max)
+{
+    return value < min ? min : (value > max ? max : value);
+}
+
+void picam_quality_configure(QUALITY_CONTROL_T *qc, long target_bitrate, long max_frame_size, int min_quality, int max_quality)
+{
+    bool was_enabled = picam_quality_enabled(qc);
+
+    qc->target_bitrate = target_bitrate;
+    qc->max_frame_size = max_frame_size;
+    qc->min_quality = min_quality;
+    qc->max_quality = max_quality > min_quality ? max_quality : min_quality;
+
+    // Start from the ceiling, which is the quality that was set by hand
+    if (!was_enabled)
+        picam_quality_reset(qc, qc->max_quality);
+    else
+        qc->quality = clamp(qc->min_quality, qc->quality, qc->max_quality);
+}
+
+void picam_quality_reset(QUALITY_CONTROL_T *qc, int quality)
+{
+    qc->quality = clamp(qc->min_quality, quality, qc->max_quality);
+    qc->average_size = 0;
+    qc->average_interval_us = 0;
+    qc->last_frame_us = 0;
+}
+
+int picam_quality_update(QUALITY_CONTROL_T *qc, size_t frame_len, uint64_t timestamp_us)
+{
+    if (qc->last_frame_us && timestamp_us > qc->last_frame_us) {
+        double interval = (double) (timestamp_us - qc->last_frame_us);
+        if (qc->average_interval_us > 0)
+            qc->average_interval_us += 0.1 * (interval - qc->average_interval_us);
+        else
+            qc->average_interval_us = interval;
+    }
+    qc->last_frame_us = timestamp_us;
+
+    if (qc->average_size > 0)
+        qc->average_size += 0.25 * ((double) frame_len - qc->average_size);
+    else
+        qc->average_size = (double) frame_len;
+
+    // How many times over budget, in doublings, by whichever target is
+    // furthest off. The bitrate is judged on the average and the size
+    // limit on this frame alone.
+    double error = -INFINITY;
+    if (qc->target_bitrate > 0 && qc->average_interval_us > 0 && qc->average_size > 0) {
+        double budget = qc->target_bitrate / 8.0 * qc->average_interval_us / 1000000.0;
+        error = log2(qc->average_size / budget);
+    }
+    if (qc->max_frame_size > 0 && frame_len > 0) {
+        double over = log2((double) frame_len / (qc->max_frame_size * MAX_FRAME_HEADROOM));
+        if (over > error)
+            error = over;
+    }
+
+    if (isfinite(error) && fabs(error) > DEADBAND) {
+        double step = clamp(-MAX_STEP_DOWN, -GAIN * PICAM_QUALITY_PER_DOUBLING * error, MAX_STEP_UP);
+        qc->quality = clamp(qc->min_quality, qc->quality + step, qc->max_quality);
+    }
+    return (int) lrint(qc->quality);
+}
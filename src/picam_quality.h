@@ -0,0 +1,36 @@
+#ifndef PICAM_QUALITY_H
+#define PICAM_QUALITY_H
+
+// Picks the JPEG quality for the next frame from the sizes of the last
+// ones. The encoder only takes a quality, so frame sizes are steered by
+// nudging it every frame until the average frame fits the bitrate's share
+// per frame and single frames stay under the size limit. Frame size
+// roughly doubles every PICAM_QUALITY_PER_DOUBLING quality steps, so steps
+// go by the log of how far off the sizes are. Quality drops quickly and
+// comes back slowly, since changes take a few frames to show up.
+#define PICAM_QUALITY_PER_DOUBLING 10.0
+
+typedef struct
+{
+    // Targets. 0 turns one off. The controller runs if either is set.
+    long target_bitrate; // bits/s
+    long max_frame_size; // bytes
+    int min_quality;
+    int max_quality;
+
+    double quality;
+    double average_size;
+    double average_interval_us;
+    uint64_t last_frame_us;
+} QUALITY_CONTROL_T;
+
+void picam_quality_configure(QUALITY_CONTROL_T *qc, long target_bitrate, long max_frame_size, int min_quality, int max_quality);
+void picam_quality_reset(QUALITY_CONTROL_T *qc, int quality);
+int picam_quality_update(QUALITY_CONTROL_T *qc, size_t frame_len, uint64_t timestamp_us);
+
+static inline bool picam_quality_enabled(const QUALITY_CONTROL_T *qc)
+{
+    return qc->target_bitrate > 0 || qc->max_frame_size > 0;
+}
+
+#endif
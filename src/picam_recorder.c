@@ -0,0 +1,409 @@
+#define _GNU_SOURCE // for fallocate()
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "picam_recorder.h"
+
+#define FRAME(rec, seq) (&(rec)->frames[(seq) % PICAM_RECORDER_MAX_FRAMES])
+
+void picam_recorder_init(RECORDER_T *rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->fd = -1;
+}
+
+static void *writer_main(void *arg);
+
+void picam_recorder_open(RECORDER_T *rec, const char *dir, size_t size)
+{
+    if (size < PICAM_RECORDER_WRITE_SIZE)
+        errx(EXIT_FAILURE, "Recording buffer must be at least %d bytes", PICAM_RECORDER_WRITE_SIZE);
+
+    rec->data = (char *) malloc(size);
+    if (!rec->data)
+        err(EXIT_FAILURE, "Could not allocate %zu bytes for recording", size);
+    if (posix_memalign((void **) &rec->staging, 4096, PICAM_RECORDER_WRITE_SIZE) != 0)
+        errx(EXIT_FAILURE, "posix_memalign");
+
+    rec->dir = strdup(dir);
+    rec->size = size;
+
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->wake, NULL);
+    if (pthread_create(&rec->thread, NULL, writer_main, rec) != 0)
+        errx(EXIT_FAILURE, "Could not start the recording thread");
+    rec->running = true;
+}
+
+void picam_recorder_close(RECORDER_T *rec)
+{
+    if (rec->running) {
+        // Whatever was being recorded is finished first.
+        pthread_mutex_lock(&rec->lock);
+        if (rec->recording) {
+            rec->recording = false;
+            rec->stop = rec->next;
+        }
+        rec->quit = true;
+        pthread_cond_signal(&rec->wake);
+        pthread_mutex_unlock(&rec->lock);
+
+        pthread_join(rec->thread, NULL);
+        pthread_mutex_destroy(&rec->lock);
+        pthread_cond_destroy(&rec->wake);
+    }
+
+    free(rec->dir);
+    free(rec->data);
+    free(rec->staging);
+
+    picam_recorder_init(rec);
+}
+
+void picam_recorder_configure(RECORDER_T *rec, int preroll_s, int segment_s)
+{
+    if (!rec->running)
+        return;
+
+    if (preroll_s < 0)
+        preroll_s = 0;
+    if (segment_s < 1)
+        segment_s = 1;
+
+    pthread_mutex_lock(&rec->lock);
+    rec->preroll_us = (uint64_t) preroll_s * 1000000;
+    rec->segment_us = (uint64_t) segment_s * 1000000;
+    pthread_mutex_unlock(&rec->lock);
+}
+
+// The writer still needs frames from write onwards.
+static bool is_protected(const RECORDER_T *rec, uint64_t seq)
+{
+    return (rec->recording || rec->write < rec->stop) && seq >= rec->write;
+}
+
+static size_t bytes_used(const RECORDER_T *rec)
+{
+    return rec->oldest == rec->next ? 0 : rec->next_byte - FRAME(rec, rec->oldest)->start;
+}
+
+// Keeps the newest place a segment can start that's older than the cutoff
+// so that recordings get at least the whole pre-roll.
+static void age_out(RECORDER_T *rec, uint64_t cutoff_us)
+{
+    uint64_t keep = rec->oldest;
+    uint64_t seq;
+    for (seq = rec->oldest; seq < rec->next && FRAME(rec, seq)->timestamp_us < cutoff_us; seq++) {
+        if (FRAME(rec, seq)->sync)
+            keep = seq;
+    }
+
+    while (rec->oldest < keep && !is_protected(rec, rec->oldest))
+        rec->oldest++;
+}
+
+// H.264 frames with SPS/PPS up front can start a segment. So can IDR
+// frames if the encoder isn't sending the headers with them.
+static bool is_sync_frame(const RECORDER_T *rec, const struct iovec *fragments, bool h264)
+{
+    if (!h264)
+        return true;
+
+    const uint8_t *p = (const uint8_t *) fragments[0].iov_base;
+    size_t len = fragments[0].iov_len;
+    size_t i;
+    for (i = 0; i + 3 < len && i < 8; i++) {
+        if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1) {
+            int type = p[i + 3] & 0x1f;
+            if (type == 7)
+                return true;
+            if (type != 5 || rec->oldest == rec->next)
+                return false;
+
+            // Part of the SPS/PPS frame before it
+            const struct recorder_frame *previous = FRAME(rec, rec->next - 1);
+            return !(previous->sync && previous->h264);
+        }
+    }
+    return false;
+}
+
+static void copy_in(RECORDER_T *rec, const struct iovec *fragments, int count)
+{
+    size_t pos = rec->next_byte % rec->size;
+    int i;
+    for (i = 0; i < count; i++) {
+        const char *p = (const char *) fragments[i].iov_base;
+        size_t remaining = fragments[i].iov_len;
+        while (remaining) {
+            size_t amount = rec->size - pos;
+            if (amount > remaining)
+                amount = remaining;
+            memcpy(rec->data + pos, p, amount);
+            p += amount;
+            remaining -= amount;
+            pos = (pos + amount) % rec->size;
+        }
+    }
+}
+
+void picam_recorder_add(RECORDER_T *rec, const struct iovec *fragments, int count, size_t len, bool h264, uint64_t now_us)
+{
+    if (!rec->running)
+        return;
+
+    pthread_mutex_lock(&rec->lock);
+    age_out(rec, now_us > rec->preroll_us ? now_us - rec->preroll_us : 0);
+
+    // Make room by dropping the oldest frames, but never ones the writer
+    // hasn't gotten to.
+    while (rec->oldest < rec->next && !is_protected(rec, rec->oldest) &&
+           (bytes_used(rec) + len > rec->size || rec->next - rec->oldest == PICAM_RECORDER_MAX_FRAMES))
+        rec->oldest++;
+
+    if (bytes_used(rec) + len > rec->size || rec->next - rec->oldest == PICAM_RECORDER_MAX_FRAMES) {
+        rec->frames_dropped++;
+        pthread_mutex_unlock(&rec->lock);
+        return;
+    }
+
+    bool sync = is_sync_frame(rec, fragments, h264);
+    uint64_t start = rec->next_byte;
+    pthread_mutex_unlock(&rec->lock);
+
+    // Only this thread moves next and next_byte, and the writer never reads
+    // past next, so the copy doesn't need the lock.
+    copy_in(rec, fragments, count);
+
+    pthread_mutex_lock(&rec->lock);
+    struct recorder_frame *frame = FRAME(rec, rec->next);
+    frame->start = start;
+    frame->len = len;
+    frame->timestamp_us = now_us;
+    frame->h264 = h264;
+    frame->sync = sync;
+    rec->next_byte += len;
+    rec->next++;
+    if (rec->recording)
+        pthread_cond_signal(&rec->wake);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+void picam_recorder_start(RECORDER_T *rec, uint64_t now_us)
+{
+    if (!rec->running)
+        return;
+
+    pthread_mutex_lock(&rec->lock);
+    if (!rec->recording && rec->write >= rec->stop) {
+        // Start from the newest sync frame at least a pre-roll ago, or the
+        // oldest one that's left.
+        uint64_t cutoff_us = now_us > rec->preroll_us ? now_us - rec->preroll_us : 0;
+        uint64_t start = rec->next;
+        uint64_t seq;
+        for (seq = rec->oldest; seq < rec->next; seq++) {
+            const struct recorder_frame *frame = FRAME(rec, seq);
+            if (!frame->sync)
+                continue;
+            if (frame->timestamp_us > cutoff_us && start != rec->next)
+                break;
+            start = seq;
+        }
+        rec->write = start;
+    }
+    // Otherwise the writer is still finishing and just keeps going.
+    rec->recording = true;
+    pthread_cond_signal(&rec->wake);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+void picam_recorder_stop(RECORDER_T *rec)
+{
+    if (!rec->running)
+        return;
+
+    pthread_mutex_lock(&rec->lock);
+    if (rec->recording) {
+        rec->recording = false;
+        rec->stop = rec->next;
+        pthread_cond_signal(&rec->wake);
+    }
+    pthread_mutex_unlock(&rec->lock);
+}
+
+void picam_recorder_report(RECORDER_T *rec, FILE *fp)
+{
+    if (!rec->running)
+        return;
+
+    pthread_mutex_lock(&rec->lock);
+    fprintf(fp, "recording=%d\n", rec->recording || rec->write < rec->stop);
+    fprintf(fp, "record_preroll_frames=%llu\n", (unsigned long long) (rec->next - rec->oldest));
+    fprintf(fp, "record_frames_dropped=%lu\n", rec->frames_dropped);
+    fprintf(fp, "record_segments=%lu\n", rec->segments);
+    fprintf(fp, "record_bytes_written=%llu\n", rec->bytes_written);
+    fprintf(fp, "record_write_errors=%lu\n", rec->write_errors);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+// The functions below run on the writer thread.
+
+static void abandon_segment(RECORDER_T *rec, const char *what)
+{
+    warn("Recording %s failed", what);
+    close(rec->fd);
+    rec->fd = -1;
+    rec->staging_len = 0;
+
+    pthread_mutex_lock(&rec->lock);
+    rec->write_errors++;
+    pthread_mutex_unlock(&rec->lock);
+}
+
+static bool flush_staging(RECORDER_T *rec)
+{
+    // Reserve space well ahead so the file doesn't fragment.
+    if (rec->file_len + (off_t) rec->staging_len > rec->allocated) {
+        if (fallocate(rec->fd, FALLOC_FL_KEEP_SIZE, rec->allocated, PICAM_RECORDER_PREALLOCATE) == 0)
+            rec->allocated += PICAM_RECORDER_PREALLOCATE;
+        else
+            rec->allocated = rec->file_len + rec->staging_len; // not supported; don't retry every write
+    }
+
+    size_t written = 0;
+    while (written < rec->staging_len) {
+        ssize_t rc = write(rec->fd, rec->staging + written, rec->staging_len - written);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            abandon_segment(rec, "write");
+            return false;
+        }
+        written += rc;
+    }
+
+    rec->file_len += written;
+    rec->staging_len = 0;
+
+    pthread_mutex_lock(&rec->lock);
+    rec->bytes_written += written;
+    pthread_mutex_unlock(&rec->lock);
+    return true;
+}
+
+static void finish_segment(RECORDER_T *rec)
+{
+    if (!flush_staging(rec))
+        return;
+
+    // Give back what was preallocated past the end.
+    if (ftruncate(rec->fd, rec->file_len) < 0)
+        warn("ftruncate");
+    close(rec->fd);
+    rec->fd = -1;
+}
+
+static void open_segment(RECORDER_T *rec, const struct recorder_frame *frame)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+
+    char when[32];
+    strftime(when, sizeof(when), "%Y%m%d-%H%M%S", &tm);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/picam-%s.%03ld.%s", rec->dir, when, (long) tv.tv_usec / 1000,
+             frame->h264 ? "h264" : "mjpeg");
+
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec->fd < 0) {
+        abandon_segment(rec, path);
+        return;
+    }
+
+    rec->fd_h264 = frame->h264;
+    rec->segment_start_us = frame->timestamp_us;
+    rec->file_len = 0;
+    rec->allocated = 0;
+
+    pthread_mutex_lock(&rec->lock);
+    rec->segments++;
+    pthread_mutex_unlock(&rec->lock);
+}
+
+static void write_frame(RECORDER_T *rec, const struct recorder_frame *frame, uint64_t segment_us)
+{
+    if (rec->fd >= 0 && frame->sync &&
+            (frame->h264 != rec->fd_h264 || frame->timestamp_us - rec->segment_start_us >= segment_us))
+        finish_segment(rec);
+
+    if (rec->fd < 0) {
+        if (!frame->sync)
+            return;
+        open_segment(rec, frame);
+        if (rec->fd < 0)
+            return;
+    }
+
+    size_t pos = frame->start % rec->size;
+    size_t remaining = frame->len;
+    while (remaining) {
+        size_t amount = PICAM_RECORDER_WRITE_SIZE - rec->staging_len;
+        if (amount > remaining)
+            amount = remaining;
+        if (amount > rec->size - pos)
+            amount = rec->size - pos;
+
+        memcpy(rec->staging + rec->staging_len, rec->data + pos, amount);
+        rec->staging_len += amount;
+        remaining -= amount;
+        pos = (pos + amount) % rec->size;
+
+        if (rec->staging_len == PICAM_RECORDER_WRITE_SIZE && !flush_staging(rec))
+            return;
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    RECORDER_T *rec = (RECORDER_T *) arg;
+
+    pthread_mutex_lock(&rec->lock);
+    for (;;) {
+        uint64_t end = rec->recording ? rec->next : rec->stop;
+        if (rec->write < end) {
+            // Frames from write onwards aren't dropped, so they can be
+            // read without the lock.
+            struct recorder_frame frame = *FRAME(rec, rec->write);
+            uint64_t segment_us = rec->segment_us;
+            pthread_mutex_unlock(&rec->lock);
+            write_frame(rec, &frame, segment_us);
+            pthread_mutex_lock(&rec->lock);
+            rec->write++;
+        } else if (!rec->recording && rec->fd >= 0) {
+            pthread_mutex_unlock(&rec->lock);
+            finish_segment(rec);
+            pthread_mutex_lock(&rec->lock);
+        } else if (rec->quit) {
+            break;
+        } else {
+            pthread_cond_wait(&rec->wake, &rec->lock);
+        }
+    }
+    pthread_mutex_unlock(&rec->lock);
+    return NULL;
+}
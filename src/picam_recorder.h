@@ -0,0 +1,74 @@
+#ifndef PICAM_RECORDER_H
+#define PICAM_RECORDER_H
+
+#define PICAM_RECORDER_MAX_FRAMES   4096
+#define PICAM_RECORDER_WRITE_SIZE   (1024 * 1024)
+#define PICAM_RECORDER_PREALLOCATE  (64 * 1024 * 1024)
+
+// Encoded frames are copied into a fixed-size ring that always holds the
+// last few seconds. Starting a recording writes the ring out and then
+// keeps going with new frames until stopped. Files are written by a
+// separate thread in segment-sized pieces, MJPEG as concatenated JPEGs and
+// H.264 as an Annex B byte stream. Segments start on a JPEG or an H.264
+// frame with SPS/PPS so each one plays on its own.
+struct recorder_frame
+{
+    uint64_t start; // offset in the ring counting from the first byte ever added
+    size_t len;
+    uint64_t timestamp_us;
+    bool h264;
+    bool sync;
+};
+
+typedef struct
+{
+    char *dir;
+    char *data;
+    size_t size;
+
+    // Frame sequence numbers. frames[seq % PICAM_RECORDER_MAX_FRAMES] is
+    // in the ring for oldest <= seq < next. The writer is at write and
+    // finishes at stop once recording is cleared.
+    struct recorder_frame frames[PICAM_RECORDER_MAX_FRAMES];
+    uint64_t oldest;
+    uint64_t next;
+    uint64_t write;
+    uint64_t stop;
+    uint64_t next_byte;
+
+    bool recording;
+    bool quit;
+    uint64_t preroll_us;
+    uint64_t segment_us;
+
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    // Only used by the writer thread
+    int fd;
+    bool fd_h264;
+    uint64_t segment_start_us;
+    char *staging;
+    size_t staging_len;
+    off_t file_len;
+    off_t allocated;
+
+    // Protected by lock
+    unsigned long frames_dropped;
+    unsigned long segments;
+    unsigned long write_errors;
+    unsigned long long bytes_written;
+} RECORDER_T;
+
+void picam_recorder_init(RECORDER_T *rec);
+void picam_recorder_open(RECORDER_T *rec, const char *dir, size_t size);
+void picam_recorder_close(RECORDER_T *rec);
+void picam_recorder_configure(RECORDER_T *rec, int preroll_s, int segment_s);
+void picam_recorder_add(RECORDER_T *rec, const struct iovec *fragments, int count, size_t len, bool h264, uint64_t now_us);
+void picam_recorder_start(RECORDER_T *rec, uint64_t now_us);
+void picam_recorder_stop(RECORDER_T *rec);
+void picam_recorder_report(RECORDER_T *rec, FILE *fp);
+
+#endif
@@ -0,0 +1,365 @@
+#define _GNU_SOURCE // for sendmmsg()
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "picam_rtp.h"
+
+#define RTP_HEADER_SIZE       12
+#define JPEG_HEADER_SIZE      8
+#define RESTART_HEADER_SIZE   4
+#define QTABLE_HEADER_SIZE    (4 + 2 * 64)
+#define MAX_HEADER_SIZE       (RTP_HEADER_SIZE + JPEG_HEADER_SIZE + RESTART_HEADER_SIZE + QTABLE_HEADER_SIZE)
+
+#define RTP_PAYLOAD_JPEG      26
+
+// What RFC 2435 needs from the JPEG headers
+struct jpeg_info
+{
+    int type; // 0 for 4:2:2, 1 for 4:2:0
+    int width;
+    int height;
+    int restart_interval;
+    const uint8_t *qtables[2]; // luma, chroma
+    const uint8_t *scan;
+    size_t scan_len;
+};
+
+void picam_rtp_init(RTP_SENDER_T *rtp)
+{
+    memset(rtp, 0, sizeof(*rtp));
+    rtp->fd = -1;
+}
+
+void picam_rtp_open(RTP_SENDER_T *rtp, const char *destination, int mtu)
+{
+    if (mtu < PICAM_RTP_MIN_MTU)
+        errx(EXIT_FAILURE, "RTP MTU must be at least %d", PICAM_RTP_MIN_MTU);
+
+    char address[64];
+    int port;
+    const char *colon = strrchr(destination, ':');
+    if (!colon || colon - destination >= (int) sizeof(address) ||
+            sscanf(colon + 1, "%d", &port) != 1 || port <= 0 || port > 65535)
+        errx(EXIT_FAILURE, "RTP destination should be <address:port>: %s", destination);
+    memcpy(address, destination, colon - destination);
+    address[colon - destination] = '\0';
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+        errx(EXIT_FAILURE, "Invalid RTP address: %s", address);
+
+    rtp->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (rtp->fd < 0)
+        err(EXIT_FAILURE, "socket");
+
+    // Connecting lets every packet go out without an address. It works the
+    // same for multicast groups.
+    if (connect(rtp->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err(EXIT_FAILURE, "Could not send RTP to %s", destination);
+
+    rtp->destination = strdup(destination);
+    rtp->mtu = mtu;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rtp->ssrc = (uint32_t) (ts.tv_nsec ^ (ts.tv_sec << 16) ^ getpid());
+    rtp->sequence = (uint16_t) rtp->ssrc;
+}
+
+void picam_rtp_close(RTP_SENDER_T *rtp)
+{
+    if (rtp->fd >= 0)
+        close(rtp->fd);
+    free(rtp->destination);
+    free(rtp->frame);
+
+    picam_rtp_init(rtp);
+}
+
+static int get_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Collects the headers RFC 2435 needs and finds the scan data. Only the
+// baseline 8-bit YUV JPEGs that the encoder produces are accepted.
+static bool parse_jpeg(const uint8_t *data, size_t len, struct jpeg_info *info)
+{
+    const uint8_t *tables[4] = {0};
+    int luma_table = -1;
+    int chroma_table = -1;
+
+    memset(info, 0, sizeof(*info));
+    info->type = -1;
+    if (len < 4 || data[0] != 0xff || data[1] != 0xd8)
+        return false;
+
+    size_t pos = 2;
+    while (pos + 4 <= len) {
+        if (data[pos] != 0xff)
+            return false;
+        uint8_t marker = data[pos + 1];
+        if (marker == 0xff) {
+            pos++; // fill byte
+            continue;
+        }
+
+        size_t segment_len = get_be16(&data[pos + 2]);
+        const uint8_t *segment = &data[pos + 4];
+        if (segment_len < 2 || pos + 2 + segment_len > len)
+            return false;
+        size_t body_len = segment_len - 2;
+
+        switch (marker) {
+        case 0xdb: { // DQT
+            size_t i = 0;
+            while (i + 65 <= body_len) {
+                if (segment[i] >> 4)
+                    return false; // 16-bit tables
+                tables[segment[i] & 3] = &segment[i + 1];
+                i += 65;
+            }
+            break;
+        }
+        case 0xc0: // SOF0
+            if (body_len < 15 || segment[0] != 8 || segment[5] != 3)
+                return false;
+            info->height = get_be16(&segment[1]);
+            info->width = get_be16(&segment[3]);
+            if (segment[7] == 0x21)
+                info->type = 0;
+            else if (segment[7] == 0x22)
+                info->type = 1;
+            if (segment[10] != 0x11 || segment[13] != 0x11)
+                return false;
+            luma_table = segment[8] & 3;
+            chroma_table = segment[11] & 3;
+            break;
+        case 0xc1: case 0xc2: case 0xc3:
+        case 0xc5: case 0xc6: case 0xc7:
+        case 0xc9: case 0xca: case 0xcb:
+        case 0xcd: case 0xce: case 0xcf:
+            return false; // not baseline
+        case 0xdd: // DRI
+            if (body_len < 2)
+                return false;
+            info->restart_interval = get_be16(segment);
+            break;
+        case 0xda: // SOS
+            info->scan = data + pos + 2 + segment_len;
+            info->scan_len = len - (pos + 2 + segment_len);
+            if (info->scan_len >= 2 && info->scan[info->scan_len - 2] == 0xff && info->scan[info->scan_len - 1] == 0xd9)
+                info->scan_len -= 2;
+
+            if (info->type < 0 || !tables[luma_table] || !tables[chroma_table])
+                return false;
+            info->qtables[0] = tables[luma_table];
+            info->qtables[1] = tables[chroma_table];
+
+            // The header only has a byte each for the size in 8 pixel units.
+            return info->width > 0 && info->width <= 2040 &&
+                   info->height > 0 && info->height <= 2040;
+        default:
+            break;
+        }
+        pos += 2 + segment_len;
+    }
+    return false;
+}
+
+static bool is_restart_marker(const uint8_t *p)
+{
+    return p[0] == 0xff && (p[1] & 0xf8) == 0xd0;
+}
+
+// Sizes the packet starting at offset. With restart markers, it ends
+// after the last one that fits so that intervals aren't split unless one
+// is bigger than a packet.
+static size_t packet_end(const struct jpeg_info *info, size_t offset, size_t room)
+{
+    if (offset + room >= info->scan_len)
+        return info->scan_len;
+
+    size_t end = offset + room;
+    if (info->restart_interval) {
+        size_t i;
+        for (i = end; i >= offset + 2; i--) {
+            if (is_restart_marker(&info->scan[i - 2]))
+                return i;
+        }
+    }
+    return end;
+}
+
+// Markers that straddle packets count towards the one they start in.
+static int count_restart_markers(const struct jpeg_info *info, size_t offset, size_t end)
+{
+    int count = 0;
+    size_t i;
+    for (i = offset; i < end && i + 1 < info->scan_len; i++) {
+        if (is_restart_marker(&info->scan[i]))
+            count++;
+    }
+    return count;
+}
+
+static size_t build_header(RTP_SENDER_T *rtp, uint8_t *p, const struct jpeg_info *info,
+                           uint32_t timestamp, size_t offset, size_t end, int interval)
+{
+    uint8_t *start = p;
+    bool last = end == info->scan_len;
+
+    p[0] = 0x80; // version 2
+    p[1] = (last ? 0x80 : 0) | RTP_PAYLOAD_JPEG;
+    put_be16(&p[2], rtp->sequence++);
+    put_be32(&p[4], timestamp);
+    put_be32(&p[8], rtp->ssrc);
+    p += RTP_HEADER_SIZE;
+
+    put_be32(p, offset); // type-specific byte is 0
+    p[4] = info->type + (info->restart_interval ? 64 : 0);
+    p[5] = 255; // tables are sent in band
+    p[6] = (info->width + 7) / 8;
+    p[7] = (info->height + 7) / 8;
+    p += JPEG_HEADER_SIZE;
+
+    if (info->restart_interval) {
+        bool first = offset == 0 || is_restart_marker(&info->scan[offset - 2]);
+        bool complete = last || is_restart_marker(&info->scan[end - 2]);
+        put_be16(&p[0], info->restart_interval);
+        put_be16(&p[2], (first ? 0x8000 : 0) | (complete ? 0x4000 : 0) | (interval & 0x3fff));
+        p += RESTART_HEADER_SIZE;
+    }
+
+    if (offset == 0) {
+        p[0] = 0;
+        p[1] = 0; // 8-bit precision
+        put_be16(&p[2], 2 * 64);
+        memcpy(&p[4], info->qtables[0], 64);
+        memcpy(&p[4 + 64], info->qtables[1], 64);
+        p += QTABLE_HEADER_SIZE;
+    }
+    return p - start;
+}
+
+// Returns false if the socket couldn't take everything.
+static bool flush_batch(RTP_SENDER_T *rtp, struct mmsghdr *msgs, int count)
+{
+    int sent = 0;
+    while (sent < count) {
+        int rc = sendmmsg(rtp->fd, &msgs[sent], count - sent, MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            // ECONNREFUSED just means nobody's listening on a unicast
+            // destination right now.
+            if (errno != EAGAIN && errno != ECONNREFUSED)
+                warn("RTP send");
+            break;
+        }
+        sent += rc;
+    }
+    rtp->packets_sent += sent;
+    return sent == count;
+}
+
+void picam_rtp_send(RTP_SENDER_T *rtp, const struct iovec *fragments, int count, size_t len, uint64_t timestamp_us)
+{
+    if (rtp->fd < 0)
+        return;
+
+    const uint8_t *data = (const uint8_t *) fragments[0].iov_base;
+    if (count > 1) {
+        if (len > rtp->frame_size) {
+            char *new_frame = (char *) realloc(rtp->frame, len);
+            if (!new_frame)
+                err(EXIT_FAILURE, "realloc");
+            rtp->frame = new_frame;
+            rtp->frame_size = len;
+        }
+
+        size_t offset = 0;
+        int i;
+        for (i = 0; i < count; i++) {
+            memcpy(rtp->frame + offset, fragments[i].iov_base, fragments[i].iov_len);
+            offset += fragments[i].iov_len;
+        }
+        data = (const uint8_t *) rtp->frame;
+    }
+
+    struct jpeg_info info;
+    if (!parse_jpeg(data, len, &info)) {
+        rtp->frames_dropped++;
+        return;
+    }
+
+    uint32_t timestamp = (uint32_t) (timestamp_us * 9 / 100); // 90 kHz
+    uint8_t headers[PICAM_RTP_BATCH][MAX_HEADER_SIZE];
+    struct iovec iovs[PICAM_RTP_BATCH][2];
+    struct mmsghdr msgs[PICAM_RTP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+
+    size_t offset = 0;
+    int interval = 0;
+    int batched = 0;
+    while (offset < info.scan_len) {
+        size_t overhead = RTP_HEADER_SIZE + JPEG_HEADER_SIZE;
+        if (info.restart_interval)
+            overhead += RESTART_HEADER_SIZE;
+        if (offset == 0)
+            overhead += QTABLE_HEADER_SIZE;
+
+        size_t end = packet_end(&info, offset, rtp->mtu - overhead);
+        size_t header_len = build_header(rtp, headers[batched], &info, timestamp, offset, end, interval);
+
+        iovs[batched][0].iov_base = headers[batched];
+        iovs[batched][0].iov_len = header_len;
+        iovs[batched][1].iov_base = (uint8_t *) info.scan + offset; // silence warning
+        iovs[batched][1].iov_len = end - offset;
+        msgs[batched].msg_hdr.msg_iov = iovs[batched];
+        msgs[batched].msg_hdr.msg_iovlen = 2;
+        batched++;
+
+        if (info.restart_interval)
+            interval += count_restart_markers(&info, offset, end);
+        offset = end;
+
+        if (batched == PICAM_RTP_BATCH || offset == info.scan_len) {
+            // The rest of a frame is useless once part of it is lost.
+            if (!flush_batch(rtp, msgs, batched)) {
+                rtp->frames_dropped++;
+                return;
+            }
+            batched = 0;
+        }
+    }
+}
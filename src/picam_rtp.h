@@ -0,0 +1,34 @@
+#ifndef PICAM_RTP_H
+#define PICAM_RTP_H
+
+#define PICAM_RTP_DEFAULT_MTU   1400
+#define PICAM_RTP_MIN_MTU       256
+#define PICAM_RTP_BATCH         32
+
+// Sends JPEGs as RTP/JPEG (RFC 2435) over UDP to a unicast or multicast
+// address. Each frame's scan data is split into packets of at most mtu
+// bytes. When the encoder inserts restart markers, packets end on them so
+// that a lost packet only costs the restart intervals in it.
+typedef struct
+{
+    int fd;
+    char *destination; // "address:port" as given
+    int mtu;
+
+    uint32_t ssrc;
+    uint16_t sequence;
+
+    // Frames that arrive in several fragments are joined here.
+    char *frame;
+    size_t frame_size;
+
+    unsigned long packets_sent;
+    unsigned long frames_dropped;
+} RTP_SENDER_T;
+
+void picam_rtp_init(RTP_SENDER_T *rtp);
+void picam_rtp_open(RTP_SENDER_T *rtp, const char *destination, int mtu);
+void picam_rtp_close(RTP_SENDER_T *rtp);
+void picam_rtp_send(RTP_SENDER_T *rtp, const struct iovec *fragments, int count, size_t len, uint64_t timestamp_us);
+
+#endif
@@ -0,0 +1,106 @@
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "picam_shm_ring.h"
+
+void picam_shm_ring_init(SHM_RING_T *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+}
+
+void picam_shm_ring_open(SHM_RING_T *ring, const char *name, size_t slot_size)
+{
+    // Keep the slots 8-byte aligned for the timestamps
+    slot_size = (slot_size + 7) & ~(size_t) 7;
+    if (slot_size <= sizeof(struct picam_shm_slot_header))
+        errx(EXIT_FAILURE, "Shared memory slot size too small");
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        err(EXIT_FAILURE, "Could not create shared memory %s", name);
+
+    ring->slot_size = slot_size;
+    ring->mapping_size = sizeof(struct picam_shm_ring_header) +
+            PICAM_SHM_RING_SLOTS * slot_size;
+    if (ftruncate(fd, ring->mapping_size) < 0)
+        err(EXIT_FAILURE, "ftruncate");
+
+    ring->header = mmap(NULL, ring->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring->header == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap");
+    close(fd);
+
+    ring->header->version = PICAM_SHM_RING_VERSION;
+    ring->header->slot_count = PICAM_SHM_RING_SLOTS;
+    ring->header->slot_size = slot_size;
+    ring->header->frame_count = 0;
+
+    // Readers check the magic last, so set it once everything else is valid.
+    __atomic_store_n(&ring->header->magic, PICAM_SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    ring->name = strdup(name);
+}
+
+void picam_shm_ring_close(SHM_RING_T *ring)
+{
+    if (!ring->header)
+        return;
+
+    munmap(ring->header, ring->mapping_size);
+    shm_unlink(ring->name);
+    free(ring->name);
+    ring->name = NULL;
+    ring->header = NULL;
+}
+
+static uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void picam_shm_ring_publish(SHM_RING_T *ring, int stream, const struct iovec *fragments, int count, size_t len)
+{
+    if (!ring->header)
+        return;
+
+    if (len > ring->slot_size - sizeof(struct picam_shm_slot_header)) {
+        ring->frames_dropped++;
+        return;
+    }
+
+    struct picam_shm_ring_header *header = ring->header;
+    uint32_t seq = header->frame_count + 1;
+    char *slot_base = (char *) (header + 1) + ((seq - 1) % PICAM_SHM_RING_SLOTS) * ring->slot_size;
+    struct picam_shm_slot_header *slot = (struct picam_shm_slot_header *) slot_base;
+
+    // Invalidate the slot before touching the data so that a reader still
+    // looking at the old frame notices.
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    char *data = slot_base + sizeof(struct picam_shm_slot_header);
+    for (int i = 0; i < count; i++) {
+        memcpy(data, fragments[i].iov_base, fragments[i].iov_len);
+        data += fragments[i].iov_len;
+    }
+    slot->stream = stream;
+    slot->length = len;
+    slot->timestamp_us = monotonic_us();
+
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->frame_count, seq, __ATOMIC_RELEASE);
+
+    syscall(SYS_futex, &header->frame_count, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
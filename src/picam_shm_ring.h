@@ -0,0 +1,56 @@
+#ifndef PICAM_SHM_RING_H
+#define PICAM_SHM_RING_H
+
+#include <stdint.h>
+
+// Shared memory layout. Readers shm_open() the ring by name, map it
+// read-only and use the frames in place.
+//
+// Frame n (counting from 1) goes into slot (n - 1) % slot_count. The slot's
+// seq is zeroed while the frame is being written and set to n once it's
+// complete. A reader should load seq, use the data, and then check that seq
+// hasn't changed; if it has, the writer lapped the reader and the data is
+// garbage.
+//
+// frame_count is the number of frames published so far. It's also a futex:
+// wait on it with FUTEX_WAIT to be woken when the next frame arrives.
+
+#define PICAM_SHM_RING_MAGIC        0x4d434950 // "PICM"
+#define PICAM_SHM_RING_VERSION      1
+#define PICAM_SHM_RING_SLOTS        8
+#define PICAM_SHM_RING_SLOT_SIZE    (1024 * 1024) // default
+
+struct picam_shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size; // Bytes per slot, including its header
+    uint32_t frame_count;
+    uint32_t reserved[3];
+};
+
+struct picam_shm_slot_header
+{
+    uint32_t seq;
+    uint32_t stream; // camera number << 4 | stream ID
+    uint32_t length;
+    uint32_t reserved;
+    uint64_t timestamp_us; // CLOCK_MONOTONIC
+};
+
+typedef struct
+{
+    char *name;
+    struct picam_shm_ring_header *header;
+    size_t slot_size;
+    size_t mapping_size;
+    unsigned long frames_dropped;
+} SHM_RING_T;
+
+void picam_shm_ring_init(SHM_RING_T *ring);
+void picam_shm_ring_open(SHM_RING_T *ring, const char *name, size_t slot_size);
+void picam_shm_ring_close(SHM_RING_T *ring);
+void picam_shm_ring_publish(SHM_RING_T *ring, int stream, const struct iovec *fragments, int count, size_t len);
+
+#endif
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE // for accept4()
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "picam_socket_server.h"
+
+void picam_socket_server_init(SOCKET_SERVER_T *server)
+{
+    memset(server, 0, sizeof(*server));
+    server->listen_fd = -1;
+}
+
+void picam_socket_server_open(SOCKET_SERVER_T *server, const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        errx(EXIT_FAILURE, "Socket path too long: %s", path);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0)
+        err(EXIT_FAILURE, "socket");
+
+    // Clean up after a previous run that didn't exit cleanly
+    unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err(EXIT_FAILURE, "Could not bind to %s", path);
+
+    if (listen(server->listen_fd, PICAM_SOCKET_SERVER_MAX_CLIENTS) < 0)
+        err(EXIT_FAILURE, "listen");
+
+    server->path = strdup(path);
+}
+
+static void close_client(SOCKET_SERVER_T *server, int ix)
+{
+    SOCKET_CLIENT_T *client = &server->clients[ix];
+    close(client->fd);
+    free(client->pending);
+
+    server->client_count--;
+    if (ix != server->client_count)
+        server->clients[ix] = server->clients[server->client_count];
+    memset(&server->clients[server->client_count], 0, sizeof(SOCKET_CLIENT_T));
+}
+
+void picam_socket_server_close(SOCKET_SERVER_T *server)
+{
+    while (server->client_count)
+        close_client(server, 0);
+
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+        unlink(server->path);
+    }
+    free(server->path);
+
+    picam_socket_server_init(server);
+}
+
+int picam_socket_server_add_pollfds(SOCKET_SERVER_T *server, struct pollfd *fds)
+{
+    if (server->listen_fd < 0)
+        return 0;
+
+    fds[0].fd = server->listen_fd;
+    fds[0].events = POLLIN;
+
+    // Clients don't send anything, but POLLIN catches them hanging up.
+    int i;
+    for (i = 0; i < server->client_count; i++) {
+        fds[i + 1].fd = server->clients[i].fd;
+        fds[i + 1].events = POLLIN;
+        if (server->clients[i].pending_len)
+            fds[i + 1].events |= POLLOUT;
+    }
+    return server->client_count + 1;
+}
+
+static void accept_client(SOCKET_SERVER_T *server)
+{
+    int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            warn("accept");
+        return;
+    }
+
+    if (server->client_count == PICAM_SOCKET_SERVER_MAX_CLIENTS) {
+        warnx("Too many socket clients. Rejecting new one.");
+        close(fd);
+        return;
+    }
+
+    SOCKET_CLIENT_T *client = &server->clients[server->client_count++];
+    memset(client, 0, sizeof(SOCKET_CLIENT_T));
+    client->fd = fd;
+}
+
+// Returns false if the client should be dropped.
+static bool flush_client(SOCKET_CLIENT_T *client)
+{
+    ssize_t amount = send(client->fd,
+                          client->pending + client->pending_offset,
+                          client->pending_len - client->pending_offset,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (amount < 0)
+        return errno == EAGAIN || errno == EINTR;
+
+    client->pending_offset += amount;
+    if (client->pending_offset == client->pending_len) {
+        client->pending_len = 0;
+        client->pending_offset = 0;
+    }
+    return true;
+}
+
+void picam_socket_server_service(SOCKET_SERVER_T *server, const struct pollfd *fds)
+{
+    if (server->listen_fd < 0)
+        return;
+
+    // Go backwards so that closing a client only moves ones that have
+    // already been serviced.
+    int i;
+    for (i = server->client_count - 1; i >= 0; i--) {
+        SOCKET_CLIENT_T *client = &server->clients[i];
+        short revents = fds[i + 1].revents;
+        bool ok = true;
+
+        if (revents & (POLLERR | POLLHUP)) {
+            ok = false;
+        } else if (revents & POLLIN) {
+            char discard[64];
+            ssize_t amount = recv(client->fd, discard, sizeof(discard), MSG_DONTWAIT);
+            if (amount == 0 || (amount < 0 && errno != EAGAIN && errno != EINTR))
+                ok = false;
+        }
+
+        if (ok && (revents & POLLOUT))
+            ok = flush_client(client);
+
+        if (!ok)
+            close_client(server, i);
+    }
+
+    if (fds[0].revents & POLLIN)
+        accept_client(server);
+}
+
+static void queue_remainder(SOCKET_CLIENT_T *client, const struct iovec *iovs, int count, size_t sent, size_t len)
+{
+    // Keep the buffer around between frames so that this doesn't allocate
+    // once a slow client has been seen.
+    size_t remaining = len - sent;
+    if (remaining > client->pending_size) {
+        char *new_pending = (char *) realloc(client->pending, remaining);
+        if (!new_pending)
+            err(EXIT_FAILURE, "realloc");
+        client->pending = new_pending;
+        client->pending_size = remaining;
+    }
+
+    size_t skip = sent;
+    size_t offset = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        const char *base = (const char *) iovs[i].iov_base;
+        size_t iov_len = iovs[i].iov_len;
+        if (skip >= iov_len) {
+            skip -= iov_len;
+            continue;
+        }
+        memcpy(client->pending + offset, base + skip, iov_len - skip);
+        offset += iov_len - skip;
+        skip = 0;
+    }
+
+    client->pending_len = remaining;
+    client->pending_offset = 0;
+}
+
+void picam_socket_server_send(SOCKET_SERVER_T *server, const struct iovec *iovs, int count, size_t len)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iovs; // silence warning
+    msg.msg_iovlen = count;
+
+    int i;
+    for (i = server->client_count - 1; i >= 0; i--) {
+        SOCKET_CLIENT_T *client = &server->clients[i];
+
+        // Slow readers skip frames rather than holding up the encoder.
+        if (client->pending_len) {
+            server->frames_dropped++;
+            continue;
+        }
+
+        ssize_t amount = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (amount < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                server->frames_dropped++;
+            else
+                close_client(server, i);
+        } else if ((size_t) amount < len) {
+            queue_remainder(client, iovs, count, amount, len);
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef PICAM_SOCKET_SERVER_H
+#define PICAM_SOCKET_SERVER_H
+
+#define PICAM_SOCKET_SERVER_MAX_CLIENTS 16
+
+// Each frame is sent to every client. If a client can't take all of a frame
+// without blocking, the rest is queued here, and new frames are skipped for
+// that client until the queue drains.
+typedef struct
+{
+    int fd;
+    char *pending;
+    size_t pending_len;
+    size_t pending_offset;
+    size_t pending_size;
+} SOCKET_CLIENT_T;
+
+typedef struct
+{
+    int listen_fd;
+    char *path;
+    SOCKET_CLIENT_T clients[PICAM_SOCKET_SERVER_MAX_CLIENTS];
+    int client_count;
+    unsigned long frames_dropped;
+} SOCKET_SERVER_T;
+
+void picam_socket_server_init(SOCKET_SERVER_T *server);
+void picam_socket_server_open(SOCKET_SERVER_T *server, const char *path);
+void picam_socket_server_close(SOCKET_SERVER_T *server);
+int picam_socket_server_add_pollfds(SOCKET_SERVER_T *server, struct pollfd *fds);
+void picam_socket_server_service(SOCKET_SERVER_T *server, const struct pollfd *fds);
+void picam_socket_server_send(SOCKET_SERVER_T *server, const struct iovec *iovs, int count, size_t len);
+
+#endif
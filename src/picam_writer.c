@@ -0,0 +1,301 @@
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "picam_output_queue.h"
+#include "picam_writer.h"
+
+static PICAM_FRAME_T *new_frame(void)
+{
+    PICAM_FRAME_T *frame = (PICAM_FRAME_T *) calloc(1, sizeof(PICAM_FRAME_T));
+    if (!frame)
+        err(EXIT_FAILURE, "calloc");
+    atomic_init(&frame->refs, 1);
+    return frame;
+}
+
+PICAM_FRAME_T *picam_frame_copy(const struct iovec *iovs, int count, size_t len, bool droppable, unsigned int replace_key)
+{
+    PICAM_FRAME_T *frame = new_frame();
+    frame->copy = (char *) malloc(len);
+    if (!frame->copy)
+        err(EXIT_FAILURE, "malloc");
+
+    size_t offset = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        memcpy(frame->copy + offset, iovs[i].iov_base, iovs[i].iov_len);
+        offset += iovs[i].iov_len;
+    }
+
+    frame->iovs[0].iov_base = frame->copy;
+    frame->iovs[0].iov_len = len;
+    frame->count = 1;
+    frame->len = len;
+    frame->droppable = droppable;
+    frame->replace_key = replace_key;
+    return frame;
+}
+
+PICAM_FRAME_T *picam_frame_lend(const struct iovec *iovs, int count, size_t len, bool droppable, int header_count,
+                                void *owner, void *const *buffers, int buffer_count)
+{
+    if (count > PICAM_FRAME_MAX_IOVS || buffer_count > PICAM_FRAME_MAX_BUFFERS)
+        errx(EXIT_FAILURE, "Frame has too many fragments to lend");
+
+    // The headers are usually on the caller's stack, so they're copied.
+    PICAM_FRAME_T *frame = new_frame();
+    size_t offset = 0;
+    int i;
+    for (i = 0; i < header_count; i++) {
+        if (offset + iovs[i].iov_len > sizeof(frame->header))
+            errx(EXIT_FAILURE, "Frame headers too long");
+        memcpy(frame->header + offset, iovs[i].iov_base, iovs[i].iov_len);
+        offset += iovs[i].iov_len;
+    }
+
+    frame->iovs[0].iov_base = frame->header;
+    frame->iovs[0].iov_len = offset;
+    memcpy(&frame->iovs[1], &iovs[header_count], (count - header_count) * sizeof(struct iovec));
+    frame->count = count - header_count + 1;
+    frame->len = len;
+    frame->droppable = droppable;
+
+    frame->owner = owner;
+    memcpy(frame->buffers, buffers, buffer_count * sizeof(void *));
+    frame->buffer_count = buffer_count;
+    return frame;
+}
+
+void picam_frame_free(PICAM_FRAME_T *frame)
+{
+    free(frame->copy);
+    free(frame);
+}
+
+static void signal_fd(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+        err(EXIT_FAILURE, "write to internal eventfd broke");
+}
+
+void picam_frame_unref(WRITER_T *writer, PICAM_FRAME_T *frame)
+{
+    if (atomic_fetch_sub(&frame->refs, 1) != 1)
+        return;
+
+    if (!frame->buffer_count) {
+        picam_frame_free(frame);
+        return;
+    }
+
+    PICAM_FRAME_T *head = atomic_load(&writer->returned);
+    do {
+        frame->next = head;
+    } while (!atomic_compare_exchange_weak(&writer->returned, &head, frame));
+
+    // Only the first frame on the list needs to wake up the main loop.
+    if (!head)
+        signal_fd(writer->return_fd);
+}
+
+PICAM_FRAME_T *picam_writer_take_returned(WRITER_T *writer)
+{
+    uint64_t count;
+    if (read(writer->return_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        err(EXIT_FAILURE, "read from internal eventfd broke");
+
+    return atomic_exchange(&writer->returned, NULL);
+}
+
+static PICAM_FRAME_T *ring_pop(WRITER_T *writer)
+{
+    unsigned int head = atomic_load_explicit(&writer->head, memory_order_relaxed);
+    if (head == atomic_load(&writer->tail))
+        return NULL;
+
+    PICAM_FRAME_T *frame = writer->ring[head % PICAM_WRITER_RING_SIZE];
+    atomic_store(&writer->head, head + 1);
+    return frame;
+}
+
+static bool ring_push(WRITER_T *writer, PICAM_FRAME_T *frame)
+{
+    unsigned int tail = atomic_load_explicit(&writer->tail, memory_order_relaxed);
+    if (tail - atomic_load(&writer->head) >= PICAM_WRITER_RING_SIZE)
+        return false;
+
+    writer->ring[tail % PICAM_WRITER_RING_SIZE] = frame;
+    atomic_store(&writer->tail, tail + 1);
+
+    // Only wake the thread if it could have seen the ring empty.
+    if (atomic_load(&writer->head) == tail)
+        signal_fd(writer->wake_fd);
+    return true;
+}
+
+static void remove_from_backlog(WRITER_T *writer, unsigned int replace_key)
+{
+    PICAM_FRAME_T *prev = NULL;
+    PICAM_FRAME_T *frame;
+    for (frame = writer->backlog; frame; prev = frame, frame = frame->next) {
+        if (frame->replace_key != replace_key)
+            continue;
+
+        if (prev)
+            prev->next = frame->next;
+        else
+            writer->backlog = frame->next;
+        if (writer->backlog_tail == frame)
+            writer->backlog_tail = prev;
+        writer->backlog_replaced++;
+        picam_frame_unref(writer, frame);
+        return;
+    }
+}
+
+void picam_writer_flush(WRITER_T *writer)
+{
+    // The thread owns a frame and its next pointer once it's on the ring
+    PICAM_FRAME_T *frame;
+    while ((frame = writer->backlog)) {
+        PICAM_FRAME_T *next = frame->next;
+        if (!ring_push(writer, frame))
+            break;
+        writer->backlog = next;
+    }
+    if (!writer->backlog) {
+        writer->backlog_tail = NULL;
+        atomic_store(&writer->backlogged, false);
+    }
+}
+
+void picam_writer_push(WRITER_T *writer, PICAM_FRAME_T *frame)
+{
+    // Messages that are waiting go first so that the order is kept
+    picam_writer_flush(writer);
+    if (!writer->backlog && ring_push(writer, frame))
+        return;
+
+    // Frames can be skipped, but messages have to wait their turn.
+    if (frame->droppable) {
+        writer->frames_skipped++;
+        picam_frame_unref(writer, frame);
+        return;
+    }
+    if (frame->replace_key)
+        remove_from_backlog(writer, frame->replace_key);
+
+    frame->next = NULL;
+    if (writer->backlog_tail)
+        writer->backlog_tail->next = frame;
+    else
+        writer->backlog = frame;
+    writer->backlog_tail = frame;
+    atomic_store(&writer->backlogged, true);
+
+    // The thread may have emptied the ring before it could see the flag
+    picam_writer_flush(writer);
+}
+
+static void *writer_main(void *arg)
+{
+    WRITER_T *writer = (WRITER_T *) arg;
+
+    for (;;) {
+        PICAM_FRAME_T *frame;
+        bool popped = false;
+        while ((frame = ring_pop(writer))) {
+            picam_output_queue_write(&writer->queue, frame->iovs, frame->count, frame->len,
+                                     frame->droppable, frame->replace_key);
+            picam_frame_unref(writer, frame);
+            popped = true;
+        }
+        atomic_store(&writer->queue_length, writer->queue.count);
+        atomic_store(&writer->frames_dropped, writer->queue.frames_dropped);
+        atomic_store(&writer->messages_replaced, writer->queue.messages_replaced);
+
+        // The main loop has messages waiting for room in the ring
+        if (popped && atomic_load(&writer->backlogged))
+            signal_fd(writer->return_fd);
+
+        if (atomic_load(&writer->quit))
+            break;
+
+        struct pollfd fds[2];
+        fds[0].fd = writer->wake_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = writer->fd;
+        fds[1].events = POLLOUT;
+        int count = picam_output_queue_pending(&writer->queue) ? 2 : 1;
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "poll");
+        }
+
+        if (fds[0].revents) {
+            uint64_t wakeups;
+            if (read(writer->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+                err(EXIT_FAILURE, "read from internal eventfd broke");
+        }
+        if (count == 2 && fds[1].revents)
+            picam_output_queue_service(&writer->queue);
+    }
+    return NULL;
+}
+
+void picam_writer_start(WRITER_T *writer, int fd)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    picam_output_queue_init(&writer->queue, fd);
+
+    writer->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    writer->return_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer->wake_fd < 0 || writer->return_fd < 0)
+        err(EXIT_FAILURE, "eventfd");
+
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0)
+        errx(EXIT_FAILURE, "Could not start the writer thread");
+    writer->running = true;
+}
+
+void picam_writer_stop(WRITER_T *writer)
+{
+    if (!writer->running)
+        return;
+
+    // Everything handed over so far still gets a chance to go out. The
+    // thread never blocks on the fd, so the backlog always drains.
+    picam_writer_flush(writer);
+    while (writer->backlog) {
+        struct pollfd fd = {writer->return_fd, POLLIN, 0};
+        if (poll(&fd, 1, 100) > 0) {
+            uint64_t count;
+            if (read(writer->return_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                err(EXIT_FAILURE, "read from internal eventfd broke");
+        }
+        picam_writer_flush(writer);
+    }
+
+    atomic_store(&writer->quit, true);
+    signal_fd(writer->wake_fd);
+    pthread_join(writer->thread, NULL);
+    writer->running = false;
+
+    picam_output_queue_free(&writer->queue);
+    close(writer->wake_fd);
+    close(writer->return_fd);
+}
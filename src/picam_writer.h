@@ -0,0 +1,89 @@
+#ifndef PICAM_WRITER_H
+#define PICAM_WRITER_H
+
+#define PICAM_FRAME_MAX_IOVS      20
+#define PICAM_FRAME_HEADER_SIZE   64
+#define PICAM_FRAME_MAX_BUFFERS   16
+#define PICAM_WRITER_RING_SIZE    64
+
+// A packet on its way to a writer thread. The data is either a private
+// copy or points into encoder buffers that the main loop lent it. Each
+// holder has a reference. When the last one goes, lent frames are handed
+// back so the main loop can return the buffers to the encoder, since only
+// it touches MMAL ports.
+typedef struct picam_frame
+{
+    atomic_int refs;
+    struct iovec iovs[PICAM_FRAME_MAX_IOVS];
+    int count;
+    size_t len;
+    bool droppable;
+    unsigned int replace_key; // see OUTPUT_QUEUE_T
+
+    char header[PICAM_FRAME_HEADER_SIZE]; // the lent frame's own headers
+    char *copy;
+
+    void *owner;
+    void *buffers[PICAM_FRAME_MAX_BUFFERS];
+    int buffer_count;
+
+    struct picam_frame *next; // on the backlog, then the returned list
+} PICAM_FRAME_T;
+
+// Writes packets to fd on its own thread through an output queue, so the
+// main loop only hands them over. Frames come in on a single-producer,
+// single-consumer ring. Lent frames go back on a lock-free list and
+// return_fd is signalled.
+//
+// Pushing never waits. When the ring is full, frames are skipped and
+// messages wait on a backlog that only the main loop touches, replacing
+// any with the same replace key. return_fd is also signalled when the
+// thread has emptied the ring while there's a backlog, so that the main
+// loop can call picam_writer_flush().
+typedef struct
+{
+    int fd;
+    int wake_fd;
+    int return_fd;
+
+    PICAM_FRAME_T *ring[PICAM_WRITER_RING_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+    _Atomic(PICAM_FRAME_T *) returned;
+    atomic_bool quit;
+
+    bool running;
+    pthread_t thread;
+    OUTPUT_QUEUE_T queue; // only used by the thread
+
+    // Published by the thread for stats
+    atomic_int queue_length;
+    atomic_ulong frames_dropped;
+    atomic_ulong messages_replaced;
+
+    // Only used by the pushing thread
+    PICAM_FRAME_T *backlog;
+    PICAM_FRAME_T *backlog_tail;
+    atomic_bool backlogged;
+    unsigned long frames_skipped;
+    unsigned long backlog_replaced;
+} WRITER_T;
+
+PICAM_FRAME_T *picam_frame_copy(const struct iovec *iovs, int count, size_t len, bool droppable, unsigned int replace_key);
+PICAM_FRAME_T *picam_frame_lend(const struct iovec *iovs, int count, size_t len, bool droppable, int header_count,
+                                void *owner, void *const *buffers, int buffer_count);
+void picam_frame_unref(WRITER_T *writer, PICAM_FRAME_T *frame);
+void picam_frame_free(PICAM_FRAME_T *frame);
+
+static inline void picam_frame_ref(PICAM_FRAME_T *frame)
+{
+    atomic_fetch_add(&frame->refs, 1);
+}
+
+void picam_writer_start(WRITER_T *writer, int fd);
+void picam_writer_stop(WRITER_T *writer);
+void picam_writer_push(WRITER_T *writer, PICAM_FRAME_T *frame);
+void picam_writer_flush(WRITER_T *writer);
+PICAM_FRAME_T *picam_writer_take_returned(WRITER_T *writer);
+
+#endif
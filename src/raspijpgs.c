@@ -25,12 +25,16 @@
 #include <err.h>
 #include <ctype.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <arpa/inet.h> // for ntohl
 
@@ -45,11 +49,126 @@
 #include "interface/mmal/mmal_parameters_camera.h"
 
 #include "picam_camera.h"
+#include "picam_fake.h"
+#include "picam_histogram.h"
+#include "picam_motion.h"
+#include "picam_output_queue.h"
 #include "picam_preview.h"
-
-#define MAX_DATA_BUFFER_SIZE        262144
+#include "picam_quality.h"
+#include "picam_shm_ring.h"
+#include "picam_socket_server.h"
+#include "picam_writer.h"
+#include "picam_http_server.h"
+#include "picam_recorder.h"
+#include "picam_rtp.h"
+
+// The frame assembly buffer starts at this size and grows to fit the
+// largest frames seen. Frames over MAX_FRAME_SIZE are dropped.
+#define INITIAL_DATA_BUFFER_SIZE    262144
+#define MAX_FRAME_SIZE              (16 * 1024 * 1024)
 #define MAX_REQUEST_BUFFER_SIZE     4096
 
+// Frames that span multiple encoder buffers are written directly from the
+// MMAL buffers when possible. This is the most fragments held at once.
+#define MAX_HELD_BUFFERS            16
+
+// Make sure that the encoder has at least this many output buffers so that
+// fragments can be held without starving it.
+#define MIN_JPEGENCODER_BUFFERS     3
+
+// Packets sent to stdout are either JPEG frames or messages. Messages start
+// with MSG_MARKER and a type byte that can't be confused with a JPEG SOI.
+#define MSG_MARKER                  0xff
+#define MSG_STATS                   's'
+#define MSG_FRAME                   'f' // followed by the stream tag byte
+#define MSG_METADATA                'm' // followed by the stream tag byte and METADATA_SIZE bytes
+#define MSG_STILL                   'c' // followed by the camera byte and a full resolution JPEG
+#define MSG_MOTION                  'v' // followed by the camera byte and MOTION_SIZE bytes
+#define MSG_ACK                     'a' // key=value lines like MSG_STATS
+#define MSG_OPTIONS                 'o' // "name=id,type" lines, sent once at startup
+#define MSG_REPLY                   'r' // answers a MSG_BINARY packet, see below
+
+// Settings can also come in on stdin as binary packets rather than text
+// lines. Option ids are indexes into opts[] as announced in MSG_OPTIONS,
+// and values are typed:
+//   0xff 'B' uint32 seq, then records of
+//   uint8 id, uint8 type, uint16 length, value
+// Every one is answered with a MSG_REPLY, even if nothing could be set:
+//   uint32 seq, uint16 applied, uint16 unchanged, uint16 rebuilds,
+//   uint16 error count, then errors of uint16 record index, uint8 code
+// All numbers are big endian.
+#define MSG_BINARY                  'B'
+#define TLV_STRING                  's' // enums and commands too
+#define TLV_INT                     'i' // int32
+#define TLV_DOUBLE                  'd' // IEEE 754 double
+#define TLV_BOOL                    'b' // uint8, 0 or 1
+#define TLV_ERROR_UNKNOWN           1   // no option with that id
+#define TLV_ERROR_TYPE              2   // the option doesn't take that type
+#define TLV_ERROR_VALUE             3   // not one of the option's values
+#define TLV_ERROR_MALFORMED         4   // bad length; records after it are skipped
+#define MAX_TLV_ERRORS              64
+
+// Stream tags have the camera number in the upper 4 bits and the stream ID
+// in the lower 4. Only camera 0's main stream is sent untagged.
+#define STREAM_TAG(camera, id)      ((char) (((camera) << 4) | (id)))
+
+// Motion events are sent for each H.264 frame with enough moving
+// macroblocks, and once more when the motion stops:
+//   uint32 frame sequence number of the main stream
+//   uint16 macroblocks that moved
+//   uint16 macroblocks in the frame
+//   uint8  left, top, right, bottom of the moving area in macroblocks
+//   uint64 PICAM_MOTION_GRID x PICAM_MOTION_GRID bitmap of where things moved
+// All are big endian.
+#define MOTION_SIZE                 20
+
+// With metadata on, each frame from every stream is prefixed by:
+//   int64  pts in microseconds from the camera's STC, -1 if unknown
+//   uint32 frame sequence number for the stream
+//   uint32 frames dropped by raspijpgs for the stream so far
+//   uint32 exposure time in microseconds
+//   uint32 analog gain (16.16 fixed point)
+//   uint32 digital gain (16.16 fixed point)
+// All are big endian. The exposure and gains are 0 until the camera
+// reports them.
+#define METADATA_SIZE               28
+
+// The main stream plus up to 3 scaled streams from the video splitter
+#define MAX_STREAMS                 4
+
+// Cameras are indexed by MMAL_PARAMETER_CAMERA_NUM. The Compute Module has
+// two connectors, but the firmware reports up to 4.
+#define MAX_CAMERAS                 4
+
+// H.264 level 4 tops out at 25 Mbps
+#define MAX_H264_BITRATE            25000000
+
+// Fake mode's frame rate when fps is 0. It can't go below 1 fps, since the
+// main loop gives up after 2 seconds without hearing from the camera.
+#define FAKE_DEFAULT_FPS            30
+
+// Buffer depths. 0 for either option picks these defaults. The high
+// frame rate sensor modes (6 and 7 on both the V1 and V2 modules) get
+// deeper queues to ride out scheduling jitter. Otherwise the encoder's
+// recommended count is used.
+#define MAX_ENCODER_BUFFERS         32
+#define HIGH_RATE_ENCODER_BUFFERS   6
+#define MAX_CAMERA_FRAMES           16
+#define DEFAULT_CAMERA_FRAMES       3
+#define HIGH_RATE_CAMERA_FRAMES     4
+#define HIGH_RATE_FPS               60
+
+// Encoder callbacks are handed to the main loop through a ring of this many
+// entries. It must be a power of 2 and larger than the encoder buffer pool.
+#define CALLBACK_RING_SIZE          64
+
+// With a settings file, the camera's exposure and white balance are saved
+// for the next run to start from whenever the pipeline stops. In case the
+// process doesn't get that far, they're also saved this often while
+// running, but only if one has moved by more than 1/SETTINGS_SAVE_TOLERANCE.
+#define SETTINGS_SAVE_INTERVAL_US   300000000
+#define SETTINGS_SAVE_TOLERANCE     8
+
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
 //
@@ -57,7 +176,8 @@
 // See https://www.raspberrypi.org/forums/viewtopic.php?p=1152920&sid=b3a527262eddeb8e00bfcb01dab2036c#p1152920
 //
 
-// Environment config keys
+// Environment config keys. These only provide the starting values. See
+// load_parameters().
 #define RASPIJPGS_SIZE              "RASPIJPGS_SIZE"
 #define RASPIJPGS_FPS               "RASPIJPGS_FPS"
 #define RASPIJPGS_ANNOTATION        "RASPIJPGS_ANNOTATION"
@@ -82,41 +202,324 @@
 #define RASPIJPGS_SHUTTER           "RASPIJPGS_SHUTTER"
 #define RASPIJPGS_QUALITY           "RASPIJPGS_QUALITY"
 #define RASPIJPGS_RESTART_INTERVAL  "RASPIJPGS_RESTART_INTERVAL"
+#define RASPIJPGS_TARGET_BITRATE    "RASPIJPGS_TARGET_BITRATE"
+#define RASPIJPGS_MAX_FRAME_SIZE    "RASPIJPGS_MAX_FRAME_SIZE"
+#define RASPIJPGS_MIN_QUALITY       "RASPIJPGS_MIN_QUALITY"
 #define RASPIJPGS_PREVIEW           "RASPIJPGS_PREVIEW"
 #define RASPIJPGS_PREVIEW_FULLSCREEN "RASPIJPGS_PREVIEW_FULLSCREEN"
 #define RASPIJPGS_PREVIEW_WINDOW    "RASPIJPGS_PREVIEW_WINDOW"
+#define RASPIJPGS_STREAMS           "RASPIJPGS_STREAMS"
+#define RASPIJPGS_CODEC             "RASPIJPGS_CODEC"
+#define RASPIJPGS_BITRATE           "RASPIJPGS_BITRATE"
+#define RASPIJPGS_INTRA_PERIOD      "RASPIJPGS_INTRA_PERIOD"
+#define RASPIJPGS_INLINE_HEADERS    "RASPIJPGS_INLINE_HEADERS"
+#define RASPIJPGS_SOCKET            "RASPIJPGS_SOCKET"
+#define RASPIJPGS_SHM               "RASPIJPGS_SHM"
+#define RASPIJPGS_HTTP              "RASPIJPGS_HTTP"
+#define RASPIJPGS_RTP               "RASPIJPGS_RTP"
+#define RASPIJPGS_RTP_MTU           "RASPIJPGS_RTP_MTU"
+#define RASPIJPGS_RECORD_DIR        "RASPIJPGS_RECORD_DIR"
+#define RASPIJPGS_RECORD_BUFFER     "RASPIJPGS_RECORD_BUFFER"
+#define RASPIJPGS_RECORD_PREROLL    "RASPIJPGS_RECORD_PREROLL"
+#define RASPIJPGS_RECORD_SEGMENT    "RASPIJPGS_RECORD_SEGMENT"
+#define RASPIJPGS_SHM_SLOT_SIZE     "RASPIJPGS_SHM_SLOT_SIZE"
+#define RASPIJPGS_RAW               "RASPIJPGS_RAW"
+#define RASPIJPGS_METADATA          "RASPIJPGS_METADATA"
+#define RASPIJPGS_BUFFERS           "RASPIJPGS_BUFFERS"
+#define RASPIJPGS_STILL_QUALITY     "RASPIJPGS_STILL_QUALITY"
+#define RASPIJPGS_MOTION            "RASPIJPGS_MOTION"
+#define RASPIJPGS_MOTION_THRESHOLD  "RASPIJPGS_MOTION_THRESHOLD"
+#define RASPIJPGS_MOTION_BLOCKS     "RASPIJPGS_MOTION_BLOCKS"
+#define RASPIJPGS_CAMERA_FRAMES     "RASPIJPGS_CAMERA_FRAMES"
+#define RASPIJPGS_CAMERAS           "RASPIJPGS_CAMERAS"
+#define RASPIJPGS_SETTINGS_FILE     "RASPIJPGS_SETTINGS_FILE"
+#define RASPIJPGS_FAKE              "RASPIJPGS_FAKE"
+
+// Options in opts[] order
+enum option_id
+{
+    OPT_SIZE,
+    OPT_ANNOTATION,
+    OPT_ANNO_BACKGROUND,
+    OPT_SHARPNESS,
+    OPT_CONTRAST,
+    OPT_BRIGHTNESS,
+    OPT_SATURATION,
+    OPT_ISO,
+    OPT_VSTAB,
+    OPT_EV,
+    OPT_EXPOSURE,
+    OPT_FPS,
+    OPT_AWB,
+    OPT_IMXFX,
+    OPT_COLFX,
+    OPT_MODE,
+    OPT_METERING,
+    OPT_ROTATION,
+    OPT_HFLIP,
+    OPT_VFLIP,
+    OPT_ROI,
+    OPT_SHUTTER,
+    OPT_QUALITY,
+    OPT_RESTART_INTERVAL,
+    OPT_TARGET_BITRATE,
+    OPT_MAX_FRAME_SIZE,
+    OPT_MIN_QUALITY,
+    OPT_PREVIEW,
+    OPT_PREVIEW_FULLSCREEN,
+    OPT_PREVIEW_WINDOW,
+    OPT_CODEC,
+    OPT_BITRATE,
+    OPT_INTRA_PERIOD,
+    OPT_INLINE_HEADERS,
+    OPT_METADATA,
+    OPT_BUFFERS,
+    OPT_CAMERA_FRAMES,
+    OPT_SOCKET,
+    OPT_SHM,
+    OPT_HTTP,
+    OPT_RTP,
+    OPT_RTP_MTU,
+    OPT_RECORD_DIR,
+    OPT_RECORD_BUFFER,
+    OPT_RECORD_PREROLL,
+    OPT_RECORD_SEGMENT,
+    OPT_MOTION,
+    OPT_MOTION_THRESHOLD,
+    OPT_MOTION_BLOCKS,
+    OPT_SHM_SLOT_SIZE,
+    OPT_RAW,
+    OPT_STREAMS,
+    OPT_SETTINGS_FILE,
+    OPT_CAMERAS,
+    OPT_FAKE,
+    OPT_HELP,
+    OPT_STATS,
+    OPT_STILL_QUALITY,
+    OPT_CAMERA,
+    OPT_ACK,
+    OPT_CAPTURE_STILL,
+    OPT_PAUSE,
+    OPT_RESUME,
+    OPT_RECORD_START,
+    OPT_RECORD_STOP,
+    OPT_COUNT
+};
 
 // Globals
 
+struct callback_entry
+{
+    MMAL_PORT_T *port;
+    MMAL_BUFFER_HEADER_T *buffer;
+    uint64_t queued_us;
+};
+
+// Single-producer (MMAL callback thread), single-consumer (main loop) ring
+struct callback_ring
+{
+    struct callback_entry entries[CALLBACK_RING_SIZE];
+    atomic_uint head; // next entry to read
+    atomic_uint tail; // next entry to write
+};
+
+// Encoded output stream. Stream 0 is the main stream at the configured size.
+// The others are scaled copies of it that are fed by a video splitter.
+struct picam_stream
+{
+    bool still; // the one-shot full resolution encoder on the still port
+    bool raw;   // uncompressed frames from the ISP for the socket and shm ring
+    int camera;
+    int id;
+    MMAL_FOURCC_T encoding; // MMAL_ENCODING_JPEG or MMAL_ENCODING_H264
+    int width;
+    int height;
+    int quality;
+
+    // H.264 settings that need the encoder to be rebuilt to change
+    int intra_period;
+    bool inline_headers;
+    bool inline_vectors;
+
+    // MMAL resources
+    MMAL_COMPONENT_T *resizer; // only for scaled streams
+    MMAL_COMPONENT_T *encoder;
+    MMAL_CONNECTION_T *con_in; // camera or splitter -> resizer or encoder
+    MMAL_CONNECTION_T *con_resizer; // resizer -> encoder
+    MMAL_POOL_T *pool;
+
+    // MMAL callback -> main loop
+    struct callback_ring callback_ring;
+
+    // Frame assembly (copy path)
+    char *frame_buffer;
+    int frame_buffer_ix;
+    int frame_buffer_size;
+    int peak_frame_size;
+
+    // Fragments of the frame currently being received (zero-copy path)
+    MMAL_BUFFER_HEADER_T *held_buffers[MAX_HELD_BUFFERS];
+    int held_buffer_count;
+    int held_length;
+    int lent_frames; // with the stdout writer until it hands them back
+
+    // Frame metadata
+    int64_t frame_pts;
+    uint32_t frame_sequence;
+    uint32_t frames_dropped;
+
+    // Demand mode. STC minus monotonic time as of the last frame, and frames
+    // older than stale_pts after resuming.
+    int64_t pts_offset;
+    int64_t stale_pts;
+
+    // Throughput
+    uint32_t frames_oversized;
+    uint32_t pool_starvations;
+    uint64_t frames_output;
+    uint64_t bytes_output;
+    uint64_t frames_at_last_report;
+    uint64_t bytes_at_last_report;
+};
+
+// Timings in microseconds, collected since the last stats report
+struct pipeline_timings
+{
+    HISTOGRAM_T callback_latency; // encoder callback -> main loop
+    HISTOGRAM_T assembly;         // handling a buffer, minus writing
+    HISTOGRAM_T write;            // handing a frame to the stdout writer
+    uint64_t write_total;
+    uint64_t last_report;
+};
+
+// An option's value, parsed when it's set. str always has the text.
+// number holds ints, bools and enums. real holds floats.
+struct param
+{
+    char *str;
+    long number;
+    double real;
+};
+
+// Everything that belongs to one camera. Each one has its own options.
+struct camera_pipeline
+{
+    int num; // MMAL_PARAMETER_CAMERA_NUM
+    bool enabled;
+
+    // Preview
+    PREVIEW_CONFIG_T preview;
+
+    // Whether the last motion vectors had enough motion to report
+    bool moving;
+
+    // Steers the main stream's JPEG quality towards the size targets
+    QUALITY_CONTROL_T quality_control;
+
+    // Annotation text as last sent to the camera, and when it was expanded.
+    // Timestamps in it are rechecked once a second.
+    char annotation[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3];
+    bool annotation_sent;
+    time_t annotation_time;
+
+    // Settings. Current values, values as of their last apply, and which
+    // ones were set in the packet being processed.
+    struct param params[OPT_COUNT];
+    char *applied[OPT_COUNT];
+    bool touched[OPT_COUNT];
+    bool rebuild_pending;
+
+    // Buffer depths as requested (0 = auto)
+    int encoder_buffers;
+    int camera_frames;
+
+    // Reported by the camera
+    CAMERA_SETTINGS_T camera_settings;
+
+    // Fast start. Whether the camera is still running on settings from the
+    // settings file, and what was last saved to it.
+    bool seeded;
+    CAMERA_SETTINGS_T saved_settings;
+    uint64_t settings_saved_at;
+
+    // Streams
+    struct picam_stream streams[MAX_STREAMS];
+    int stream_count;
+
+    // Created on the first capture_still
+    struct picam_stream still;
+
+    // MMAL resources
+    MMAL_COMPONENT_T *camera;
+    MMAL_COMPONENT_T *splitter; // only when there are scaled streams
+    MMAL_CONNECTION_T *con_cam_splitter;
+};
+
 struct raspijpgs_state
 {
     // Sensor
     MMAL_PARAMETER_CAMERA_INFO_T sensor_info;
 
-    // Preview
-    PREVIEW_CONFIG_T preview;
+    // Indexed by camera number. cam is the one that options and commands
+    // currently apply to.
+    struct camera_pipeline cameras[MAX_CAMERAS];
+    struct camera_pipeline *cam;
 
-    // Current settings
-    int width;
-    int height;
+    // Encoders get no output buffers while paused
+    bool paused;
+
+    // Each stdin packet is applied as one batch
+    struct {
+        bool active;
+        bool ack;
+        int unknown;
+
+        // Results, as of the last apply_batch()
+        int applied;
+        int unchanged;
+        int rebuilds;
+    } batch;
+
+    bool metadata;
+
+    // Instrumentation
+    struct pipeline_timings timings;
 
     // Communication
-    char *socket_buffer;
-    int socket_buffer_ix;
+    WRITER_T stdout_writer;
     char *stdin_buffer;
     int stdin_buffer_ix;
+    SOCKET_SERVER_T socket_server;
+    HTTP_SERVER_T http_server;
+    RTP_SENDER_T rtp;
+    RECORDER_T recorder;
+    SHM_RING_T shm_ring;
+
+    // Wakes up the main loop when a callback ring has entries
+    int mmal_callback_eventfd;
+
+    // Replaying a clip on camera 0's main stream instead of running MMAL
+    bool fake;
+    FAKE_CLIP_T fake_clip;
+    int fake_timerfd;
+};
 
-    // MMAL resources
-    MMAL_COMPONENT_T *camera;
-    MMAL_COMPONENT_T *jpegencoder;
-    MMAL_CONNECTION_T *con_cam_video;
-    MMAL_POOL_T *pool_jpegencoder;
+static struct raspijpgs_state state;
 
-    // MMAL callback -> main loop
-    int mmal_callback_pipe[2];
+enum param_type
+{
+    PARAM_STRING = 0,
+    PARAM_INT,
+    PARAM_FLOAT,
+    PARAM_BOOL,
+    PARAM_ENUM
 };
 
-static struct raspijpgs_state state;
+struct param_name
+{
+    const char *name;
+    int value;
+};
 
 struct raspi_config_opt
 {
@@ -133,24 +536,119 @@ struct raspi_config_opt
 
     // Apply the option (called on every option)
     void (*apply)(const struct raspi_config_opt *, bool fail_on_error);
+
+    // How set values are parsed. Enums are looked up in names.
+    enum param_type type;
+    const struct param_name *names;
 };
 static struct raspi_config_opt opts[];
 
 static void stop_all();
 static void start_all();
+static void rebuild_pipeline();
+static void resize_all(int width, int height);
+static void restart_stream(struct picam_stream *stream);
+
+// These options are shared by all cameras and kept with camera 0's. The
+// rest are per camera.
+static bool is_global_option(int id)
+{
+    return id == OPT_SOCKET ||
+           id == OPT_SHM ||
+           id == OPT_HTTP ||
+           id == OPT_RTP ||
+           id == OPT_RTP_MTU ||
+           id == OPT_RECORD_DIR ||
+           id == OPT_RECORD_BUFFER ||
+           id == OPT_RECORD_PREROLL ||
+           id == OPT_RECORD_SEGMENT ||
+           id == OPT_SHM_SLOT_SIZE ||
+           id == OPT_METADATA ||
+           id == OPT_CAMERAS ||
+           id == OPT_FAKE;
+}
+
+// Without a camera, only the outputs and the frame rate do anything
+static bool option_applies(int id)
+{
+    return !state.fake || is_global_option(id) || id == OPT_FPS;
+}
+
+static int opt_id(const struct raspi_config_opt *opt)
+{
+    return opt - opts;
+}
+
+static struct param *param_slot(int id)
+{
+    return is_global_option(id) ? &state.cameras[0].params[id] : &state.cam->params[id];
+}
+
+static const char *param_str(int id)
+{
+    return param_slot(id)->str;
+}
+
+static long param_int(int id)
+{
+    return param_slot(id)->number;
+}
+
+static bool param_bool(int id)
+{
+    return param_slot(id)->number != 0;
+}
+
+static double param_float(int id)
+{
+    return param_slot(id)->real;
+}
+
+static bool parse_param(const struct raspi_config_opt *opt, const char *value, struct param *param)
+{
+    long number = 0;
+    double real = 0;
+    switch (opt->type) {
+    case PARAM_STRING:
+        break;
+    case PARAM_INT:
+        number = strtol(value, 0, 0);
+        break;
+    case PARAM_FLOAT:
+        real = strtod(value, 0);
+        break;
+    case PARAM_BOOL:
+        number = (strcmp(value, "on") == 0);
+        break;
+    case PARAM_ENUM: {
+        const struct param_name *n;
+        for (n = opt->names; n->name; n++) {
+            if (strcmp(n->name, value) == 0)
+                break;
+        }
+        if (!n->name)
+            return false;
+        number = n->value;
+        break;
+    }
+    }
+
+    free(param->str);
+    param->str = strdup(value);
+    param->number = number;
+    param->real = real;
+    return true;
+}
 
 static void default_set(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
 {
     if (!opt->env_key)
         return;
 
-    if (value) {
-        if (setenv(opt->env_key, value, 1 /*replace*/) < 0)
-            err(EXIT_FAILURE, "Error setting %s to %s", opt->env_key, opt->default_value);
-    } else {
-        if (unsetenv(opt->env_key) < 0)
-            err(EXIT_FAILURE, "Error unsetting %s", opt->env_key);
-    }
+    if (!value)
+        value = opt->default_value;
+    if (!parse_param(opt, value, param_slot(opt_id(opt))) && fail_on_error)
+        errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
 }
 
 static int constrain(int minimum, int value, int maximum)
@@ -173,17 +671,10 @@ static float constrainf(float minimum, float value, float maximum)
         return value;
 }
 
-static void parse_requested_dimensions(int *width, int *height)
+static void parse_dimensions(const char *str, int max_width, int max_height, int *width, int *height)
 {
-    // Find out the max dimensions for calculations below.
-    // Only the first imager is currently supported.
-
-    int imager_width = state.sensor_info.cameras[0].max_width;
-    int imager_height = state.sensor_info.cameras[0].max_height;
-
     int raw_width;
     int raw_height;
-    const char *str = getenv(RASPIJPGS_SIZE);
     if (sscanf(str, "%d,%d", &raw_width, &raw_height) != 2 ||
             (raw_height <= 0 && raw_width <= 0)) {
         // Use defaults
@@ -191,8 +682,8 @@ static void parse_requested_dimensions(int *width, int *height)
         raw_height = 0;
     }
 
-    raw_width = constrain(0, raw_width, imager_width);
-    raw_height = constrain(0, raw_height, imager_height);
+    raw_width = constrain(0, raw_width, max_width);
+    raw_height = constrain(0, raw_height, max_height);
 
     // Force to multiple of 16 for JPEG encoder
     raw_width &= ~0xf;
@@ -201,10 +692,10 @@ static void parse_requested_dimensions(int *width, int *height)
     // Check if the user wants us to auto-calculate one of
     // the dimensions.
     if (raw_height == 0) {
-        raw_height = imager_height * raw_width / imager_width;
+        raw_height = max_height * raw_width / max_width;
         raw_height &= ~0xf;
     } else if (raw_width == 0) {
-        raw_width = imager_width * raw_height / imager_height;
+        raw_width = max_width * raw_height / max_height;
         raw_width &= ~0xf;
     }
 
@@ -212,7 +703,100 @@ static void parse_requested_dimensions(int *width, int *height)
     *height = raw_height;
 }
 
+static void parse_requested_dimensions(int *width, int *height)
+{
+    // Find out the max dimensions for calculations below.
+    int imager_width = state.sensor_info.cameras[state.cam->num].max_width;
+    int imager_height = state.sensor_info.cameras[state.cam->num].max_height;
+
+    parse_dimensions(param_str(OPT_SIZE), imager_width, imager_height, width, height);
+}
+
+struct stream_config
+{
+    int width;
+    int height;
+    int quality;
+};
+
+static MMAL_FOURCC_T parse_requested_raw(int main_width, int main_height, struct stream_config *config)
+{
+    // The raw stream is "w,h[,i420|rgb]", sized like the scaled streams. It
+    // defaults to I420, which is what the camera produces.
+    const char *spec = param_str(OPT_RAW);
+    if (*spec == '\0')
+        return 0;
+
+    int width, height;
+    char format[8];
+    int fields = sscanf(spec, "%d,%d,%7s", &width, &height, format);
+    if (fields < 2) {
+        warnx("Invalid raw stream '%s'", spec);
+        return 0;
+    }
+
+    MMAL_FOURCC_T encoding = MMAL_ENCODING_I420;
+    if (fields == 3) {
+        if (strcmp(format, "rgb") == 0)
+            encoding = MMAL_ENCODING_RGB24;
+        else if (strcmp(format, "i420") != 0) {
+            warnx("Unknown raw format '%s'", format);
+            return 0;
+        }
+    }
+
+    parse_dimensions(spec, main_width, main_height, &config->width, &config->height);
+    config->quality = 0;
+    return encoding;
+}
+
+static int parse_requested_streams(int main_width, int main_height, struct stream_config *configs)
+{
+    // Scaled streams are specified as "w,h[,quality];w,h[,quality]...". The
+    // sizes are relative to the main stream, so one of them may be 0 to
+    // keep its aspect ratio. Quality defaults to the main stream's.
+    int default_quality = constrain(0, param_int(OPT_QUALITY), 100);
+    char *str = strdup(param_str(OPT_STREAMS));
+    int count = 0;
+    char *saveptr;
+    char *spec;
+    for (spec = strtok_r(str, ";", &saveptr); spec; spec = strtok_r(NULL, ";", &saveptr)) {
+        int width, height, quality;
+        int fields = sscanf(spec, "%d,%d,%d", &width, &height, &quality);
+        if (fields < 2) {
+            warnx("Invalid stream '%s'", spec);
+            continue;
+        }
+        if (fields < 3)
+            quality = default_quality;
+
+        if (count == MAX_STREAMS - 1) {
+            warnx("Only %d scaled streams are supported. Ignoring '%s'", MAX_STREAMS - 1, spec);
+            continue;
+        }
+        parse_dimensions(spec, main_width, main_height, &configs[count].width, &configs[count].height);
+        configs[count].quality = constrain(0, quality, 100);
+        count++;
+    }
+    free(str);
+    return count;
+}
+
 static void help(const struct raspi_config_opt *opt, const char *value, bool fail_on_error);
+static void stats(const struct raspi_config_opt *opt, const char *value, bool fail_on_error);
+static void pause_encoding(const struct raspi_config_opt *opt, const char *value, bool fail_on_error);
+static void capture_still(const struct raspi_config_opt *opt, const char *value, bool fail_on_error);
+static void resume_encoding(const struct raspi_config_opt *opt, const char *value, bool fail_on_error);
+static void record_start(const struct raspi_config_opt *opt, const char *value, bool fail_on_error);
+static void record_stop(const struct raspi_config_opt *opt, const char *value, bool fail_on_error);
+static void apply_touched();
+
+static struct picam_stream *raw_stream()
+{
+    // The raw stream is always last
+    struct picam_stream *stream = &state.cam->streams[state.cam->stream_count - 1];
+    return stream->raw ? stream : NULL;
+}
 
 static void size_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
@@ -223,65 +807,127 @@ static void size_apply(const struct raspi_config_opt *opt, bool fail_on_error)
     int desired_height;
     parse_requested_dimensions(&desired_width, &desired_height);
 
-    if (desired_width != state.width ||
-            desired_height != state.height) {
-        stop_all();
+    if (desired_width == state.cam->streams[0].width &&
+            desired_height == state.cam->streams[0].height)
+        return;
+
+    // Scaled streams are sized from the main one, and the raw and H.264
+    // outputs have their sizes committed when they're created. Only a
+    // lone JPEG stream follows the camera on its own.
+    if (state.cam->stream_count > 1 || state.cam->streams[0].encoding != MMAL_ENCODING_JPEG)
+        rebuild_pipeline();
+    else
+        resize_all(desired_width, desired_height);
+}
+
+static void streams_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    struct stream_config configs[MAX_STREAMS - 1];
+    int count = parse_requested_streams(state.cam->streams[0].width, state.cam->streams[0].height, configs);
+
+    bool changed = (count != state.cam->stream_count - 1 - (raw_stream() ? 1 : 0));
+    int i;
+    for (i = 0; i < count && !changed; i++) {
+        const struct picam_stream *stream = &state.cam->streams[i + 1];
+        changed = (configs[i].width != stream->width ||
+                   configs[i].height != stream->height ||
+                   configs[i].quality != stream->quality);
+    }
 
-        state.width = desired_width;
-        state.height = desired_height;
+    // Adding or removing a splitter branch changes the whole pipeline.
+    if (changed) {
+        rebuild_pipeline();
+    }
+}
 
-        start_all();
+// strftime codes in the annotation are expanded here, since the firmware
+// draws the text as is. That only has to be redone when the second
+// changes, and the camera is only told when the text did.
+static bool update_annotation(struct camera_pipeline *cam, bool force)
+{
+    if (!cam->camera)
+        return true;
+
+    const char *format = cam->params[OPT_ANNOTATION].str;
+    bool timestamped = strchr(format, '%') != NULL;
+    time_t now = time(NULL);
+    if (!force && (!timestamped || now == cam->annotation_time))
+        return true;
+    cam->annotation_time = now;
+
+    char text[MMAL_CAMERA_ANNOTATE_MAX_TEXT_LEN_V3];
+    if (timestamped) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        if (strftime(text, sizeof(text), format, &tm) == 0)
+            text[0] = '\0';
+    } else {
+        snprintf(text, sizeof(text), "%s", format);
     }
+
+    if (!force && cam->annotation_sent && strcmp(text, cam->annotation) == 0)
+        return true;
+
+    cam->annotation_sent = picam_camera_set_annotation(cam->camera, text, cam->params[OPT_ANNO_BACKGROUND].number);
+    strcpy(cam->annotation, text);
+    return cam->annotation_sent;
 }
 
-static void annotation_apply(const struct raspi_config_opt *opt, bool fail_on_error) {
-    UNUSED(opt);
+static void annotation_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    if (!update_annotation(state.cam, true) && fail_on_error)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
-static void anno_background_apply(const struct raspi_config_opt *opt, bool fail_on_error) {
-    UNUSED(opt);
+static void anno_background_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    if (!update_annotation(state.cam, true) && fail_on_error)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
-static void rational_param_apply(int mmal_param, const struct raspi_config_opt *opt, bool fail_on_error)
+static void rational_param_apply(int mmal_param, int min, const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    unsigned int value = strtoul(getenv(opt->env_key), 0, 0);
-    if (value > 100) {
+    int value = param_int(opt_id(opt));
+    if (value < min || value > 100) {
         if (fail_on_error)
-            errx(EXIT_FAILURE, "%s must be between 0 and 100", opt->long_option);
+            errx(EXIT_FAILURE, "%s must be between %d and 100", opt->long_option, min);
         else
             return;
     }
     MMAL_RATIONAL_T mmal_value = {value, 100};
-    MMAL_STATUS_T status = mmal_port_parameter_set_rational(state.camera->control, mmal_param, mmal_value);
+    MMAL_STATUS_T status = mmal_port_parameter_set_rational(state.cam->camera->control, mmal_param, mmal_value);
     if(status != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s (%d)", opt->long_option, status);
 }
 
 static void sharpness_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    rational_param_apply(MMAL_PARAMETER_SHARPNESS, opt, fail_on_error);
+    rational_param_apply(MMAL_PARAMETER_SHARPNESS, -100, opt, fail_on_error);
 }
 
 static void contrast_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    rational_param_apply(MMAL_PARAMETER_CONTRAST, opt, fail_on_error);
+    rational_param_apply(MMAL_PARAMETER_CONTRAST, -100, opt, fail_on_error);
 }
 
 static void brightness_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    rational_param_apply(MMAL_PARAMETER_BRIGHTNESS, opt, fail_on_error);
+    rational_param_apply(MMAL_PARAMETER_BRIGHTNESS, 0, opt, fail_on_error);
 }
 
 static void saturation_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    rational_param_apply(MMAL_PARAMETER_SATURATION, opt, fail_on_error);
+    rational_param_apply(MMAL_PARAMETER_SATURATION, -100, opt, fail_on_error);
 }
 
 static void ISO_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     UNUSED(fail_on_error);
-    unsigned int value = strtoul(getenv(opt->env_key), 0, 0);
-    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(state.camera->control, MMAL_PARAMETER_ISO, value);
+    unsigned int value = param_int(opt_id(opt));
+    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(state.cam->camera->control, MMAL_PARAMETER_ISO, value);
     if(status != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
@@ -289,8 +935,8 @@ static void ISO_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 static void vstab_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     UNUSED(fail_on_error);
-    unsigned int value = (strcmp(getenv(opt->env_key), "on") == 0);
-    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(state.camera->control, MMAL_PARAMETER_VIDEO_STABILISATION, value);
+    unsigned int value = param_bool(opt_id(opt));
+    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(state.cam->camera->control, MMAL_PARAMETER_VIDEO_STABILISATION, value);
     if(status != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
@@ -298,104 +944,33 @@ static void vstab_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 static void ev_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     UNUSED(fail_on_error);
-    unsigned int value = strtoul(getenv(opt->env_key), 0, 0);
-    MMAL_STATUS_T status = mmal_port_parameter_set_int32(state.camera->control, MMAL_PARAMETER_EXPOSURE_COMP, value);
+    int value = param_int(opt_id(opt));
+    MMAL_STATUS_T status = mmal_port_parameter_set_int32(state.cam->camera->control, MMAL_PARAMETER_EXPOSURE_COMP, value);
     if(status != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
 static void exposure_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    MMAL_PARAM_EXPOSUREMODE_T mode;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "off") == 0) mode = MMAL_PARAM_EXPOSUREMODE_OFF;
-    else if(strcmp(str, "auto") == 0) mode = MMAL_PARAM_EXPOSUREMODE_AUTO;
-    else if(strcmp(str, "night") == 0) mode = MMAL_PARAM_EXPOSUREMODE_NIGHT;
-    else if(strcmp(str, "nightpreview") == 0) mode = MMAL_PARAM_EXPOSUREMODE_NIGHTPREVIEW;
-    else if(strcmp(str, "backlight") == 0) mode = MMAL_PARAM_EXPOSUREMODE_BACKLIGHT;
-    else if(strcmp(str, "spotlight") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SPOTLIGHT;
-    else if(strcmp(str, "sports") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SPORTS;
-    else if(strcmp(str, "snow") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SNOW;
-    else if(strcmp(str, "beach") == 0) mode = MMAL_PARAM_EXPOSUREMODE_BEACH;
-    else if(strcmp(str, "verylong") == 0) mode = MMAL_PARAM_EXPOSUREMODE_VERYLONG;
-    else if(strcmp(str, "fixedfps") == 0) mode = MMAL_PARAM_EXPOSUREMODE_FIXEDFPS;
-    else if(strcmp(str, "antishake") == 0) mode = MMAL_PARAM_EXPOSUREMODE_ANTISHAKE;
-    else if(strcmp(str, "fireworks") == 0) mode = MMAL_PARAM_EXPOSUREMODE_FIREWORKS;
-    else {
-        if (fail_on_error)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
-            return;
-    }
-
-    MMAL_PARAMETER_EXPOSUREMODE_T param = {{MMAL_PARAMETER_EXPOSURE_MODE,sizeof(param)}, mode};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
+    UNUSED(fail_on_error);
+    MMAL_PARAMETER_EXPOSUREMODE_T param = {{MMAL_PARAMETER_EXPOSURE_MODE,sizeof(param)}, param_int(opt_id(opt))};
+    if (mmal_port_parameter_set(state.cam->camera->control, &param.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
 static void awb_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    MMAL_PARAM_AWBMODE_T awb_mode;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "off") == 0) awb_mode = MMAL_PARAM_AWBMODE_OFF;
-    else if(strcmp(str, "auto") == 0) awb_mode = MMAL_PARAM_AWBMODE_AUTO;
-    else if(strcmp(str, "sun") == 0) awb_mode = MMAL_PARAM_AWBMODE_SUNLIGHT;
-    else if(strcmp(str, "cloudy") == 0) awb_mode = MMAL_PARAM_AWBMODE_CLOUDY;
-    else if(strcmp(str, "shade") == 0) awb_mode = MMAL_PARAM_AWBMODE_SHADE;
-    else if(strcmp(str, "tungsten") == 0) awb_mode = MMAL_PARAM_AWBMODE_TUNGSTEN;
-    else if(strcmp(str, "fluorescent") == 0) awb_mode = MMAL_PARAM_AWBMODE_FLUORESCENT;
-    else if(strcmp(str, "incandescent") == 0) awb_mode = MMAL_PARAM_AWBMODE_INCANDESCENT;
-    else if(strcmp(str, "flash") == 0) awb_mode = MMAL_PARAM_AWBMODE_FLASH;
-    else if(strcmp(str, "horizon") == 0) awb_mode = MMAL_PARAM_AWBMODE_HORIZON;
-    else {
-        if (fail_on_error)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
-            return;
-    }
-    MMAL_PARAMETER_AWBMODE_T param = {{MMAL_PARAMETER_AWB_MODE,sizeof(param)}, awb_mode};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
+    UNUSED(fail_on_error);
+    MMAL_PARAMETER_AWBMODE_T param = {{MMAL_PARAMETER_AWB_MODE,sizeof(param)}, param_int(opt_id(opt))};
+    if (mmal_port_parameter_set(state.cam->camera->control, &param.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
 static void imxfx_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    MMAL_PARAM_IMAGEFX_T imageFX;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "none") == 0) imageFX = MMAL_PARAM_IMAGEFX_NONE;
-    else if(strcmp(str, "negative") == 0) imageFX = MMAL_PARAM_IMAGEFX_NEGATIVE;
-    else if(strcmp(str, "solarise") == 0) imageFX = MMAL_PARAM_IMAGEFX_SOLARIZE;
-    else if(strcmp(str, "solarize") == 0) imageFX = MMAL_PARAM_IMAGEFX_SOLARIZE;
-    else if(strcmp(str, "sketch") == 0) imageFX = MMAL_PARAM_IMAGEFX_SKETCH;
-    else if(strcmp(str, "denoise") == 0) imageFX = MMAL_PARAM_IMAGEFX_DENOISE;
-    else if(strcmp(str, "emboss") == 0) imageFX = MMAL_PARAM_IMAGEFX_EMBOSS;
-    else if(strcmp(str, "oilpaint") == 0) imageFX = MMAL_PARAM_IMAGEFX_OILPAINT;
-    else if(strcmp(str, "hatch") == 0) imageFX = MMAL_PARAM_IMAGEFX_HATCH;
-    else if(strcmp(str, "gpen") == 0) imageFX = MMAL_PARAM_IMAGEFX_GPEN;
-    else if(strcmp(str, "pastel") == 0) imageFX = MMAL_PARAM_IMAGEFX_PASTEL;
-    else if(strcmp(str, "watercolour") == 0) imageFX = MMAL_PARAM_IMAGEFX_WATERCOLOUR;
-    else if(strcmp(str, "watercolor") == 0) imageFX = MMAL_PARAM_IMAGEFX_WATERCOLOUR;
-    else if(strcmp(str, "film") == 0) imageFX = MMAL_PARAM_IMAGEFX_FILM;
-    else if(strcmp(str, "blur") == 0) imageFX = MMAL_PARAM_IMAGEFX_BLUR;
-    else if(strcmp(str, "saturation") == 0) imageFX = MMAL_PARAM_IMAGEFX_SATURATION;
-    else if(strcmp(str, "colourswap") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURSWAP;
-    else if(strcmp(str, "colorswap") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURSWAP;
-    else if(strcmp(str, "washedout") == 0) imageFX = MMAL_PARAM_IMAGEFX_WASHEDOUT;
-    else if(strcmp(str, "posterise") == 0) imageFX = MMAL_PARAM_IMAGEFX_POSTERISE;
-    else if(strcmp(str, "posterize") == 0) imageFX = MMAL_PARAM_IMAGEFX_POSTERISE;
-    else if(strcmp(str, "colourpoint") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURPOINT;
-    else if(strcmp(str, "colorpoint") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURPOINT;
-    else if(strcmp(str, "colourbalance") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURBALANCE;
-    else if(strcmp(str, "colorbalance") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURBALANCE;
-    else if(strcmp(str, "cartoon") == 0) imageFX = MMAL_PARAM_IMAGEFX_CARTOON;
-    else {
-        if (fail_on_error)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
-            return;
-    }
-    MMAL_PARAMETER_IMAGEFX_T param = {{MMAL_PARAMETER_IMAGE_EFFECT,sizeof(param)}, imageFX};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
+    UNUSED(fail_on_error);
+    MMAL_PARAMETER_IMAGEFX_T param = {{MMAL_PARAMETER_IMAGE_EFFECT,sizeof(param)}, param_int(opt_id(opt))};
+    if (mmal_port_parameter_set(state.cam->camera->control, &param.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
@@ -403,44 +978,33 @@ static void colfx_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     // Color effect is specified as u:v. Anything else means off.
     MMAL_PARAMETER_COLOURFX_T param = {{MMAL_PARAMETER_COLOUR_EFFECT,sizeof(param)}, 0, 0, 0};
-    const char *str = getenv(opt->env_key);
+    const char *str = param_str(opt_id(opt));
     if (sscanf(str, "%d:%d", &param.u, &param.v) == 2 &&
             param.u < 256 &&
             param.v < 256)
         param.enable = 1;
     else
         param.enable = 0;
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
+    if (mmal_port_parameter_set(state.cam->camera->control, &param.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
 static void metering_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    MMAL_PARAM_EXPOSUREMETERINGMODE_T m_mode;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "average") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE;
-    else if(strcmp(str, "spot") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_SPOT;
-    else if(strcmp(str, "backlit") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_BACKLIT;
-    else if(strcmp(str, "matrix") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_MATRIX;
-    else {
-        if (fail_on_error)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
-            return;
-    }
-    MMAL_PARAMETER_EXPOSUREMETERINGMODE_T param = {{MMAL_PARAMETER_EXP_METERING_MODE,sizeof(param)}, m_mode};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
+    UNUSED(fail_on_error);
+    MMAL_PARAMETER_EXPOSUREMETERINGMODE_T param = {{MMAL_PARAMETER_EXP_METERING_MODE,sizeof(param)}, param_int(opt_id(opt))};
+    if (mmal_port_parameter_set(state.cam->camera->control, &param.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
 static void rotation_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     UNUSED(fail_on_error);
-    int value = strtol(getenv(opt->env_key), NULL, 0);
-    if (mmal_port_parameter_set_int32(state.camera->output[CAMERA_PORT_PREVIEW], MMAL_PARAMETER_ROTATION, value) != MMAL_SUCCESS)
+    int value = param_int(opt_id(opt));
+    if (mmal_port_parameter_set_int32(state.cam->camera->output[CAMERA_PORT_PREVIEW], MMAL_PARAMETER_ROTATION, value) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s on preview port", opt->long_option);
 
-    if (mmal_port_parameter_set_int32(state.camera->output[CAMERA_PORT_VIDEO], MMAL_PARAMETER_ROTATION, value) != MMAL_SUCCESS)
+    if (mmal_port_parameter_set_int32(state.cam->camera->output[CAMERA_PORT_VIDEO], MMAL_PARAMETER_ROTATION, value) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s on video port", opt->long_option);
 }
 
@@ -449,15 +1013,15 @@ static void flip_apply(const struct raspi_config_opt *opt, bool fail_on_error)
     UNUSED(fail_on_error);
 
     MMAL_PARAMETER_MIRROR_T mirror = {{MMAL_PARAMETER_MIRROR, sizeof(MMAL_PARAMETER_MIRROR_T)}, MMAL_PARAM_MIRROR_NONE};
-    if (strcmp(getenv(RASPIJPGS_HFLIP), "on") == 0)
+    if (param_bool(OPT_HFLIP))
         mirror.value = MMAL_PARAM_MIRROR_HORIZONTAL;
-    if (strcmp(getenv(RASPIJPGS_VFLIP), "on") == 0)
+    if (param_bool(OPT_VFLIP))
         mirror.value = (mirror.value == MMAL_PARAM_MIRROR_HORIZONTAL ? MMAL_PARAM_MIRROR_BOTH : MMAL_PARAM_MIRROR_VERTICAL);
 
-    if (mmal_port_parameter_set(state.camera->output[CAMERA_PORT_PREVIEW], &mirror.hdr) != MMAL_SUCCESS)
+    if (mmal_port_parameter_set(state.cam->camera->output[CAMERA_PORT_PREVIEW], &mirror.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s on preview port", opt->long_option);
 
-    if (mmal_port_parameter_set(state.camera->output[CAMERA_PORT_VIDEO], &mirror.hdr) != MMAL_SUCCESS)
+    if (mmal_port_parameter_set(state.cam->camera->output[CAMERA_PORT_VIDEO], &mirror.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s on video port", opt->long_option);
 }
 
@@ -470,7 +1034,7 @@ static void sensor_mode_apply(const struct raspi_config_opt *opt, bool fail_on_e
 
 static void roi_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    const char *str = getenv(opt->env_key);
+    const char *str = param_str(opt_id(opt));
     if (str[0] == '\0')
         str = "0:0:1:1";
 
@@ -492,53 +1056,206 @@ static void roi_apply(const struct raspi_config_opt *opt, bool fail_on_error)
     crop.rect.width = lrintf(65536.f * w);
     crop.rect.height = lrintf(65536.f * h);
 
-    if (mmal_port_parameter_set(state.camera->control, &crop.hdr) != MMAL_SUCCESS)
+    if (mmal_port_parameter_set(state.cam->camera->control, &crop.hdr) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
 static void shutter_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     UNUSED(fail_on_error);
-    int value = strtoul(getenv(opt->env_key), NULL, 0);
-    if (mmal_port_parameter_set_uint32(state.camera->control, MMAL_PARAMETER_SHUTTER_SPEED, value) != MMAL_SUCCESS)
+    int value = param_int(opt_id(opt));
+    if (mmal_port_parameter_set_uint32(state.cam->camera->control, MMAL_PARAMETER_SHUTTER_SPEED, value) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
 }
 
+static void raw_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    struct stream_config config;
+    MMAL_FOURCC_T encoding = parse_requested_raw(state.cam->streams[0].width, state.cam->streams[0].height, &config);
+    const struct picam_stream *raw = raw_stream();
+
+    bool changed;
+    if (!raw)
+        changed = (encoding != 0);
+    else
+        changed = (encoding != raw->encoding ||
+                   config.width != raw->width ||
+                   config.height != raw->height);
+
+    // It needs a splitter output of its own
+    if (changed) {
+        rebuild_pipeline();
+    }
+}
+
+static void set_jpeg_quality(struct picam_stream *stream, int value)
+{
+    if (stream->encoding != MMAL_ENCODING_JPEG || !stream->encoder)
+        return;
+
+    if (mmal_port_parameter_set_uint32(stream->encoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, value) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set jpeg quality to %d", value);
+    stream->quality = value;
+}
+
+// The size targets are limited to what a frame buffer can hold. Once one
+// is set, even just the bitrate, frames are also kept under that limit.
+static void configure_quality_control(struct camera_pipeline *cam)
+{
+    long target_bitrate = cam->params[OPT_TARGET_BITRATE].number;
+    long max_frame_size = cam->params[OPT_MAX_FRAME_SIZE].number;
+    if (target_bitrate < 0)
+        target_bitrate = 0;
+    max_frame_size = constrain(0, max_frame_size, MAX_FRAME_SIZE);
+    if (target_bitrate && !max_frame_size)
+        max_frame_size = MAX_FRAME_SIZE;
+
+    int max_quality = constrain(0, cam->params[OPT_QUALITY].number, 100);
+    int min_quality = constrain(0, cam->params[OPT_MIN_QUALITY].number, max_quality);
+    picam_quality_configure(&cam->quality_control, target_bitrate, max_frame_size, min_quality, max_quality);
+}
+
 static void quality_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     UNUSED(fail_on_error);
-    int value = strtoul(getenv(opt->env_key), NULL, 0);
-    value = constrain(0, value, 100);
-    if (mmal_port_parameter_set_uint32(state.jpegencoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, value) != MMAL_SUCCESS)
+
+    // With a size target, this is only the ceiling
+    configure_quality_control(state.cam);
+    int value = constrain(0, param_int(opt_id(opt)), 100);
+    if (picam_quality_enabled(&state.cam->quality_control))
+        value = lrint(state.cam->quality_control.quality);
+    set_jpeg_quality(&state.cam->streams[0], value);
+}
+
+static void quality_control_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    bool was_enabled = picam_quality_enabled(&state.cam->quality_control);
+    configure_quality_control(state.cam);
+
+    // Going back to the fixed quality
+    if (was_enabled && !picam_quality_enabled(&state.cam->quality_control))
+        set_jpeg_quality(&state.cam->streams[0], constrain(0, param_int(OPT_QUALITY), 100));
+}
+
+static void still_quality_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(fail_on_error);
+
+    int value = constrain(0, param_int(opt_id(opt)), 100);
+    if (state.cam->still.encoder &&
+            mmal_port_parameter_set_uint32(state.cam->still.encoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, value) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s to %d", opt->long_option, value);
+    state.cam->still.quality = value;
 }
 
 static void restart_interval_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
     UNUSED(fail_on_error);
-    int value = strtoul(getenv(opt->env_key), NULL, 0);
-    if (mmal_port_parameter_set_uint32(state.jpegencoder->output[0], MMAL_PARAMETER_JPEG_RESTART_INTERVAL, value) != MMAL_SUCCESS)
+    int value = param_int(opt_id(opt));
+    int i;
+    for (i = 0; i < state.cam->stream_count; i++) {
+        if (state.cam->streams[i].encoding != MMAL_ENCODING_JPEG)
+            continue;
+        if (mmal_port_parameter_set_uint32(state.cam->streams[i].encoder->output[0], MMAL_PARAMETER_JPEG_RESTART_INTERVAL, value) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set %s to %d", opt->long_option, value);
+    }
+}
+
+static void codec_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(fail_on_error);
+
+    MMAL_FOURCC_T encoding = param_int(opt_id(opt));
+    if (encoding == state.cam->streams[0].encoding)
+        return;
+
+    // Switching codecs means a different encoder component, but the camera
+    // and any scaled streams can keep running.
+    state.cam->streams[0].encoding = encoding;
+    restart_stream(&state.cam->streams[0]);
+}
+
+static void bitrate_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    if (state.cam->streams[0].encoding != MMAL_ENCODING_H264)
+        return;
+
+    int value = param_int(opt_id(opt));
+    if (value > MAX_H264_BITRATE) {
+        if (fail_on_error)
+            errx(EXIT_FAILURE, "%s must be at most %d", opt->long_option, MAX_H264_BITRATE);
+        else
+            return;
+    }
+    if (mmal_port_parameter_set_uint32(state.cam->streams[0].encoder->output[0], MMAL_PARAMETER_VIDEO_BIT_RATE, value) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s to %d", opt->long_option, value);
 }
 
+static void h264_encoder_option_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    // The encoder only takes these when it's created, so rebuild it when
+    // they change.
+    struct picam_stream *stream = &state.cam->streams[0];
+    if (stream->encoding != MMAL_ENCODING_H264)
+        return;
+
+    int intra_period = param_int(OPT_INTRA_PERIOD);
+    bool inline_headers = param_bool(OPT_INLINE_HEADERS);
+    bool inline_vectors = param_bool(OPT_MOTION);
+    if (intra_period != stream->intra_period ||
+            inline_headers != stream->inline_headers ||
+            inline_vectors != stream->inline_vectors)
+        restart_stream(stream);
+}
+
+static void arm_fake_timer(double fps)
+{
+    if (fps <= 0)
+        fps = FAKE_DEFAULT_FPS;
+    if (fps < 1)
+        fps = 1;
+
+    long interval_ns = lrint(1000000000.0 / fps);
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_ns / 1000000000;
+    spec.it_interval.tv_nsec = interval_ns % 1000000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(state.fake_timerfd, 0, &spec, NULL) < 0)
+        err(EXIT_FAILURE, "timerfd_settime");
+}
+
 static void fps_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    int fps256 = lrint(256.0 * strtod(getenv(opt->env_key), 0));
+    if (state.fake) {
+        arm_fake_timer(param_float(opt_id(opt)));
+        return;
+    }
+
+    int fps256 = lrint(256.0 * param_float(opt_id(opt)));
     if (fps256 < 0)
         fps256 = 0;
 
     MMAL_PARAMETER_FRAME_RATE_T rate = {{MMAL_PARAMETER_FRAME_RATE, sizeof(MMAL_PARAMETER_FRAME_RATE_T)}, {fps256, 256}};
-    MMAL_STATUS_T status = mmal_port_parameter_set(state.camera->output[CAMERA_PORT_VIDEO], &rate.hdr);
+    MMAL_STATUS_T status = mmal_port_parameter_set(state.cam->camera->output[CAMERA_PORT_VIDEO], &rate.hdr);
     if(status != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not set %s=%d/256 (%d)", opt->long_option, fps256, status);
 }
 
 static void preview_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    PREVIEW_CONFIG_T *config = &state.preview;
+    PREVIEW_CONFIG_T *config = &state.cam->preview;
     MMAL_BOOL_T prev_enable = config->enable;
 
-    if (strcmp(getenv(opt->env_key), "on") == 0)
+    if (param_bool(opt_id(opt)))
         config->enable = MMAL_TRUE;
     else
         config->enable = MMAL_FALSE;
@@ -546,27 +1263,27 @@ static void preview_apply(const struct raspi_config_opt *opt, bool fail_on_error
     if (prev_enable != config->enable)
     {
         // Re-init to create the correct component (renderer or null sink)
-        MMAL_PORT_T *source_port = state.preview.connection->out;
-        mmal_connection_destroy(state.preview.connection);
+        MMAL_PORT_T *source_port = state.cam->preview.connection->out;
+        mmal_connection_destroy(state.cam->preview.connection);
         picam_preview_init(config);
         if (mmal_connection_create(
-                    &state.preview.connection,
+                    &state.cam->preview.connection,
                     source_port,
-                    state.preview.component->input[0],
+                    state.cam->preview.component->input[0],
                     MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT
                 ) != MMAL_SUCCESS)
             errx(EXIT_FAILURE, "Could not create connection camera -> preview");
 
-        if (mmal_connection_enable(state.preview.connection) != MMAL_SUCCESS)
+        if (mmal_connection_enable(state.cam->preview.connection) != MMAL_SUCCESS)
             errx(EXIT_FAILURE, "Could not enable connection camera -> preview");
     }
 }
 
 static void preview_fullscreen_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    PREVIEW_CONFIG_T *config = &state.preview;
+    PREVIEW_CONFIG_T *config = &state.cam->preview;
 
-    if (strcmp(getenv(opt->env_key), "on") == 0)
+    if (param_bool(opt_id(opt)))
         config->fullscreen = MMAL_TRUE;
     else
         config->fullscreen = MMAL_FALSE;
@@ -574,55 +1291,347 @@ static void preview_fullscreen_apply(const struct raspi_config_opt *opt, bool fa
     picam_preview_configure(config);
 }
 
-static void preview_window_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+static bool high_rate_mode()
 {
-    int32_t x, y, width, height;
-    const char *str = getenv(opt->env_key);
-    if (sscanf(str, "%d,%d,%d,%d", &x, &y, &width, &height) != 4)
-        errx(EXIT_FAILURE, "Could not parse video preview window dimensions: %s", str);
+    int mode = param_int(OPT_MODE);
+    double fps = param_float(OPT_FPS);
+    return mode == 6 || mode == 7 || fps > HIGH_RATE_FPS;
+}
 
-    PREVIEW_CONFIG_T *config = &state.preview;
-    config->dest_rect.x = x;
-    config->dest_rect.y = y;
-    config->dest_rect.width = width;
-    config->dest_rect.height = height;
+static int requested_encoder_buffers()
+{
+    return constrain(0, param_int(OPT_BUFFERS), MAX_ENCODER_BUFFERS);
+}
 
-    picam_preview_configure(config);
+static int requested_camera_frames()
+{
+    return constrain(0, param_int(OPT_CAMERA_FRAMES), MAX_CAMERA_FRAMES);
 }
 
-static struct raspi_config_opt opts[] =
+static void buffers_apply(const struct raspi_config_opt *opt, bool fail_on_error)
 {
-    // long_option  short   env_key                  help                                                    default
-    {"size",        " s",   RASPIJPGS_SIZE,         "Set image size <w,h> (h=0, calculate from w)",         "320,0",    default_set, size_apply},
-    {"annotation",  "a",    RASPIJPGS_ANNOTATION,   "Annotate the video frames with this text",             "",         default_set, annotation_apply},
-    {"anno_background", "ab", RASPIJPGS_ANNO_BACKGROUND, "Turn on a black background behind the annotation", "off",     default_set, anno_background_apply},
-    {"sharpness",   "sh",   RASPIJPGS_SHARPNESS,    "Set image sharpness (-100 to 100)",                    "0",        default_set, sharpness_apply},
-    {"contrast",    "co",   RASPIJPGS_CONTRAST,     "Set image contrast (-100 to 100)",                     "0",        default_set, contrast_apply},
-    {"brightness",  "br",   RASPIJPGS_BRIGHTNESS,   "Set image brightness (0 to 100)",                      "50",       default_set, brightness_apply},
-    {"saturation",  "sa",   RASPIJPGS_SATURATION,   "Set image saturation (-100 to 100)",                   "0",        default_set, saturation_apply},
-    {"ISO",         "ISO",  RASPIJPGS_ISO,          "Set capture ISO (100 to 800)",                         "0",        default_set, ISO_apply},
-    {"vstab",       "vs",   RASPIJPGS_VSTAB,        "Turn on video stabilisation",                          "off",      default_set, vstab_apply},
-    {"ev",          "ev",   RASPIJPGS_EV,           "Set EV compensation (-10 to 10)",                      "0",        default_set, ev_apply},
-    {"exposure",    "ex",   RASPIJPGS_EXPOSURE,     "Set exposure mode",                                    "auto",     default_set, exposure_apply},
-    {"fps",         0,      RASPIJPGS_FPS,          "Limit the frame rate (0 = auto)",                      "0",        default_set, fps_apply},
-    {"awb",         "awb",  RASPIJPGS_AWB,          "Set Automatic White Balance (AWB) mode",               "auto",     default_set, awb_apply},
-    {"imxfx",       "ifx",  RASPIJPGS_IMXFX,        "Set image effect",                                     "none",     default_set, imxfx_apply},
-    {"colfx",       "cfx",  RASPIJPGS_COLFX,        "Set colour effect <U:V>",                              "",         default_set, colfx_apply},
-    {"mode",        "md",   RASPIJPGS_SENSOR_MODE,  "Set sensor mode (0 to 7)",                             "0",        default_set, sensor_mode_apply},
-    {"metering",    "mm",   RASPIJPGS_METERING,     "Set metering mode",                                    "average",  default_set, metering_apply},
-    {"rotation",    "rot",  RASPIJPGS_ROTATION,     "Set image rotation (0-359)",                           "0",        default_set, rotation_apply},
-    {"hflip",       "hf",   RASPIJPGS_HFLIP,        "Set horizontal flip",                                  "off",      default_set, flip_apply},
-    {"vflip",       "vf",   RASPIJPGS_VFLIP,        "Set vertical flip",                                    "off",      default_set, flip_apply},
-    {"roi",         "roi",  RASPIJPGS_ROI,          "Set region of interest (x,y,w,d as normalised coordinates [0.0-1.0])", "0:0:1:1", default_set, roi_apply},
-    {"shutter",     "ss",   RASPIJPGS_SHUTTER,      "Set shutter speed",                                    "0",        default_set, shutter_apply},
-    {"quality",     "q",    RASPIJPGS_QUALITY,      "Set the JPEG quality (0-100)",                         "15",       default_set, quality_apply},
-    {"restart_interval", "rs", RASPIJPGS_RESTART_INTERVAL, "Set the JPEG restart interval (default of 0 for none)", "0", default_set, restart_interval_apply},
-    {"preview",     "p",    RASPIJPGS_PREVIEW,      "Enable or disable video preview on attached display(s)", "off",    default_set, preview_apply},
-    {"preview_fullscreen", "pf", RASPIJPGS_PREVIEW_FULLSCREEN, "Enable or disable fullscreen video preview", "on",      default_set, preview_fullscreen_apply},
-    {"preview_window", "pw", RASPIJPGS_PREVIEW_WINDOW, "Set the video preview window dimensions",           "0,0,320,240", default_set, preview_window_apply},
-    // options that can't be overridden using environment variables
-    {"help",        "h",    0,                       "Print this help message",                             0,          help,        0},
-    {0,             0,      0,                       0,                                                     0,          0,           0}
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    int buffers = requested_encoder_buffers();
+    if (buffers == state.cam->encoder_buffers)
+        return;
+
+    // The pools are sized when the encoders are set up
+    state.cam->encoder_buffers = buffers;
+    int i;
+    for (i = 0; i < state.cam->stream_count; i++)
+        restart_stream(&state.cam->streams[i]);
+}
+
+static void camera_frames_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    // The camera only takes this while it's being set up
+    if (requested_camera_frames() != state.cam->camera_frames) {
+        rebuild_pipeline();
+    }
+}
+
+static void metadata_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(fail_on_error);
+
+    state.metadata = param_bool(opt_id(opt));
+}
+
+static void socket_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(fail_on_error);
+
+    const char *path = param_str(opt_id(opt));
+    const char *current = state.socket_server.path ? state.socket_server.path : "";
+    if (strcmp(path, current) == 0)
+        return;
+
+    picam_socket_server_close(&state.socket_server);
+    if (*path)
+        picam_socket_server_open(&state.socket_server, path);
+}
+
+static void http_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(fail_on_error);
+
+    int port = param_int(opt_id(opt));
+    if (port == state.http_server.port)
+        return;
+
+    picam_http_server_close(&state.http_server);
+    if (port)
+        picam_http_server_open(&state.http_server, port);
+}
+
+static void rtp_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    const char *destination = param_str(OPT_RTP);
+    const char *current = state.rtp.destination ? state.rtp.destination : "";
+    int mtu = param_int(OPT_RTP_MTU);
+    if (strcmp(destination, current) == 0 && (!*destination || mtu == state.rtp.mtu))
+        return;
+
+    picam_rtp_close(&state.rtp);
+    if (*destination)
+        picam_rtp_open(&state.rtp, destination, mtu);
+}
+
+static void record_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    // Changing where recordings go or the ring size ends any recording in
+    // progress and starts a new pre-roll.
+    const char *dir = param_str(OPT_RECORD_DIR);
+    const char *current = state.recorder.dir ? state.recorder.dir : "";
+    size_t size = param_int(OPT_RECORD_BUFFER);
+    if (strcmp(dir, current) != 0 || (*dir && size != state.recorder.size)) {
+        picam_recorder_close(&state.recorder);
+        if (*dir)
+            picam_recorder_open(&state.recorder, dir, size);
+    }
+    picam_recorder_configure(&state.recorder, param_int(OPT_RECORD_PREROLL), param_int(OPT_RECORD_SEGMENT));
+}
+
+static void shm_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(fail_on_error);
+
+    const char *name = param_str(OPT_SHM);
+    const char *current = state.shm_ring.name ? state.shm_ring.name : "";
+    size_t slot_size = param_int(OPT_SHM_SLOT_SIZE);
+    if (strcmp(name, current) == 0 && (!*name || slot_size == state.shm_ring.slot_size))
+        return;
+
+    picam_shm_ring_close(&state.shm_ring);
+    if (*name)
+        picam_shm_ring_open(&state.shm_ring, name, slot_size);
+}
+
+static void preview_window_apply(const struct raspi_config_opt *opt, bool fail_on_error)
+{
+    int32_t x, y, width, height;
+    const char *str = param_str(opt_id(opt));
+    if (sscanf(str, "%d,%d,%d,%d", &x, &y, &width, &height) != 4)
+        errx(EXIT_FAILURE, "Could not parse video preview window dimensions: %s", str);
+
+    PREVIEW_CONFIG_T *config = &state.cam->preview;
+    config->dest_rect.x = x;
+    config->dest_rect.y = y;
+    config->dest_rect.width = width;
+    config->dest_rect.height = height;
+
+    picam_preview_configure(config);
+}
+
+static void request_ack(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(value);
+    UNUSED(fail_on_error);
+
+    state.batch.ack = true;
+}
+
+static void select_camera(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+
+    // Options that follow are for this camera
+    int num = strtol(value, 0, 0);
+    if (num < 0 || num >= MAX_CAMERAS) {
+        if (fail_on_error)
+            errx(EXIT_FAILURE, "Invalid camera %s", value);
+        return;
+    }
+    state.cam = &state.cameras[num];
+}
+
+static void parse_requested_cameras()
+{
+    char *str = strdup(param_str(OPT_CAMERAS));
+    char *saveptr;
+    char *token;
+    for (token = strtok_r(str, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        int num = strtol(token, 0, 0);
+        if (num < 0 || num >= MAX_CAMERAS || num >= (int) state.sensor_info.num_cameras)
+            errx(EXIT_FAILURE, "Camera %s not found", token);
+        state.cameras[num].enabled = true;
+    }
+    free(str);
+}
+
+static struct camera_pipeline *first_camera()
+{
+    int i;
+    for (i = 0; i < MAX_CAMERAS; i++) {
+        if (state.cameras[i].enabled)
+            return &state.cameras[i];
+    }
+    errx(EXIT_FAILURE, "No cameras selected");
+}
+
+static const struct param_name exposure_names[] =
+{
+    {"off", MMAL_PARAM_EXPOSUREMODE_OFF},
+    {"auto", MMAL_PARAM_EXPOSUREMODE_AUTO},
+    {"night", MMAL_PARAM_EXPOSUREMODE_NIGHT},
+    {"nightpreview", MMAL_PARAM_EXPOSUREMODE_NIGHTPREVIEW},
+    {"backlight", MMAL_PARAM_EXPOSUREMODE_BACKLIGHT},
+    {"spotlight", MMAL_PARAM_EXPOSUREMODE_SPOTLIGHT},
+    {"sports", MMAL_PARAM_EXPOSUREMODE_SPORTS},
+    {"snow", MMAL_PARAM_EXPOSUREMODE_SNOW},
+    {"beach", MMAL_PARAM_EXPOSUREMODE_BEACH},
+    {"verylong", MMAL_PARAM_EXPOSUREMODE_VERYLONG},
+    {"fixedfps", MMAL_PARAM_EXPOSUREMODE_FIXEDFPS},
+    {"antishake", MMAL_PARAM_EXPOSUREMODE_ANTISHAKE},
+    {"fireworks", MMAL_PARAM_EXPOSUREMODE_FIREWORKS},
+    {0, 0}
+};
+
+static const struct param_name awb_names[] =
+{
+    {"off", MMAL_PARAM_AWBMODE_OFF},
+    {"auto", MMAL_PARAM_AWBMODE_AUTO},
+    {"sun", MMAL_PARAM_AWBMODE_SUNLIGHT},
+    {"cloudy", MMAL_PARAM_AWBMODE_CLOUDY},
+    {"shade", MMAL_PARAM_AWBMODE_SHADE},
+    {"tungsten", MMAL_PARAM_AWBMODE_TUNGSTEN},
+    {"fluorescent", MMAL_PARAM_AWBMODE_FLUORESCENT},
+    {"incandescent", MMAL_PARAM_AWBMODE_INCANDESCENT},
+    {"flash", MMAL_PARAM_AWBMODE_FLASH},
+    {"horizon", MMAL_PARAM_AWBMODE_HORIZON},
+    {0, 0}
+};
+
+static const struct param_name imxfx_names[] =
+{
+    {"none", MMAL_PARAM_IMAGEFX_NONE},
+    {"negative", MMAL_PARAM_IMAGEFX_NEGATIVE},
+    {"solarise", MMAL_PARAM_IMAGEFX_SOLARIZE},
+    {"solarize", MMAL_PARAM_IMAGEFX_SOLARIZE},
+    {"sketch", MMAL_PARAM_IMAGEFX_SKETCH},
+    {"denoise", MMAL_PARAM_IMAGEFX_DENOISE},
+    {"emboss", MMAL_PARAM_IMAGEFX_EMBOSS},
+    {"oilpaint", MMAL_PARAM_IMAGEFX_OILPAINT},
+    {"hatch", MMAL_PARAM_IMAGEFX_HATCH},
+    {"gpen", MMAL_PARAM_IMAGEFX_GPEN},
+    {"pastel", MMAL_PARAM_IMAGEFX_PASTEL},
+    {"watercolour", MMAL_PARAM_IMAGEFX_WATERCOLOUR},
+    {"watercolor", MMAL_PARAM_IMAGEFX_WATERCOLOUR},
+    {"film", MMAL_PARAM_IMAGEFX_FILM},
+    {"blur", MMAL_PARAM_IMAGEFX_BLUR},
+    {"saturation", MMAL_PARAM_IMAGEFX_SATURATION},
+    {"colourswap", MMAL_PARAM_IMAGEFX_COLOURSWAP},
+    {"colorswap", MMAL_PARAM_IMAGEFX_COLOURSWAP},
+    {"washedout", MMAL_PARAM_IMAGEFX_WASHEDOUT},
+    {"posterise", MMAL_PARAM_IMAGEFX_POSTERISE},
+    {"posterize", MMAL_PARAM_IMAGEFX_POSTERISE},
+    {"colourpoint", MMAL_PARAM_IMAGEFX_COLOURPOINT},
+    {"colorpoint", MMAL_PARAM_IMAGEFX_COLOURPOINT},
+    {"colourbalance", MMAL_PARAM_IMAGEFX_COLOURBALANCE},
+    {"colorbalance", MMAL_PARAM_IMAGEFX_COLOURBALANCE},
+    {"cartoon", MMAL_PARAM_IMAGEFX_CARTOON},
+    {0, 0}
+};
+
+static const struct param_name metering_names[] =
+{
+    {"average", MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE},
+    {"spot", MMAL_PARAM_EXPOSUREMETERINGMODE_SPOT},
+    {"backlit", MMAL_PARAM_EXPOSUREMETERINGMODE_BACKLIT},
+    {"matrix", MMAL_PARAM_EXPOSUREMETERINGMODE_MATRIX},
+    {0, 0}
+};
+
+static const struct param_name codec_names[] =
+{
+    {"mjpeg", MMAL_ENCODING_JPEG},
+    {"h264", MMAL_ENCODING_H264},
+    {0, 0}
+};
+
+static struct raspi_config_opt opts[] =
+{
+    // id                    long_option  short   env_key                  help                                                    default
+    [OPT_SIZE]              = {"size",        " s",   RASPIJPGS_SIZE,         "Set image size <w,h> (h=0, calculate from w)",         "320,0",    default_set, size_apply},
+    [OPT_ANNOTATION]        = {"annotation",  "a",    RASPIJPGS_ANNOTATION,   "Annotate the video frames with this text (strftime codes are expanded)", "",         default_set, annotation_apply},
+    [OPT_ANNO_BACKGROUND]   = {"anno_background", "ab", RASPIJPGS_ANNO_BACKGROUND, "Turn on a black background behind the annotation", "off",     default_set, anno_background_apply, PARAM_BOOL},
+    [OPT_SHARPNESS]         = {"sharpness",   "sh",   RASPIJPGS_SHARPNESS,    "Set image sharpness (-100 to 100)",                    "0",        default_set, sharpness_apply, PARAM_INT},
+    [OPT_CONTRAST]          = {"contrast",    "co",   RASPIJPGS_CONTRAST,     "Set image contrast (-100 to 100)",                     "0",        default_set, contrast_apply, PARAM_INT},
+    [OPT_BRIGHTNESS]        = {"brightness",  "br",   RASPIJPGS_BRIGHTNESS,   "Set image brightness (0 to 100)",                      "50",       default_set, brightness_apply, PARAM_INT},
+    [OPT_SATURATION]        = {"saturation",  "sa",   RASPIJPGS_SATURATION,   "Set image saturation (-100 to 100)",                   "0",        default_set, saturation_apply, PARAM_INT},
+    [OPT_ISO]               = {"ISO",         "ISO",  RASPIJPGS_ISO,          "Set capture ISO (100 to 800)",                         "0",        default_set, ISO_apply, PARAM_INT},
+    [OPT_VSTAB]             = {"vstab",       "vs",   RASPIJPGS_VSTAB,        "Turn on video stabilisation",                          "off",      default_set, vstab_apply, PARAM_BOOL},
+    [OPT_EV]                = {"ev",          "ev",   RASPIJPGS_EV,           "Set EV compensation (-10 to 10)",                      "0",        default_set, ev_apply, PARAM_INT},
+    [OPT_EXPOSURE]          = {"exposure",    "ex",   RASPIJPGS_EXPOSURE,     "Set exposure mode",                                    "auto",     default_set, exposure_apply, PARAM_ENUM, exposure_names},
+    [OPT_FPS]               = {"fps",         0,      RASPIJPGS_FPS,          "Limit the frame rate (0 = auto)",                      "0",        default_set, fps_apply, PARAM_FLOAT},
+    [OPT_AWB]               = {"awb",         "awb",  RASPIJPGS_AWB,          "Set Automatic White Balance (AWB) mode",               "auto",     default_set, awb_apply, PARAM_ENUM, awb_names},
+    [OPT_IMXFX]             = {"imxfx",       "ifx",  RASPIJPGS_IMXFX,        "Set image effect",                                     "none",     default_set, imxfx_apply, PARAM_ENUM, imxfx_names},
+    [OPT_COLFX]             = {"colfx",       "cfx",  RASPIJPGS_COLFX,        "Set colour effect <U:V>",                              "",         default_set, colfx_apply},
+    [OPT_MODE]              = {"mode",        "md",   RASPIJPGS_SENSOR_MODE,  "Set sensor mode (0 to 7)",                             "0",        default_set, sensor_mode_apply, PARAM_INT},
+    [OPT_METERING]          = {"metering",    "mm",   RASPIJPGS_METERING,     "Set metering mode",                                    "average",  default_set, metering_apply, PARAM_ENUM, metering_names},
+    [OPT_ROTATION]          = {"rotation",    "rot",  RASPIJPGS_ROTATION,     "Set image rotation (0-359)",                           "0",        default_set, rotation_apply, PARAM_INT},
+    [OPT_HFLIP]             = {"hflip",       "hf",   RASPIJPGS_HFLIP,        "Set horizontal flip",                                  "off",      default_set, flip_apply, PARAM_BOOL},
+    [OPT_VFLIP]             = {"vflip",       "vf",   RASPIJPGS_VFLIP,        "Set vertical flip",                                    "off",      default_set, flip_apply, PARAM_BOOL},
+    [OPT_ROI]               = {"roi",         "roi",  RASPIJPGS_ROI,          "Set region of interest (x,y,w,d as normalised coordinates [0.0-1.0])", "0:0:1:1", default_set, roi_apply},
+    [OPT_SHUTTER]           = {"shutter",     "ss",   RASPIJPGS_SHUTTER,      "Set shutter speed",                                    "0",        default_set, shutter_apply, PARAM_INT},
+    [OPT_QUALITY]           = {"quality",     "q",    RASPIJPGS_QUALITY,      "Set the JPEG quality (0-100)",                         "15",       default_set, quality_apply, PARAM_INT},
+    [OPT_RESTART_INTERVAL]  = {"restart_interval", "rs", RASPIJPGS_RESTART_INTERVAL, "Set the JPEG restart interval (default of 0 for none)", "0", default_set, restart_interval_apply, PARAM_INT},
+    [OPT_TARGET_BITRATE]    = {"target_bitrate", "tb", RASPIJPGS_TARGET_BITRATE, "Adjust the JPEG quality to average this many bits/s (0 = off)", "0", default_set, quality_control_apply, PARAM_INT},
+    [OPT_MAX_FRAME_SIZE]    = {"max_frame_size", "mfs", RASPIJPGS_MAX_FRAME_SIZE, "Adjust the JPEG quality to keep frames under this many bytes (0 = off)", "0", default_set, quality_control_apply, PARAM_INT},
+    [OPT_MIN_QUALITY]       = {"min_quality", "qmin", RASPIJPGS_MIN_QUALITY,  "Set the lowest JPEG quality the size targets can go to", "5",   default_set, quality_control_apply, PARAM_INT},
+    [OPT_PREVIEW]           = {"preview",     "p",    RASPIJPGS_PREVIEW,      "Enable or disable video preview on attached display(s)", "off",    default_set, preview_apply, PARAM_BOOL},
+    [OPT_PREVIEW_FULLSCREEN]= {"preview_fullscreen", "pf", RASPIJPGS_PREVIEW_FULLSCREEN, "Enable or disable fullscreen video preview", "on",      default_set, preview_fullscreen_apply, PARAM_BOOL},
+    [OPT_PREVIEW_WINDOW]    = {"preview_window", "pw", RASPIJPGS_PREVIEW_WINDOW, "Set the video preview window dimensions",           "0,0,320,240", default_set, preview_window_apply},
+    [OPT_CODEC]             = {"codec",       "cd",   RASPIJPGS_CODEC,        "Set the main stream's codec (mjpeg or h264)",          "mjpeg",    default_set, codec_apply, PARAM_ENUM, codec_names},
+    [OPT_BITRATE]           = {"bitrate",     "b",    RASPIJPGS_BITRATE,      "Set the H.264 bitrate in bits/s (0 = variable)",       "17000000", default_set, bitrate_apply, PARAM_INT},
+    [OPT_INTRA_PERIOD]      = {"intra_period", "g",   RASPIJPGS_INTRA_PERIOD, "Set the H.264 intra refresh period (GOP) in frames (0 = default)", "0", default_set, h264_encoder_option_apply, PARAM_INT},
+    [OPT_INLINE_HEADERS]    = {"inline_headers", "ih", RASPIJPGS_INLINE_HEADERS, "Insert H.264 SPS/PPS headers before every I-frame",   "on",       default_set, h264_encoder_option_apply, PARAM_BOOL},
+    [OPT_METADATA]          = {"metadata",    "meta", RASPIJPGS_METADATA,     "Prefix frames with their timestamp, sequence number and exposure", "off", default_set, metadata_apply, PARAM_BOOL},
+    [OPT_BUFFERS]           = {"buffers",     "bn",   RASPIJPGS_BUFFERS,      "Set the number of encoder output buffers per stream (0 = auto)", "0", default_set, buffers_apply, PARAM_INT},
+    [OPT_CAMERA_FRAMES]     = {"camera_frames", "cf", RASPIJPGS_CAMERA_FRAMES, "Set the number of frames the camera queues (0 = auto)", "0", default_set, camera_frames_apply, PARAM_INT},
+    [OPT_SOCKET]            = {"socket",      "so",   RASPIJPGS_SOCKET,       "Also serve frames to clients on this Unix domain socket", "",     default_set, socket_apply},
+    [OPT_SHM]               = {"shm",         "shm",  RASPIJPGS_SHM,          "Also publish frames to a shared memory ring with this name (e.g. /picam)", "", default_set, shm_apply},
+    [OPT_HTTP]              = {"http",        "ht",   RASPIJPGS_HTTP,         "Serve MJPEG streams over HTTP on this port (0 = off)", "0",       default_set, http_apply, PARAM_INT},
+    [OPT_RTP]               = {"rtp",         "rtp",  RASPIJPGS_RTP,          "Send the main stream as RTP/JPEG to this <address:port> (unicast or multicast)", "", default_set, rtp_apply},
+    [OPT_RTP_MTU]           = {"rtp_mtu",     "rtpm", RASPIJPGS_RTP_MTU,      "Set the largest RTP packet in bytes",                  "1400",     default_set, rtp_apply, PARAM_INT},
+    [OPT_RECORD_DIR]        = {"record_dir",  "rd",   RASPIJPGS_RECORD_DIR,   "Keep a pre-roll of the main stream for recording into this directory", "", default_set, record_apply},
+    [OPT_RECORD_BUFFER]     = {"record_buffer", "rb", RASPIJPGS_RECORD_BUFFER, "Set the size of the recording pre-roll ring in bytes", "16777216", default_set, record_apply, PARAM_INT},
+    [OPT_RECORD_PREROLL]    = {"record_preroll", "rp", RASPIJPGS_RECORD_PREROLL, "Start recordings this many seconds before record_start", "5", default_set, record_apply, PARAM_INT},
+    [OPT_RECORD_SEGMENT]    = {"record_segment", "rg", RASPIJPGS_RECORD_SEGMENT, "Start a new recording file every this many seconds", "60", default_set, record_apply, PARAM_INT},
+    [OPT_MOTION]            = {"motion",      "mo",   RASPIJPGS_MOTION,       "Report motion from the H.264 encoder's motion vectors", "off",  default_set, h264_encoder_option_apply, PARAM_BOOL},
+    [OPT_MOTION_THRESHOLD]  = {"motion_threshold", "mt", RASPIJPGS_MOTION_THRESHOLD, "Motion vector length for a macroblock to count as moving", "4", default_set, 0, PARAM_INT},
+    [OPT_MOTION_BLOCKS]     = {"motion_blocks", "mb", RASPIJPGS_MOTION_BLOCKS, "Moving macroblocks needed to report motion",           "10",       default_set, 0, PARAM_INT},
+    [OPT_SHM_SLOT_SIZE]     = {"shm_slot_size", "shs", RASPIJPGS_SHM_SLOT_SIZE, "Set the size of each shared memory slot in bytes",   "1048576",  default_set, shm_apply, PARAM_INT},
+    [OPT_RAW]               = {"raw",         "raw",  RASPIJPGS_RAW,          "Send uncompressed w,h[,i420|rgb] frames to the socket and shm ring", "", default_set, raw_apply},
+    [OPT_STREAMS]           = {"streams",     "st",   RASPIJPGS_STREAMS,      "Add scaled streams <w,h[,quality];...> (h=0, calculate from w)", "", default_set, streams_apply},
+    [OPT_SETTINGS_FILE]     = {"settings_file", "sf", RASPIJPGS_SETTINGS_FILE, "Save exposure and white balance here and start from them next time", "", default_set, 0},
+    [OPT_CAMERAS]           = {"cameras",     "cam",  RASPIJPGS_CAMERAS,      "Run these cameras <num,...> (only at startup)",        "0",        default_set, 0},
+    [OPT_FAKE]              = {"fake",        "fk",   RASPIJPGS_FAKE,         "Replay this .mjpeg file or directory of JPEGs at fps instead of using the camera (only at startup)", "", default_set, 0},
+    // options that can't be overridden using environment variables
+    [OPT_HELP]              = {"help",        "h",    0,                       "Print this help message",                             0,          help,        0},
+    [OPT_STATS]             = {"stats",       0,      0,                       "Report frame statistics on stdout",                   0,          stats,       0},
+    [OPT_STILL_QUALITY]     = {"still_quality", "sq", RASPIJPGS_STILL_QUALITY, "Set the JPEG quality for capture_still (0 to 100)",  "90",       default_set, still_quality_apply, PARAM_INT},
+    [OPT_CAMERA]            = {"camera",      0,      0,                       "Apply the options that follow to this camera",        0,          select_camera, 0},
+    [OPT_ACK]               = {"ack",         0,      0,                       "Report how the settings in this packet were applied", 0,          request_ack, 0},
+    [OPT_CAPTURE_STILL]     = {"capture_still", 0,    0,                       "Capture a full resolution JPEG still",                0,          capture_still, 0},
+    [OPT_PAUSE]             = {"pause",       0,      0,                       "Stop encoding until resumed",                         0,          pause_encoding, 0},
+    [OPT_RESUME]            = {"resume",      0,      0,                       "Resume encoding",                                     0,          resume_encoding, 0},
+    [OPT_RECORD_START]      = {"record_start", 0,     0,                       "Start recording with the pre-roll",                   0,          record_start, 0},
+    [OPT_RECORD_STOP]       = {"record_stop", 0,      0,                       "Stop recording",                                      0,          record_stop, 0},
+    [OPT_COUNT]             = {0}
 };
 
 static void help(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
@@ -653,6 +1662,7 @@ static void help(const struct raspi_config_opt *opt, const char *value, bool fai
             "    blur, saturation, colorswap, washedout, posterize, colorpoint,\n"
             "    colorbalance, cartoon\n"
             "Metering (--metering) options: average, spot, backlit, matrix\n"
+            "Codec (--codec) options: mjpeg, h264. Scaled streams are always mjpeg\n"
             "Sensor mode (--mode) options:\n"
             "       0   automatic selection\n"
             "       1   1920x1080 (16:9) 1-30 fps\n"
@@ -676,25 +1686,49 @@ static int is_short_option(const char *str)
     return strlen(str) >= 2 && str[0] == '-' && str[1] != '-';
 }
 
-static void fillin_defaults()
+// The environment only provides the starting values. Camera 0 uses the
+// plain keys, and other cameras look for <key>_<camera number> first.
+static void load_parameters()
 {
-    const struct raspi_config_opt *opt;
-    for (opt = opts; opt->long_option; opt++) {
-        if (opt->env_key && opt->default_value) {
-            // The replace option is set to 0, so that anything set in the environment
-            // is an override.
-            if (setenv(opt->env_key, opt->default_value, 0) < 0)
-                err(EXIT_FAILURE, "Error setting %s to %s", opt->env_key, opt->default_value);
+    int c;
+    for (c = 0; c < MAX_CAMERAS; c++) {
+        state.cam = &state.cameras[c];
+
+        const struct raspi_config_opt *opt;
+        for (opt = opts; opt->long_option; opt++) {
+            if (!opt->env_key || (c != 0 && is_global_option(opt_id(opt))))
+                continue;
+
+            char camera_key[64];
+            snprintf(camera_key, sizeof(camera_key), "%s_%d", opt->env_key, c);
+            const char *value = c != 0 ? getenv(camera_key) : NULL;
+            if (!value)
+                value = getenv(opt->env_key);
+            if (!value)
+                value = opt->default_value;
+            if (!parse_param(opt, value, param_slot(opt_id(opt))))
+                errx(EXIT_FAILURE, "Invalid %s '%s'", opt->env_key, value);
         }
     }
+    state.cam = &state.cameras[0];
+}
+
+static void record_applied(const struct raspi_config_opt *opt)
+{
+    int ix = opt - opts;
+    free(state.cam->applied[ix]);
+    state.cam->applied[ix] = strdup(param_str(opt_id(opt)));
 }
 
 static void apply_parameters(bool fail_on_error)
 {
     const struct raspi_config_opt *opt;
     for (opt = opts; opt->long_option; opt++) {
-        if (opt->apply)
-            opt->apply(opt, fail_on_error);
+        if (opt->apply) {
+            if (option_applies(opt_id(opt)))
+                opt->apply(opt, fail_on_error);
+            record_applied(opt);
+        }
     }
 }
 
@@ -760,6 +1794,16 @@ static void trim_whitespace(char *s)
     s[len] = 0;
 }
 
+// Commands see the settings before them in the packet, so that
+// "quality=50" then "capture_still" captures at 50. Choosing the camera or
+// asking for an ack doesn't need that.
+static void run_command(const struct raspi_config_opt *opt, const char *value)
+{
+    if (opt != &opts[OPT_CAMERA] && opt != &opts[OPT_ACK])
+        apply_touched();
+    opt->set(opt, value, false);
+}
+
 static void parse_config_line(const char *line)
 {
     char *str = strdup(line);
@@ -792,286 +1836,1410 @@ static void parse_config_line(const char *line)
             break;
     if (!opt->long_option) {
         // Ignore the bad option
+        state.batch.unknown++;
         free(str);
         return;
     }
 
-    opt->set(opt, value, false);
+    // Settings are applied once the whole packet has been read, or before
+    // a command that follows them.
+    if (!opt->env_key)
+        run_command(opt, value);
+    else
+        opt->set(opt, value, false);
     if (opt->apply)
-        opt->apply(opt, false);
+        state.cam->touched[opt - opts] = true;
 
     free(str);
 }
 
-static void output_jpeg(const char *buf, int len)
+static uint64_t monotonic_us()
 {
-    struct iovec iovs[2];
-    uint32_t len32 = htonl(len);
-    iovs[0].iov_base = &len32;
-    iovs[0].iov_len = sizeof(int32_t);
-    iovs[1].iov_base = (char *) buf; // silence warning
-    iovs[1].iov_len = len;
-    ssize_t count = writev(STDOUT_FILENO, iovs, 2);
-    if (count < 0)
-        err(EXIT_FAILURE, "Error writing to stdout");
-    else if (count != (ssize_t) (iovs[0].iov_len + iovs[1].iov_len))
-        warnx("Unexpected truncation of JPEG when writing to stdout");
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void recycle_jpegencoder_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+// stdout is written by its own thread so that a busy reader can't stall the
+// encoders. Frames that the stream is holding MMAL buffers for are lent to
+// it as they are. Everything else is copied.
+static void write_stdout(const struct iovec *iovs, int count, size_t len, bool droppable,
+                         unsigned int replace_key, struct picam_stream *lender, int header_count)
 {
-    mmal_buffer_header_release(buffer);
-
-    if (port->is_enabled) {
-        MMAL_BUFFER_HEADER_T *new_buffer;
-
-        if (!(new_buffer = mmal_queue_get(state.pool_jpegencoder->queue)) ||
-                mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
-            errx(EXIT_FAILURE, "Could not send buffers to port");
+    uint64_t start = monotonic_us();
+    PICAM_FRAME_T *frame;
+    if (lender) {
+        frame = picam_frame_lend(iovs, count, len, droppable, header_count, lender,
+                                 (void *const *) lender->held_buffers, lender->held_buffer_count);
+        lender->lent_frames++;
+        lender->held_buffer_count = 0;
+        lender->held_length = 0;
+    } else {
+        frame = picam_frame_copy(iovs, count, len, droppable, replace_key);
     }
+    picam_writer_push(&state.stdout_writer, frame);
+    uint64_t elapsed = monotonic_us() - start;
+    picam_histogram_add(&state.timings.write, elapsed);
+    state.timings.write_total += elapsed;
 }
 
-static void jpegencoder_buffer_callback_impl()
+static void output_packet(const struct iovec *fragments, int count, int len, unsigned int replace_key)
 {
-    void *msg[2];
-    if (read(state.mmal_callback_pipe[0], msg, sizeof(msg)) != sizeof(msg))
-        err(EXIT_FAILURE, "read from internal pipe broke");
+    struct iovec iovs[MAX_HELD_BUFFERS + 2];
+    uint32_t len32 = htonl(len);
+    iovs[0].iov_base = &len32;
+    iovs[0].iov_len = sizeof(int32_t);
+    memcpy(&iovs[1], fragments, count * sizeof(struct iovec));
+    write_stdout(iovs, count + 1, sizeof(int32_t) + len, false, replace_key, NULL, 0);
+}
 
-    MMAL_PORT_T *port = (MMAL_PORT_T *) msg[0];
-    MMAL_BUFFER_HEADER_T *buffer = (MMAL_BUFFER_HEADER_T *) msg[1];
+static void put_be32(char *p, uint32_t value)
+{
+    uint32_t be = htonl(value);
+    memcpy(p, &be, sizeof(be));
+}
 
-    mmal_buffer_header_mem_lock(buffer);
+static void fill_metadata(const struct picam_stream *stream, char *p)
+{
+    CAMERA_SETTINGS_T settings;
+    picam_camera_get_settings(&state.cameras[stream->camera].camera_settings, &settings);
+
+    uint64_t pts = stream->frame_pts == MMAL_TIME_UNKNOWN ? (uint64_t) -1 : (uint64_t) stream->frame_pts;
+    put_be32(p, pts >> 32);
+    put_be32(p + 4, pts & 0xffffffff);
+    put_be32(p + 8, stream->frame_sequence);
+    put_be32(p + 12, stream->frames_dropped);
+    put_be32(p + 16, settings.exposure);
+    put_be32(p + 20, settings.analog_gain);
+    put_be32(p + 24, settings.digital_gain);
+}
 
-    if (state.socket_buffer_ix == 0 &&
-            (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) &&
-            buffer->length <= MAX_DATA_BUFFER_SIZE) {
-        // Easy case: JPEG all in one buffer
-        output_jpeg((const char *) buffer->data, buffer->length);
-    } else {
-        // Hard case: assemble JPEG
-        if (state.socket_buffer_ix + buffer->length > MAX_DATA_BUFFER_SIZE) {
-            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
-                state.socket_buffer_ix = 0;
-            } else if (state.socket_buffer_ix != MAX_DATA_BUFFER_SIZE) {
-                // Warn when frame crosses threshold
-                warnx("Frame too large (%d bytes). Dropping. Adjust MAX_DATA_BUFFER_SIZE.", state.socket_buffer_ix + buffer->length);
-                state.socket_buffer_ix = MAX_DATA_BUFFER_SIZE;
-            }
-        } else {
-            memcpy(&state.socket_buffer[state.socket_buffer_ix], buffer->data, buffer->length);
-            state.socket_buffer_ix += buffer->length;
-            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
-                output_jpeg(state.socket_buffer, state.socket_buffer_ix);
-                state.socket_buffer_ix = 0;
-            }
+static void output_frame(struct picam_stream *stream, const struct iovec *fragments, int count, int len, bool held)
+{
+    struct iovec iovs[MAX_HELD_BUFFERS + 2];
+    int header_count = 0;
+
+    stream->frame_sequence++;
+    if (stream->frame_pts != MMAL_TIME_UNKNOWN)
+        stream->pts_offset = stream->frame_pts - (int64_t) monotonic_us();
+    stream->frames_output++;
+    stream->bytes_output += len;
+    if (stream->id == 0 && !stream->still && !stream->raw)
+        update_annotation(&state.cameras[stream->camera], false);
+    if (stream->id == 0 && !stream->still && !stream->raw && stream->encoding == MMAL_ENCODING_JPEG) {
+        QUALITY_CONTROL_T *qc = &state.cameras[stream->camera].quality_control;
+        if (picam_quality_enabled(qc)) {
+            uint64_t timestamp = stream->frame_pts != MMAL_TIME_UNKNOWN ? (uint64_t) stream->frame_pts : monotonic_us();
+            int quality = picam_quality_update(qc, len, timestamp);
+            if (quality != stream->quality)
+                set_jpeg_quality(stream, quality);
         }
     }
+    if (!stream->still && !stream->raw && stream->encoding == MMAL_ENCODING_JPEG)
+        picam_http_server_send(&state.http_server, stream->camera, stream->id, fragments, count, len);
+    if (stream->camera == 0 && stream->id == 0 && !stream->still && !stream->raw) {
+        bool h264 = stream->encoding == MMAL_ENCODING_H264;
+        if (!h264) {
+            uint64_t timestamp = stream->frame_pts != MMAL_TIME_UNKNOWN ? (uint64_t) stream->frame_pts : monotonic_us();
+            picam_rtp_send(&state.rtp, fragments, count, len, timestamp);
+        }
+        picam_recorder_add(&state.recorder, fragments, count, len, h264, monotonic_us());
+    }
+    if (!stream->still)
+        picam_shm_ring_publish(&state.shm_ring, (stream->camera << 4) | stream->id, fragments, count, len);
+
+    // Camera 0's main stream is sent as plain JPEGs so that it looks the
+    // same whether or not there are scaled streams or other cameras.
+    char header[3 + METADATA_SIZE] = {(char) MSG_MARKER, MSG_FRAME, STREAM_TAG(stream->camera, stream->id)};
+    int header_len = 0;
+    if (stream->still) {
+        header[1] = MSG_STILL;
+        header[2] = (char) stream->camera;
+        header_len = 3;
+    } else if (state.metadata) {
+        header[1] = MSG_METADATA;
+        fill_metadata(stream, &header[3]);
+        header_len = sizeof(header);
+    } else if (stream->camera != 0 || stream->id != 0) {
+        header_len = 3;
+    }
+    len += header_len;
+    stream->frame_pts = MMAL_TIME_UNKNOWN;
+
+    uint32_t len32 = htonl(len);
+    iovs[header_count].iov_base = &len32;
+    iovs[header_count].iov_len = sizeof(int32_t);
+    header_count++;
+
+    if (header_len) {
+        iovs[header_count].iov_base = header;
+        iovs[header_count].iov_len = header_len;
+        header_count++;
+    }
 
-    mmal_buffer_header_mem_unlock(buffer);
+    memcpy(&iovs[header_count], fragments, count * sizeof(struct iovec));
+    count += header_count;
+    len += sizeof(int32_t);
 
-    //cam_set_annotation();
+    // Raw frames are too big to push through the port. Socket subscribers
+    // get them along with everything that's sent on stdout. Stills have
+    // callers waiting on them, so they're never dropped.
+    if (!stream->raw)
+        write_stdout(iovs, count, len, !stream->still, 0, held ? stream : NULL, header_count);
 
-    recycle_jpegencoder_buffer(port, buffer);
+    picam_socket_server_send(&state.socket_server, iovs, count, len);
 }
 
-static void jpegencoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static void output_jpeg(struct picam_stream *stream, const char *buf, int len)
 {
-    // If the buffer contains something, notify our main thread to process it.
-    // If not, recycle it immediately.
-    if (buffer->length) {
-        void *msg[2];
-        msg[0] = port;
-        msg[1] = buffer;
-        if (write(state.mmal_callback_pipe[1], msg, sizeof(msg)) != sizeof(msg))
-            err(EXIT_FAILURE, "write to internal pipe broke");
-    } else {
-        recycle_jpegencoder_buffer(port, buffer);
-    }
+    struct iovec iov;
+    iov.iov_base = (char *) buf; // silence warning
+    iov.iov_len = len;
+    output_frame(stream, &iov, 1, len, false);
 }
 
-static void discover_sensors(MMAL_PARAMETER_CAMERA_INFO_T *camera_info)
+static void output_keyed_message(char type, const char *payload, int len, unsigned int replace_key)
 {
-    MMAL_COMPONENT_T *camera_component;
+    char header[2] = {(char) MSG_MARKER, type};
+    struct iovec iovs[2];
+    iovs[0].iov_base = header;
+    iovs[0].iov_len = sizeof(header);
+    iovs[1].iov_base = (char *) payload; // silence warning
+    iovs[1].iov_len = len;
+    output_packet(iovs, 2, sizeof(header) + len, replace_key);
+}
 
-    // Try to get the camera name and maximum supported resolution
-    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &camera_component);
-    if (status != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Failed to create camera_info component");
+// Replies and events that have to arrive
+static void output_message(char type, const char *payload, int len)
+{
+    output_keyed_message(type, payload, len, 0);
+}
 
-    camera_info->hdr.id = MMAL_PARAMETER_CAMERA_INFO;
-    camera_info->hdr.size = sizeof(MMAL_PARAMETER_CAMERA_INFO_T)-4;  // Deliberately undersize to check firmware version
-    status = mmal_port_parameter_get(camera_component->control, &camera_info->hdr);
+// Reports that are superseded by the next one. If stdout is backed up,
+// only the latest of each type per camera waits to go out.
+static void output_report(char type, int camera, const char *payload, int len)
+{
+    output_keyed_message(type, payload, len, ((unsigned int) (uint8_t) type << 8) | (camera + 1));
+}
 
-    if (status != MMAL_SUCCESS) {
-        // Running on newer firmware
-        camera_info->hdr.size = sizeof(MMAL_PARAMETER_CAMERA_INFO_T);
-        status = mmal_port_parameter_get(camera_component->control, &camera_info->hdr);
-        if (status != MMAL_SUCCESS)
-            errx(EXIT_FAILURE, "Failed to get imager information even on new firmware");
-    } else {
-        // Older firmware. Assume one OV5647
-        camera_info->num_cameras = 1;
-        camera_info->num_flashes = 0;
-        camera_info->cameras[0].port_id = 0;
-        camera_info->cameras[0].max_width = 2592;
-        camera_info->cameras[0].max_height = 1944;
-        camera_info->cameras[0].lens_present = 0;
-        strcpy(camera_info->cameras[0].camera_name, "OV5647");
-    }
+static void reserve_frame_buffer(struct picam_stream *stream, int size)
+{
+    if (size <= stream->frame_buffer_size)
+        return;
 
-    mmal_component_destroy(camera_component);
+    // Grow in big steps so that reallocations stop once the largest frame
+    // sizes for the current settings have been seen.
+    int new_size = stream->frame_buffer_size ? stream->frame_buffer_size : INITIAL_DATA_BUFFER_SIZE;
+    while (new_size < size)
+        new_size *= 2;
+    if (new_size > MAX_FRAME_SIZE)
+        new_size = MAX_FRAME_SIZE;
+
+    char *new_buffer = (char *) realloc(stream->frame_buffer, new_size);
+    if (!new_buffer)
+        err(EXIT_FAILURE, "realloc");
+    stream->frame_buffer = new_buffer;
+    stream->frame_buffer_size = new_size;
 }
 
-void start_all()
+static void record_frame_size(struct picam_stream *stream, int len)
 {
+    if (len > stream->peak_frame_size) {
+        stream->peak_frame_size = len;
 
-    MMAL_ES_FORMAT_T *format;
-    MMAL_STATUS_T status;
-
-    // Create the file descriptors for getting back to the main thread
-    // from the MMAL callbacks.
-    if (pipe(state.mmal_callback_pipe) < 0)
-        err(EXIT_FAILURE, "pipe");
+        // If this frame had to be copied, it would need this much room.
+        reserve_frame_buffer(stream, len + len / 4);
+    }
+}
 
-    // Only the first camera is currently supported.
-    int imager_width = state.sensor_info.cameras[0].max_width;
-    int imager_height = state.sensor_info.cameras[0].max_height;
+static void report_streams(FILE *fp, struct camera_pipeline *cam, uint64_t elapsed_ms)
+{
+    // Camera 0's main stream's keys have no prefix. Scaled streams' keys
+    // are prefixed with "stream<id>_" and other cameras' with "camera<num>_".
+    int i;
+    for (i = 0; i < cam->stream_count; i++) {
+        struct picam_stream *stream = &cam->streams[i];
+        char prefix[32] = "";
+        if (cam->num != 0)
+            sprintf(prefix, "camera%d_", cam->num);
+        if (stream->id != 0)
+            sprintf(prefix + strlen(prefix), "stream%d_", stream->id);
+
+        fprintf(fp, "%sframe_buffer_size=%d\n", prefix, stream->frame_buffer_size);
+        if (stream->encoding == MMAL_ENCODING_JPEG)
+            fprintf(fp, "%squality=%d\n", prefix, stream->quality);
+        fprintf(fp, "%speak_frame_size=%d\n", prefix, stream->peak_frame_size);
+        fprintf(fp, "%sframes_dropped=%u\n", prefix, stream->frames_dropped);
+        fprintf(fp, "%sframes_oversized=%u\n", prefix, stream->frames_oversized);
+        fprintf(fp, "%spool_buffers=%u\n", prefix, stream->pool ? stream->pool->headers_num : 0);
+        fprintf(fp, "%spool_starvations=%u\n", prefix, stream->pool_starvations);
+        fprintf(fp, "%sframes=%llu\n", prefix, (unsigned long long) stream->frames_output);
+        fprintf(fp, "%sbytes=%llu\n", prefix, (unsigned long long) stream->bytes_output);
+
+        // Rates are over the time since the last report
+        if (elapsed_ms > 0) {
+            fprintf(fp, "%sfps=%llu\n", prefix,
+                    (unsigned long long) ((stream->frames_output - stream->frames_at_last_report) * 1000 / elapsed_ms));
+            fprintf(fp, "%sbytes_per_second=%llu\n", prefix,
+                    (unsigned long long) ((stream->bytes_output - stream->bytes_at_last_report) * 1000 / elapsed_ms));
+        }
+        stream->frames_at_last_report = stream->frames_output;
+        stream->bytes_at_last_report = stream->bytes_output;
+    }
+}
 
-    //
-    // create camera
-    //
-    if (mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &state.camera) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not create camera");
+static void stats(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(value);
+    UNUSED(fail_on_error);
 
-    int fps256 = lrint(256.0 * strtod(getenv(RASPIJPGS_FPS), 0));
+    char *report;
+    size_t len;
+    FILE *fp = open_memstream(&report, &len);
+    if (!fp)
+        err(EXIT_FAILURE, "open_memstream");
 
-    parse_requested_dimensions(&state.width, &state.height);
+    uint64_t now = monotonic_us();
+    uint64_t elapsed_ms = (now - state.timings.last_report) / 1000;
 
-    int video_width = state.width;
-    int video_height = state.height;
+    int i;
+    for (i = 0; i < MAX_CAMERAS; i++) {
+        if (state.cameras[i].enabled)
+            report_streams(fp, &state.cameras[i], elapsed_ms);
+    }
 
-    picam_camera_init(state.camera, imager_width, imager_height);
-    picam_camera_configure_format(state.camera, video_width, video_height, fps256);
+    picam_histogram_report(&state.timings.callback_latency, fp, "callback_latency");
+    picam_histogram_report(&state.timings.assembly, fp, "assembly");
+    picam_histogram_report(&state.timings.write, fp, "write");
+    picam_histogram_reset(&state.timings.callback_latency);
+    picam_histogram_reset(&state.timings.assembly);
+    picam_histogram_reset(&state.timings.write);
+    state.timings.last_report = now;
+
+    fprintf(fp, "paused=%d\n", state.paused);
+    fprintf(fp, "stdout_queue_length=%d\n", atomic_load(&state.stdout_writer.queue_length));
+    fprintf(fp, "stdout_frames_dropped=%lu\n",
+            atomic_load(&state.stdout_writer.frames_dropped) + state.stdout_writer.frames_skipped);
+    fprintf(fp, "stdout_reports_replaced=%lu\n",
+            atomic_load(&state.stdout_writer.messages_replaced) + state.stdout_writer.backlog_replaced);
+    fprintf(fp, "socket_clients=%d\n", state.socket_server.client_count);
+    fprintf(fp, "socket_frames_dropped=%lu\n", state.socket_server.frames_dropped);
+    fprintf(fp, "http_clients=%d\n", state.http_server.client_count);
+    fprintf(fp, "http_frames_dropped=%lu\n", state.http_server.frames_dropped);
+    fprintf(fp, "rtp_packets_sent=%lu\n", state.rtp.packets_sent);
+    fprintf(fp, "rtp_frames_dropped=%lu\n", state.rtp.frames_dropped);
+    fprintf(fp, "shm_frames_dropped=%lu\n", state.shm_ring.frames_dropped);
+    picam_recorder_report(&state.recorder, fp);
+    fclose(fp);
+
+    output_report(MSG_STATS, 0, report, len);
+    free(report);
+}
 
-    if (mmal_component_enable(state.camera) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable camera");
+// Events for moving frames only matter until the next one, but the one
+// that says the motion stopped always goes out.
+static void output_motion(const struct picam_stream *stream, const MOTION_RESULT_T *result, bool moving)
+{
+    char payload[1 + MOTION_SIZE];
+    payload[0] = (char) stream->camera;
+    put_be32(&payload[1], stream->frame_sequence);
+    payload[5] = result->active >> 8;
+    payload[6] = result->active & 0xff;
+    payload[7] = result->total >> 8;
+    payload[8] = result->total & 0xff;
+    payload[9] = result->left;
+    payload[10] = result->top;
+    payload[11] = result->right;
+    payload[12] = result->bottom;
+    put_be32(&payload[13], result->grid >> 32);
+    put_be32(&payload[17], result->grid & 0xffffffff);
+    if (moving)
+        output_report(MSG_MOTION, stream->camera, payload, sizeof(payload));
+    else
+        output_message(MSG_MOTION, payload, sizeof(payload));
+}
 
-    //
-    // create renderer
-    //
+static void analyze_motion(const struct picam_stream *stream, MMAL_BUFFER_HEADER_T *buffer)
+{
+    int threshold = param_int(OPT_MOTION_THRESHOLD);
+    int min_blocks = param_int(OPT_MOTION_BLOCKS);
 
-    picam_preview_init(&state.preview);
+    MOTION_RESULT_T result;
+    if (!picam_motion_analyze(buffer->data, buffer->length, stream->width, stream->height, threshold, &result))
+        return;
 
-    //
-    // create jpeg-encoder
-    //
+    bool moving = (result.active >= min_blocks);
+    if (moving || state.cam->moving)
+        output_motion(stream, &result, moving);
+    state.cam->moving = moving;
+}
 
-    status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &state.jpegencoder);
-    if (status != MMAL_SUCCESS && status != MMAL_ENOSYS)
-        errx(EXIT_FAILURE, "Could not create image encoder");
+static void recycle_jpegencoder_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct picam_stream *stream = (struct picam_stream *) port->userdata;
 
-    mmal_format_copy(state.jpegencoder->input[0]->format, state.camera->output[CAMERA_PORT_VIDEO]->format);
-    if (mmal_port_format_commit(state.jpegencoder->input[0]) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set jpeg encoder input format");
+    mmal_buffer_header_release(buffer);
 
-    format = state.jpegencoder->output[0]->format;
-    format->encoding = MMAL_ENCODING_JPEG;
+    // While paused, buffers stay in the pool so that the encoder stalls.
+    if (port->is_enabled && (!state.paused || stream->still)) {
+        MMAL_BUFFER_HEADER_T *new_buffer;
 
-    state.jpegencoder->output[0]->buffer_size = state.jpegencoder->output[0]->buffer_size_recommended;
-    if (state.jpegencoder->output[0]->buffer_size < state.jpegencoder->output[0]->buffer_size_min)
-        state.jpegencoder->output[0]->buffer_size = state.jpegencoder->output[0]->buffer_size_min;
-    state.jpegencoder->output[0]->buffer_num = state.jpegencoder->output[0]->buffer_num_recommended;
-    if(state.jpegencoder->output[0]->buffer_num < state.jpegencoder->output[0]->buffer_num_min)
-        state.jpegencoder->output[0]->buffer_num = state.jpegencoder->output[0]->buffer_num_min;
+        if (!(new_buffer = mmal_queue_get(stream->pool->queue)) ||
+                mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not send buffers to port");
+    }
+}
 
-    if (mmal_port_format_commit(state.jpegencoder->output[0]) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set jpeg encoder output format");
+static void release_held_buffers(struct picam_stream *stream)
+{
+    int i;
+    for (i = 0; i < stream->held_buffer_count; i++) {
+        mmal_buffer_header_mem_unlock(stream->held_buffers[i]);
+        recycle_jpegencoder_buffer(stream->encoder->output[0], stream->held_buffers[i]);
+    }
+    stream->held_buffer_count = 0;
+    stream->held_length = 0;
+}
 
-    int quality = strtol(getenv(RASPIJPGS_QUALITY), 0, 0);
-    if (mmal_port_parameter_set_uint32(state.jpegencoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, quality) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set jpeg quality to %d", quality);
+// Lent frames come back once stdout has them. Their buffers then go back
+// to the encoder.
+static void service_returned_frames()
+{
+    PICAM_FRAME_T *frame = picam_writer_take_returned(&state.stdout_writer);
+    while (frame) {
+        PICAM_FRAME_T *next = frame->next;
+        struct picam_stream *stream = (struct picam_stream *) frame->owner;
+        int i;
+        for (i = 0; i < frame->buffer_count; i++) {
+            MMAL_BUFFER_HEADER_T *buffer = (MMAL_BUFFER_HEADER_T *) frame->buffers[i];
+            mmal_buffer_header_mem_unlock(buffer);
+            recycle_jpegencoder_buffer(stream->encoder->output[0], buffer);
+        }
+        stream->lent_frames--;
+        picam_frame_free(frame);
+        frame = next;
+    }
 
-    // Set the JPEG restart interval
-    int restart_interval = strtol(getenv(RASPIJPGS_RESTART_INTERVAL), 0, 0);
-    if (mmal_port_parameter_set_uint32(state.jpegencoder->output[0], MMAL_PARAMETER_JPEG_RESTART_INTERVAL, restart_interval) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Unable to set JPEG restart interval");
+    // The writer also signals when there's room for the backlog
+    picam_writer_flush(&state.stdout_writer);
+}
 
-    if (mmal_port_parameter_set_boolean(state.jpegencoder->output[0], MMAL_PARAMETER_EXIF_DISABLE, 1) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not turn off EXIF");
+static void wait_for_lent_frames(struct picam_stream *stream)
+{
+    while (stream->lent_frames) {
+        struct pollfd fd = {state.stdout_writer.return_fd, POLLIN, 0};
+        if (poll(&fd, 1, 2000) == 0)
+            errx(EXIT_FAILURE, "stdout writer stuck");
+        service_returned_frames();
+    }
+}
 
-    if (mmal_component_enable(state.jpegencoder) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable image encoder");
-    state.pool_jpegencoder = mmal_port_pool_create(state.jpegencoder->output[0], state.jpegencoder->output[0]->buffer_num, state.jpegencoder->output[0]->buffer_size);
-    if (!state.pool_jpegencoder)
-        errx(EXIT_FAILURE, "Could not create image buffer pool");
+static void output_held_buffers(struct picam_stream *stream)
+{
+    struct iovec iovs[MAX_HELD_BUFFERS];
+    int i;
+    for (i = 0; i < stream->held_buffer_count; i++) {
+        iovs[i].iov_base = stream->held_buffers[i]->data;
+        iovs[i].iov_len = stream->held_buffers[i]->length;
+    }
+    record_frame_size(stream, stream->held_length);
+    output_frame(stream, iovs, stream->held_buffer_count, stream->held_length, true);
+    release_held_buffers(stream);
+}
+
+static int max_held_buffers(const struct picam_stream *stream)
+{
+    // Always leave the encoder at least one buffer to fill or it will stall
+    // before finishing the frame.
+    int max = stream->pool->headers_num - 1;
+    return max < MAX_HELD_BUFFERS ? max : MAX_HELD_BUFFERS;
+}
+
+static void assemble_jpeg(struct picam_stream *stream, MMAL_BUFFER_HEADER_T *buffer)
+{
+    int needed = stream->frame_buffer_ix + buffer->length;
+    if (needed > MAX_FRAME_SIZE) {
+        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+            stream->frame_buffer_ix = 0;
+            stream->frame_pts = MMAL_TIME_UNKNOWN;
+        } else if (stream->frame_buffer_ix != MAX_FRAME_SIZE) {
+            // Warn when frame crosses threshold
+            warnx("Frame too large (%d bytes). Dropping.", needed);
+            stream->frame_buffer_ix = MAX_FRAME_SIZE;
+            stream->frames_dropped++;
+            stream->frames_oversized++;
+            stream->frame_pts = MMAL_TIME_UNKNOWN;
+        }
+    } else {
+        reserve_frame_buffer(stream, needed);
+        memcpy(&stream->frame_buffer[stream->frame_buffer_ix], buffer->data, buffer->length);
+        stream->frame_buffer_ix += buffer->length;
+        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
+            record_frame_size(stream, stream->frame_buffer_ix);
+            output_jpeg(stream, stream->frame_buffer, stream->frame_buffer_ix);
+            stream->frame_buffer_ix = 0;
+        }
+    }
+}
+
+static void spill_held_buffers(struct picam_stream *stream)
+{
+    int i;
+    for (i = 0; i < stream->held_buffer_count; i++)
+        assemble_jpeg(stream, stream->held_buffers[i]);
+    release_held_buffers(stream);
+}
+
+static void drop_partial_frame(struct picam_stream *stream)
+{
+    if (stream->held_buffer_count || stream->frame_buffer_ix)
+        stream->frames_dropped++;
+
+    release_held_buffers(stream);
+    stream->frame_buffer_ix = 0;
+    stream->frame_pts = MMAL_TIME_UNKNOWN;
+}
+
+static void callback_ring_push(struct callback_ring *ring, MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= CALLBACK_RING_SIZE)
+        errx(EXIT_FAILURE, "MMAL callback ring overflow");
+
+    ring->entries[tail % CALLBACK_RING_SIZE].port = port;
+    ring->entries[tail % CALLBACK_RING_SIZE].buffer = buffer;
+    ring->entries[tail % CALLBACK_RING_SIZE].queued_us = monotonic_us();
+    atomic_store(&ring->tail, tail + 1);
+
+    // Only wake up the main loop if it could have seen the ring empty.
+    // Otherwise it's still draining and will find this entry before going
+    // back to poll.
+    if (atomic_load(&ring->head) == tail) {
+        uint64_t one = 1;
+        if (write(state.mmal_callback_eventfd, &one, sizeof(one)) != sizeof(one))
+            err(EXIT_FAILURE, "write to internal eventfd broke");
+    }
+}
+
+static unsigned int callback_ring_length(struct callback_ring *ring)
+{
+    return atomic_load(&ring->tail) - atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+static bool callback_ring_pop(struct callback_ring *ring, struct callback_entry *entry)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == atomic_load(&ring->tail))
+        return false;
+
+    *entry = ring->entries[head % CALLBACK_RING_SIZE];
+    atomic_store(&ring->head, head + 1);
+    return true;
+}
+
+static void jpegencoder_buffer_callback_impl(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct picam_stream *stream = (struct picam_stream *) port->userdata;
+
+    mmal_buffer_header_mem_lock(buffer);
+
+    // Motion vectors aren't part of the frame
+    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) {
+        analyze_motion(stream, buffer);
+        mmal_buffer_header_mem_unlock(buffer);
+        recycle_jpegencoder_buffer(port, buffer);
+        return;
+    }
+
+    // Use the timestamp of the first fragment that has one.
+    if (stream->frame_pts == MMAL_TIME_UNKNOWN)
+        stream->frame_pts = buffer->pts;
+
+    // Frames that were stuck in the encoder while paused are old news. H.264
+    // frames after them can't be decoded without the ones dropped, so that
+    // waits for the I-frame requested on resume. Headers are always kept.
+    if (stream->stale_pts && stream->held_buffer_count == 0 && stream->frame_buffer_ix == 0 &&
+            !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)) {
+        bool stale = stream->frame_pts != MMAL_TIME_UNKNOWN && stream->frame_pts < stream->stale_pts;
+        if (stream->encoding == MMAL_ENCODING_H264 && !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME))
+            stale = true;
+        if (stale) {
+            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+                stream->frame_pts = MMAL_TIME_UNKNOWN;
+            mmal_buffer_header_mem_unlock(buffer);
+            recycle_jpegencoder_buffer(port, buffer);
+            return;
+        }
+        stream->stale_pts = 0;
+    }
+
+    // If there's no room left to hold another fragment, fall back to copying
+    // the frame.
+    if (stream->frame_buffer_ix == 0 && stream->held_buffer_count == max_held_buffers(stream))
+        spill_held_buffers(stream);
+
+    if (stream->frame_buffer_ix == 0) {
+        // Hold the buffer until the whole JPEG has arrived. All fragments
+        // are then written straight from the MMAL buffers.
+        stream->held_buffers[stream->held_buffer_count++] = buffer;
+        stream->held_length += buffer->length;
+        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+            output_held_buffers(stream);
+    } else {
+        assemble_jpeg(stream, buffer);
+        mmal_buffer_header_mem_unlock(buffer);
+        recycle_jpegencoder_buffer(port, buffer);
+    }
+}
+
+static void service_stream_callbacks(struct picam_stream *stream)
+{
+    struct callback_entry entry;
+    while (callback_ring_pop(&stream->callback_ring, &entry)) {
+        uint64_t start = monotonic_us();
+        picam_histogram_add(&state.timings.callback_latency, start - entry.queued_us);
+
+        // If every buffer is either waiting here or held for a partial
+        // frame, the encoder has had nothing to fill.
+        if (callback_ring_length(&stream->callback_ring) + 1 + stream->held_buffer_count >= (unsigned int) stream->pool->headers_num)
+            stream->pool_starvations++;
+
+        uint64_t write_total = state.timings.write_total;
+        jpegencoder_buffer_callback_impl(entry.port, entry.buffer);
+        picam_histogram_add(&state.timings.assembly,
+                            monotonic_us() - start - (state.timings.write_total - write_total));
+    }
+}
+
+static void apply_option(const char *long_option)
+{
+    const struct raspi_config_opt *opt;
+    for (opt = opts; opt->long_option; opt++) {
+        if (strcmp(opt->long_option, long_option) == 0) {
+            opt->apply(opt, false);
+            return;
+        }
+    }
+}
+
+static void release_seed()
+{
+    // Put back the user's shutter speed and white balance now that AE and
+    // AWB have a good starting point.
+    picam_camera_release_seed(state.cam->camera);
+    apply_option("shutter");
+    apply_option("awb");
+    state.cam->seeded = false;
+}
+
+static bool setting_moved(uint32_t value, uint32_t saved)
+{
+    uint32_t difference = value > saved ? value - saved : saved - value;
+    return difference > saved / SETTINGS_SAVE_TOLERANCE;
+}
+
+static bool settings_moved(const CAMERA_SETTINGS_T *settings, const CAMERA_SETTINGS_T *saved)
+{
+    return setting_moved(settings->exposure, saved->exposure) ||
+           setting_moved(settings->analog_gain, saved->analog_gain) ||
+           setting_moved(settings->digital_gain, saved->digital_gain) ||
+           setting_moved(settings->awb_red_gain, saved->awb_red_gain) ||
+           setting_moved(settings->awb_blue_gain, saved->awb_blue_gain);
+}
+
+static void save_camera_settings(bool force)
+{
+    const char *settings_file = param_str(OPT_SETTINGS_FILE);
+    if (!*settings_file || state.cam->seeded)
+        return;
+
+    uint64_t now = monotonic_us();
+    if (!force && now - state.cam->settings_saved_at < SETTINGS_SAVE_INTERVAL_US)
+        return;
+
+    // Nothing to save until the camera reports in. AE and AWB wander a
+    // little from frame to frame, so small changes wait for the pipeline
+    // to stop.
+    CAMERA_SETTINGS_T settings;
+    picam_camera_get_settings(&state.cam->camera_settings, &settings);
+    if (settings.exposure == 0 || memcmp(&settings, &state.cam->saved_settings, sizeof(settings)) == 0)
+        return;
+    if (!force && !settings_moved(&settings, &state.cam->saved_settings))
+        return;
+
+    picam_camera_save_settings(settings_file, &settings);
+    state.cam->saved_settings = settings;
+    state.cam->settings_saved_at = now;
+}
+
+static void service_mmal_callbacks()
+{
+    // Clear the wakeup before draining so that anything pushed from here on
+    // wakes up the next poll.
+    uint64_t count;
+    if (read(state.mmal_callback_eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        err(EXIT_FAILURE, "read from internal eventfd broke");
+
+    // Each stream's encoder may call back on its own thread, so each one
+    // has its own ring. Handling a frame can look at its camera's options.
+    struct camera_pipeline *current = state.cam;
+    int c;
+    for (c = 0; c < MAX_CAMERAS; c++) {
+        if (!state.cameras[c].enabled)
+            continue;
+        state.cam = &state.cameras[c];
+
+        int i;
+        for (i = 0; i < state.cam->stream_count; i++)
+            service_stream_callbacks(&state.cam->streams[i]);
+        if (state.cam->still.encoder)
+            service_stream_callbacks(&state.cam->still);
+
+        if (state.cam->seeded && state.cam->streams[0].frame_sequence > 0)
+            release_seed();
+        save_camera_settings(false);
+    }
+    state.cam = current;
+}
+
+static void jpegencoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    struct picam_stream *stream = (struct picam_stream *) port->userdata;
+
+    // If the buffer contains something, notify our main thread to process it.
+    // If not, recycle it immediately.
+    if (buffer->length)
+        callback_ring_push(&stream->callback_ring, port, buffer);
+    else
+        recycle_jpegencoder_buffer(port, buffer);
+}
+
+static void discover_sensors(MMAL_PARAMETER_CAMERA_INFO_T *camera_info)
+{
+    MMAL_COMPONENT_T *camera_component;
+
+    // Try to get the camera name and maximum supported resolution
+    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &camera_component);
+    if (status != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Failed to create camera_info component");
+
+    camera_info->hdr.id = MMAL_PARAMETER_CAMERA_INFO;
+    camera_info->hdr.size = sizeof(MMAL_PARAMETER_CAMERA_INFO_T)-4;  // Deliberately undersize to check firmware version
+    status = mmal_port_parameter_get(camera_component->control, &camera_info->hdr);
+
+    if (status != MMAL_SUCCESS) {
+        // Running on newer firmware
+        camera_info->hdr.size = sizeof(MMAL_PARAMETER_CAMERA_INFO_T);
+        status = mmal_port_parameter_get(camera_component->control, &camera_info->hdr);
+        if (status != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Failed to get imager information even on new firmware");
+    } else {
+        // Older firmware. Assume one OV5647
+        camera_info->num_cameras = 1;
+        camera_info->num_flashes = 0;
+        camera_info->cameras[0].port_id = 0;
+        camera_info->cameras[0].max_width = 2592;
+        camera_info->cameras[0].max_height = 1944;
+        camera_info->cameras[0].lens_present = 0;
+        strcpy(camera_info->cameras[0].camera_name, "OV5647");
+    }
+
+    mmal_component_destroy(camera_component);
+}
+
+static MMAL_PORT_T *stream_source_port(const struct picam_stream *stream)
+{
+    if (stream->still)
+        return state.cam->camera->output[CAMERA_PORT_STILL];
+    else if (state.cam->splitter)
+        return state.cam->splitter->output[stream->id];
+    else
+        return state.cam->camera->output[CAMERA_PORT_VIDEO];
+}
+
+static void configure_splitter()
+{
+    mmal_format_copy(state.cam->splitter->input[0]->format, state.cam->camera->output[CAMERA_PORT_VIDEO]->format);
+    if (mmal_port_format_commit(state.cam->splitter->input[0]) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set splitter input format");
+
+    int i;
+    for (i = 0; i < state.cam->stream_count; i++) {
+        mmal_format_copy(state.cam->splitter->output[i]->format, state.cam->splitter->input[0]->format);
+        if (mmal_port_format_commit(state.cam->splitter->output[i]) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set splitter output format");
+    }
+}
+
+static void configure_stream_input(struct picam_stream *stream)
+{
+    MMAL_PORT_T *source = stream_source_port(stream);
+
+    if (stream->resizer) {
+        mmal_format_copy(stream->resizer->input[0]->format, source->format);
+        if (mmal_port_format_commit(stream->resizer->input[0]) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set resizer input format");
+
+        MMAL_ES_FORMAT_T *format = stream->resizer->output[0]->format;
+        mmal_format_copy(format, stream->resizer->input[0]->format);
+        format->encoding = MMAL_ENCODING_I420;
+        format->encoding_variant = MMAL_ENCODING_I420;
+        format->es->video.width = VCOS_ALIGN_UP(stream->width, 32);
+        format->es->video.height = VCOS_ALIGN_UP(stream->height, 16);
+        format->es->video.crop.x = 0;
+        format->es->video.crop.y = 0;
+        format->es->video.crop.width = stream->width;
+        format->es->video.crop.height = stream->height;
+        if (mmal_port_format_commit(stream->resizer->output[0]) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set resizer output format");
+
+        source = stream->resizer->output[0];
+    }
+
+    mmal_format_copy(stream->encoder->input[0]->format, source->format);
+    if (mmal_port_format_commit(stream->encoder->input[0]) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set jpeg encoder input format");
+}
+
+static void configure_jpeg_output(struct picam_stream *stream)
+{
+    MMAL_PORT_T *output = stream->encoder->output[0];
+
+    if (mmal_port_parameter_set_uint32(output, MMAL_PARAMETER_JPEG_Q_FACTOR, stream->quality) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set jpeg quality to %d", stream->quality);
+
+    // Set the JPEG restart interval
+    int restart_interval = param_int(OPT_RESTART_INTERVAL);
+    if (mmal_port_parameter_set_uint32(output, MMAL_PARAMETER_JPEG_RESTART_INTERVAL, restart_interval) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Unable to set JPEG restart interval");
+
+    if (mmal_port_parameter_set_boolean(output, MMAL_PARAMETER_EXIF_DISABLE, 1) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not turn off EXIF");
+}
+
+static void configure_raw_output(struct picam_stream *stream)
+{
+    // The ISP scales and converts to the requested format on the way out.
+    MMAL_PORT_T *output = stream->encoder->output[0];
+    MMAL_ES_FORMAT_T *format = output->format;
+    mmal_format_copy(format, stream->encoder->input[0]->format);
+    format->encoding = stream->encoding;
+    format->encoding_variant = stream->encoding;
+    format->es->video.width = VCOS_ALIGN_UP(stream->width, 32);
+    format->es->video.height = VCOS_ALIGN_UP(stream->height, 16);
+    format->es->video.crop.x = 0;
+    format->es->video.crop.y = 0;
+    format->es->video.crop.width = stream->width;
+    format->es->video.crop.height = stream->height;
+
+    // Commit now so that the recommended buffer size is for a whole frame
+    if (mmal_port_format_commit(output) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set raw output format");
+}
+
+static void configure_h264_output(struct picam_stream *stream)
+{
+    MMAL_PORT_T *output = stream->encoder->output[0];
+
+    stream->intra_period = param_int(OPT_INTRA_PERIOD);
+    if (stream->intra_period > 0 &&
+            mmal_port_parameter_set_uint32(output, MMAL_PARAMETER_INTRAPERIOD, stream->intra_period) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set H.264 intra period to %d", stream->intra_period);
+
+    // Inline SPS/PPS headers let a client start decoding at any I-frame.
+    stream->inline_headers = param_bool(OPT_INLINE_HEADERS);
+    if (mmal_port_parameter_set_boolean(output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, stream->inline_headers) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set H.264 inline headers");
+
+    // Motion vectors come out as extra buffers flagged CODECSIDEINFO
+    stream->inline_vectors = param_bool(OPT_MOTION);
+    if (mmal_port_parameter_set_boolean(output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, stream->inline_vectors) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set H.264 inline motion vectors");
+}
+
+static void create_stream(struct picam_stream *stream)
+{
+    MMAL_STATUS_T status;
 
     //
-    // connect
+    // create resizer for scaled streams. The ISP is faster, but fall back
+    // to the resizer component on firmware without it.
     //
+    if (stream->id != 0 && !stream->still && !stream->raw) {
+        if (mmal_component_create("vc.ril.isp", &stream->resizer) != MMAL_SUCCESS &&
+                mmal_component_create("vc.ril.resize", &stream->resizer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not create resizer");
+    }
 
-    if (mmal_connection_create(
-                &state.preview.connection,
-                state.camera->output[CAMERA_PORT_PREVIEW],
-                state.preview.component->input[0],
-                MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT
-            ) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not create connection camera -> preview");
+    //
+    // create encoder
+    //
+    if (stream->raw) {
+        if (mmal_component_create("vc.ril.isp", &stream->encoder) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not create ISP for the raw stream");
+    } else if (stream->encoding == MMAL_ENCODING_H264) {
+        if (mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &stream->encoder) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not create video encoder");
+    } else {
+        status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &stream->encoder);
+        if (status != MMAL_SUCCESS && status != MMAL_ENOSYS)
+            errx(EXIT_FAILURE, "Could not create image encoder");
+    }
 
-    if (mmal_connection_enable(state.preview.connection) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable connection camera -> preview");
+    configure_stream_input(stream);
+
+    MMAL_PORT_T *output = stream->encoder->output[0];
+    if (stream->raw)
+        configure_raw_output(stream);
+    else
+        output->format->encoding = stream->encoding;
+
+    if (stream->encoding == MMAL_ENCODING_H264) {
+        output->format->bitrate = constrain(0, param_int(OPT_BITRATE), MAX_H264_BITRATE);
+        // Let the encoder use the camera's frame rate
+        output->format->es->video.frame_rate.num = 0;
+        output->format->es->video.frame_rate.den = 1;
+    }
+
+    output->buffer_size = output->buffer_size_recommended;
+    if (output->buffer_size < output->buffer_size_min)
+        output->buffer_size = output->buffer_size_min;
+    output->buffer_num = output->buffer_num_recommended;
+    if (state.cam->encoder_buffers > 0)
+        output->buffer_num = state.cam->encoder_buffers;
+    else if (high_rate_mode() && output->buffer_num < HIGH_RATE_ENCODER_BUFFERS)
+        output->buffer_num = HIGH_RATE_ENCODER_BUFFERS;
+    if(output->buffer_num < output->buffer_num_min)
+        output->buffer_num = output->buffer_num_min;
+    if(output->buffer_num < MIN_JPEGENCODER_BUFFERS)
+        output->buffer_num = MIN_JPEGENCODER_BUFFERS;
+
+    if (mmal_port_format_commit(output) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set encoder output format");
+
+    if (stream->encoding == MMAL_ENCODING_H264)
+        configure_h264_output(stream);
+    else if (stream->encoding == MMAL_ENCODING_JPEG)
+        configure_jpeg_output(stream);
+
+    if (stream->resizer && mmal_component_enable(stream->resizer) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable resizer");
+
+    if (mmal_component_enable(stream->encoder) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable image encoder");
+    stream->pool = mmal_port_pool_create(output, output->buffer_num, output->buffer_size);
+    if (!stream->pool)
+        errx(EXIT_FAILURE, "Could not create image buffer pool");
+
+    // A frame only gets copied when it doesn't fit in the buffers that
+    // can be held, so make sure that there's room for that much up front.
+    reserve_frame_buffer(stream, output->buffer_num * output->buffer_size);
+
+    atomic_init(&stream->callback_ring.head, 0);
+    atomic_init(&stream->callback_ring.tail, 0);
+    stream->frame_pts = MMAL_TIME_UNKNOWN;
+}
+
+static void send_pool_buffers(struct picam_stream *stream)
+{
+    MMAL_PORT_T *output = stream->encoder->output[0];
+    int max = mmal_queue_length(stream->pool->queue);
+    int i;
+    for (i = 0; i < max; i++) {
+        MMAL_BUFFER_HEADER_T *jpegbuffer = mmal_queue_get(stream->pool->queue);
+        if (!jpegbuffer)
+            errx(EXIT_FAILURE, "Could not create jpeg buffer header");
+        if (mmal_port_send_buffer(output, jpegbuffer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not send buffers to jpeg port");
+    }
+}
+
+static void connect_stream(struct picam_stream *stream)
+{
+    MMAL_PORT_T *encoder_input = stream->encoder->input[0];
+
+    if (stream->resizer) {
+        if (mmal_connection_create(
+                    &stream->con_resizer,
+                    stream->resizer->output[0],
+                    encoder_input,
+                    MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT
+                ) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not create connection resizer -> encoder");
+
+        if (mmal_connection_enable(stream->con_resizer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not enable connection resizer -> encoder");
+
+        encoder_input = stream->resizer->input[0];
+    }
 
     if (mmal_connection_create(
-                &state.con_cam_video,
-                state.camera->output[CAMERA_PORT_VIDEO],
-                state.jpegencoder->input[0],
+                &stream->con_in,
+                stream_source_port(stream),
+                encoder_input,
                 MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT
             ) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not create connection camera -> encoder");
 
-    if (mmal_connection_enable(state.con_cam_video) != MMAL_SUCCESS)
+    if (mmal_connection_enable(stream->con_in) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not enable connection camera -> encoder");
 
     //
     // enable JPEG encoder
     //
-
-    if (mmal_port_enable(state.jpegencoder->output[0], jpegencoder_buffer_callback) != MMAL_SUCCESS)
+    MMAL_PORT_T *output = stream->encoder->output[0];
+    output->userdata = (struct MMAL_PORT_USERDATA_T *) stream;
+    if (mmal_port_enable(output, jpegencoder_buffer_callback) != MMAL_SUCCESS)
         errx(EXIT_FAILURE, "Could not enable jpeg port");
-    int max = mmal_queue_length(state.pool_jpegencoder->queue);
+    if (!state.paused || stream->still)
+        send_pool_buffers(stream);
+}
+
+static void capture_still(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(value);
+    UNUSED(fail_on_error);
+
+    // Fake mode hands back the frame that's showing
+    if (state.fake) {
+        size_t len;
+        const char *jpeg = picam_fake_last(&state.fake_clip, &len);
+        state.cam->still.frame_pts = MMAL_TIME_UNKNOWN;
+        output_jpeg(&state.cam->still, jpeg, len);
+        return;
+    }
+
+    // Nothing to capture with when given on the command line
+    if (!state.cam->camera)
+        return;
+
+    // The still encoder and its full resolution buffers are only set up
+    // once someone wants a still.
+    if (!state.cam->still.encoder) {
+        state.cam->still.still = true;
+        state.cam->still.encoding = MMAL_ENCODING_JPEG;
+        state.cam->still.camera = state.cam->num;
+        state.cam->still.width = state.sensor_info.cameras[state.cam->num].max_width;
+        state.cam->still.height = state.sensor_info.cameras[state.cam->num].max_height;
+        state.cam->still.quality = constrain(0, param_int(OPT_STILL_QUALITY), 100);
+
+        picam_camera_configure_still_format(state.cam->camera, state.cam->still.width, state.cam->still.height);
+        create_stream(&state.cam->still);
+        connect_stream(&state.cam->still);
+    }
+
+    // With one_shot_stills, this takes a single frame from the still port
+    // while the video port keeps going.
+    if (mmal_port_parameter_set_boolean(state.cam->camera->output[CAMERA_PORT_STILL], MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not capture still");
+}
+
+static void pause_encoding(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(value);
+    UNUSED(fail_on_error);
+
+    // Buffers that the encoders already have get filled and sent as usual.
+    // After that, they stall and the camera drops frames upstream.
+    state.paused = true;
+}
+
+static void record_start(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(value);
+    UNUSED(fail_on_error);
+
+    // Files are written by the recorder's thread, so this doesn't block.
+    picam_recorder_start(&state.recorder, monotonic_us());
+}
+
+static void record_stop(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(value);
+    UNUSED(fail_on_error);
+
+    picam_recorder_stop(&state.recorder);
+}
+
+static void resume_stream(struct picam_stream *stream)
+{
+    // The encoder may still have frames from when it stalled. Skip any
+    // captured before now by the camera's clock.
+    if (stream->pts_offset) {
+        stream->stale_pts = (int64_t) monotonic_us() + stream->pts_offset;
+        if (stream->encoding == MMAL_ENCODING_H264 &&
+                mmal_port_parameter_set_boolean(stream->encoder->output[0], MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1) != MMAL_SUCCESS)
+            warnx("Could not request an I-frame");
+    }
+
+    send_pool_buffers(stream);
+}
+
+static void resume_encoding(const struct raspi_config_opt *opt, const char *value, bool fail_on_error)
+{
+    UNUSED(opt);
+    UNUSED(value);
+    UNUSED(fail_on_error);
+
+    if (!state.paused)
+        return;
+    state.paused = false;
+    if (state.fake)
+        return;
+
+    // Pausing applies to all cameras
+    int c;
+    for (c = 0; c < MAX_CAMERAS; c++) {
+        int i;
+        for (i = 0; i < state.cameras[c].stream_count; i++)
+            resume_stream(&state.cameras[c].streams[i]);
+    }
+}
+
+static void destroy_stream(struct picam_stream *stream)
+{
+    mmal_port_disable(stream->encoder->output[0]);
+
+    // Drop any partially received frame now that the port won't want
+    // the buffers back. The pool can't go until lent ones are back too.
+    drop_partial_frame(stream);
+    wait_for_lent_frames(stream);
+
+    if (stream->con_resizer)
+        mmal_connection_destroy(stream->con_resizer);
+    mmal_connection_destroy(stream->con_in);
+
+    mmal_port_pool_destroy(stream->encoder->output[0], stream->pool);
+
+    mmal_component_disable(stream->encoder);
+    mmal_component_destroy(stream->encoder);
+    if (stream->resizer) {
+        mmal_component_disable(stream->resizer);
+        mmal_component_destroy(stream->resizer);
+    }
+
+    stream->con_resizer = NULL;
+    stream->con_in = NULL;
+    stream->pool = NULL;
+    stream->encoder = NULL;
+    stream->resizer = NULL;
+}
+
+void rebuild_pipeline()
+{
+    // Within a batch, do it once at the end so that everything that needs
+    // a rebuild gets it together.
+    if (state.batch.active) {
+        state.cam->rebuild_pending = true;
+        return;
+    }
+    stop_all();
+    start_all();
+}
+
+void restart_stream(struct picam_stream *stream)
+{
+    destroy_stream(stream);
+    create_stream(stream);
+    connect_stream(stream);
+}
+
+void start_all()
+{
+    int imager_width = state.sensor_info.cameras[state.cam->num].max_width;
+    int imager_height = state.sensor_info.cameras[state.cam->num].max_height;
+
+    //
+    // create camera
+    //
+    if (mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &state.cam->camera) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not create camera");
+
+    int fps256 = lrint(256.0 * param_float(OPT_FPS));
+
+    struct picam_stream *main_stream = &state.cam->streams[0];
+    parse_requested_dimensions(&main_stream->width, &main_stream->height);
+    main_stream->quality = constrain(0, param_int(OPT_QUALITY), 100);
+    main_stream->encoding = param_int(OPT_CODEC);
+
+    // A new encoder starts over from the ceiling
+    configure_quality_control(state.cam);
+    picam_quality_reset(&state.cam->quality_control, main_stream->quality);
+
+    struct stream_config configs[MAX_STREAMS - 1];
+    int scaled_count = parse_requested_streams(main_stream->width, main_stream->height, configs);
+    state.cam->stream_count = 1 + scaled_count;
+
+    struct stream_config raw_config;
+    MMAL_FOURCC_T raw_encoding = parse_requested_raw(main_stream->width, main_stream->height, &raw_config);
+    if (raw_encoding && state.cam->stream_count == MAX_STREAMS) {
+        warnx("No splitter output left for the raw stream. Ignoring it.");
+        raw_encoding = 0;
+    }
+
     int i;
-    for (i = 0; i < max; i++) {
-        MMAL_BUFFER_HEADER_T *jpegbuffer = mmal_queue_get(state.pool_jpegencoder->queue);
-        if (!jpegbuffer)
-            errx(EXIT_FAILURE, "Could not create jpeg buffer header");
-        if (mmal_port_send_buffer(state.jpegencoder->output[0], jpegbuffer) != MMAL_SUCCESS)
-            errx(EXIT_FAILURE, "Could not send buffers to jpeg port");
+    for (i = 0; i < MAX_STREAMS; i++) {
+        state.cam->streams[i].camera = state.cam->num;
+        state.cam->streams[i].id = i;
+        state.cam->streams[i].raw = false;
+    }
+    if (raw_encoding) {
+        struct picam_stream *raw = &state.cam->streams[state.cam->stream_count++];
+        raw->raw = true;
+        raw->encoding = raw_encoding;
+        raw->width = raw_config.width;
+        raw->height = raw_config.height;
+    }
+    for (i = 0; i < scaled_count; i++) {
+        state.cam->streams[i + 1].encoding = MMAL_ENCODING_JPEG;
+        state.cam->streams[i + 1].width = configs[i].width;
+        state.cam->streams[i + 1].height = configs[i].height;
+        state.cam->streams[i + 1].quality = configs[i].quality;
+    }
+
+    state.cam->encoder_buffers = requested_encoder_buffers();
+    state.cam->camera_frames = requested_camera_frames();
+    int camera_frames = state.cam->camera_frames;
+    if (camera_frames == 0)
+        camera_frames = high_rate_mode() ? HIGH_RATE_CAMERA_FRAMES : DEFAULT_CAMERA_FRAMES;
+
+    picam_camera_init(state.cam->camera, state.cam->num, imager_width, imager_height, camera_frames, &state.cam->camera_settings);
+    picam_camera_configure_format(state.cam->camera, main_stream->width, main_stream->height, fps256);
+
+    if (mmal_component_enable(state.cam->camera) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable camera");
+
+    //
+    // create renderer
+    //
+
+    picam_preview_init(&state.cam->preview);
+
+    //
+    // create splitter when there's more than one stream
+    //
+
+    if (state.cam->stream_count > 1) {
+        if (mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER, &state.cam->splitter) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not create video splitter");
+
+        configure_splitter();
+
+        if (mmal_component_enable(state.cam->splitter) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not enable video splitter");
+    }
+
+    //
+    // create resizers and jpeg-encoders
+    //
+
+    for (i = 0; i < state.cam->stream_count; i++)
+        create_stream(&state.cam->streams[i]);
+
+    //
+    // connect
+    //
+
+    if (mmal_connection_create(
+                &state.cam->preview.connection,
+                state.cam->camera->output[CAMERA_PORT_PREVIEW],
+                state.cam->preview.component->input[0],
+                MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT
+            ) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not create connection camera -> preview");
+
+    if (mmal_connection_enable(state.cam->preview.connection) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable connection camera -> preview");
+
+    if (state.cam->splitter) {
+        if (mmal_connection_create(
+                    &state.cam->con_cam_splitter,
+                    state.cam->camera->output[CAMERA_PORT_VIDEO],
+                    state.cam->splitter->input[0],
+                    MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT
+                ) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not create connection camera -> splitter");
+
+        if (mmal_connection_enable(state.cam->con_cam_splitter) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not enable connection camera -> splitter");
     }
 
+    for (i = 0; i < state.cam->stream_count; i++)
+        connect_stream(&state.cam->streams[i]);
+
     //
     // Set all parameters
     //
     apply_parameters(true);
+
+    // Start from where the last run left off rather than letting AE and AWB
+    // converge from scratch. That's released once the first frame is out.
+    CAMERA_SETTINGS_T seed;
+    const char *settings_file = param_str(OPT_SETTINGS_FILE);
+    if (*settings_file && picam_camera_load_settings(settings_file, &seed)) {
+        picam_camera_seed_settings(state.cam->camera, &seed);
+        state.cam->seeded = true;
+    }
 }
 
 void stop_all()
 {
-    mmal_port_disable(state.jpegencoder->output[0]);
+    save_camera_settings(true);
+
+    int i;
+    for (i = 0; i < state.cam->stream_count; i++)
+        destroy_stream(&state.cam->streams[i]);
+    if (state.cam->still.encoder)
+        destroy_stream(&state.cam->still);
+
+    if (state.cam->splitter)
+        mmal_connection_destroy(state.cam->con_cam_splitter);
+    mmal_connection_destroy(state.cam->preview.connection);
+
+    if (state.cam->splitter)
+        mmal_component_disable(state.cam->splitter);
+    mmal_component_disable(state.cam->preview.component);
+    mmal_component_disable(state.cam->camera);
+
+    if (state.cam->splitter)
+        mmal_component_destroy(state.cam->splitter);
+    mmal_component_destroy(state.cam->preview.component);
+    mmal_component_destroy(state.cam->camera);
+
+    state.cam->splitter = NULL;
+    state.cam->con_cam_splitter = NULL;
+}
+
+void resize_all(int width, int height)
+{
+    // Only the ports carrying video need to be reconfigured. Keeping the
+    // camera component enabled preserves its converged AE/AWB state.
+    //
+    // The connections are tunnelled, so disabling them disables the
+    // camera's preview and video ports and everything downstream of them.
+    // size_apply() only comes here for a single JPEG stream.
+    int i;
+    if (state.cam->splitter && mmal_connection_disable(state.cam->con_cam_splitter) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not disable connection camera -> splitter");
+    for (i = 0; i < state.cam->stream_count; i++) {
+        struct picam_stream *stream = &state.cam->streams[i];
+        if (mmal_connection_disable(stream->con_in) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not disable connection camera -> encoder");
+        if (stream->con_resizer && mmal_connection_disable(stream->con_resizer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not disable connection resizer -> encoder");
+    }
+    if (mmal_connection_disable(state.cam->preview.connection) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not disable connection camera -> preview");
+
+    // Send out whatever the encoders finished and drop partial frames since
+    // the rest of them aren't coming.
+    service_mmal_callbacks();
+    for (i = 0; i < state.cam->stream_count; i++)
+        drop_partial_frame(&state.cam->streams[i]);
+
+    state.cam->streams[0].width = width;
+    state.cam->streams[0].height = height;
+
+    int fps256 = lrint(256.0 * param_float(OPT_FPS));
+    picam_camera_configure_format(state.cam->camera, width, height, fps256);
+
+    if (state.cam->splitter)
+        configure_splitter();
+    for (i = 0; i < state.cam->stream_count; i++)
+        configure_stream_input(&state.cam->streams[i]);
+
+    if (mmal_connection_enable(state.cam->preview.connection) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable connection camera -> preview");
+    for (i = 0; i < state.cam->stream_count; i++) {
+        struct picam_stream *stream = &state.cam->streams[i];
+        if (stream->con_resizer && mmal_connection_enable(stream->con_resizer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not enable connection resizer -> encoder");
+        if (mmal_connection_enable(stream->con_in) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not enable connection camera -> encoder");
+    }
+    if (state.cam->splitter && mmal_connection_enable(state.cam->con_cam_splitter) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable connection camera -> splitter");
+}
 
-    mmal_connection_destroy(state.con_cam_video);
-    mmal_connection_destroy(state.preview.connection);
+static void begin_batch()
+{
+    // A camera=N line only lasts until the end of its packet
+    state.cam = first_camera();
+    state.batch.active = true;
+    state.batch.ack = false;
+    state.batch.unknown = 0;
+    state.batch.applied = 0;
+    state.batch.unchanged = 0;
+    state.batch.rebuilds = 0;
+}
 
-    mmal_port_pool_destroy(state.jpegencoder->output[0], state.pool_jpegencoder);
+// Apply what the packet has changed so far, in opts[] order, skipping
+// values that are already in effect.
+static void apply_touched()
+{
+    int applied = 0;
+    int unchanged = 0;
+    int rebuilds = 0;
+
+    struct camera_pipeline *current = state.cam;
+    int c;
+    for (c = 0; c < MAX_CAMERAS; c++) {
+        state.cam = &state.cameras[c];
+
+        const struct raspi_config_opt *opt;
+        for (opt = opts; opt->long_option; opt++) {
+            int ix = opt - opts;
+            if (!state.cam->touched[ix])
+                continue;
+            state.cam->touched[ix] = false;
+            if (!state.cam->enabled)
+                continue;
+
+            // start_all() applies everything once a rebuild is needed
+            const char *value = param_str(opt_id(opt));
+            if (state.cam->rebuild_pending) {
+                applied++;
+            } else if (state.cam->applied[ix] && strcmp(value, state.cam->applied[ix]) == 0) {
+                unchanged++;
+            } else {
+                if (option_applies(ix))
+                    opt->apply(opt, false);
+                record_applied(opt);
+                applied++;
+            }
+        }
 
-    mmal_component_disable(state.jpegencoder);
-    mmal_component_disable(state.preview.component);
-    mmal_component_disable(state.camera);
+        if (state.cam->rebuild_pending) {
+            stop_all();
+            start_all();
+            state.cam->rebuild_pending = false;
+            rebuilds++;
+        }
+    }
+    state.cam = current;
 
-    mmal_component_destroy(state.jpegencoder);
-    mmal_component_destroy(state.preview.component);
-    mmal_component_destroy(state.camera);
+    state.batch.applied += applied;
+    state.batch.unchanged += unchanged;
+    state.batch.rebuilds += rebuilds;
+}
 
-    close(state.mmal_callback_pipe[0]);
-    close(state.mmal_callback_pipe[1]);
+static void apply_batch()
+{
+    apply_touched();
+    state.batch.active = false;
+
+    if (state.batch.ack) {
+        char report[128];
+        int len = snprintf(report, sizeof(report),
+                           "applied=%d\nunchanged=%d\nunknown=%d\nrebuilds=%d\n",
+                           state.batch.applied, state.batch.unchanged, state.batch.unknown, state.batch.rebuilds);
+        output_message(MSG_ACK, report, len);
+    }
 }
 
 static void parse_config_lines(char *lines)
@@ -1093,6 +3261,150 @@ static unsigned int from_uint32_be(const char *buffer)
     return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
 }
 
+static char tlv_type(const struct raspi_config_opt *opt)
+{
+    switch (opt->type) {
+    case PARAM_INT:
+        return TLV_INT;
+    case PARAM_FLOAT:
+        return TLV_DOUBLE;
+    case PARAM_BOOL:
+        return TLV_BOOL;
+    default:
+        return TLV_STRING;
+    }
+}
+
+// Ids have to fit in a record's uint8
+_Static_assert(OPT_COUNT <= 256, "Too many options for binary commands");
+
+static void announce_options()
+{
+    char *report;
+    size_t len;
+    FILE *fp = open_memstream(&report, &len);
+    if (!fp)
+        err(EXIT_FAILURE, "open_memstream");
+
+    const struct raspi_config_opt *opt;
+    for (opt = opts; opt->long_option; opt++)
+        fprintf(fp, "%s=%d,%c\n", opt->long_option, opt_id(opt), tlv_type(opt));
+    fclose(fp);
+
+    output_message(MSG_OPTIONS, report, len);
+    free(report);
+}
+
+// Turns the value back into the text that the option would have been given
+// so that it's stored, compared and applied the same way.
+static int set_binary_option(int id, char type, const uint8_t *value, int len)
+{
+    if (id >= OPT_COUNT)
+        return TLV_ERROR_UNKNOWN;
+    const struct raspi_config_opt *opt = &opts[id];
+
+    char str[MAX_REQUEST_BUFFER_SIZE];
+    switch (type) {
+    case TLV_INT:
+        if (len != 4)
+            return TLV_ERROR_MALFORMED;
+        if (opt->type != PARAM_INT && opt->type != PARAM_FLOAT)
+            return TLV_ERROR_TYPE;
+        sprintf(str, "%d", (int32_t) from_uint32_be((const char *) value));
+        break;
+    case TLV_DOUBLE: {
+        if (len != 8)
+            return TLV_ERROR_MALFORMED;
+        if (opt->type != PARAM_FLOAT)
+            return TLV_ERROR_TYPE;
+        uint64_t bits = ((uint64_t) from_uint32_be((const char *) value) << 32) |
+                        from_uint32_be((const char *) value + 4);
+        double real;
+        memcpy(&real, &bits, sizeof(real));
+        sprintf(str, "%.9g", real);
+        break;
+    }
+    case TLV_BOOL:
+        if (len != 1)
+            return TLV_ERROR_MALFORMED;
+        if (opt->type != PARAM_BOOL)
+            return TLV_ERROR_TYPE;
+        strcpy(str, value[0] ? "on" : "off");
+        break;
+    case TLV_STRING:
+        if (opt->type != PARAM_STRING && opt->type != PARAM_ENUM)
+            return TLV_ERROR_TYPE;
+        memcpy(str, value, len);
+        str[len] = '\0';
+        break;
+    default:
+        return TLV_ERROR_TYPE;
+    }
+
+    // Unlike text, bad enum values get reported
+    if (!opt->env_key) {
+        run_command(opt, str);
+    } else if (opt->set == default_set) {
+        if (!parse_param(opt, str, param_slot(id)))
+            return TLV_ERROR_VALUE;
+    } else {
+        opt->set(opt, str, false);
+    }
+    if (opt->apply)
+        state.cam->touched[id] = true;
+    return 0;
+}
+
+static void put_be16(char *p, uint16_t value)
+{
+    p[0] = (char) (value >> 8);
+    p[1] = (char) value;
+}
+
+static void process_binary_packet(const uint8_t *packet, int len)
+{
+    uint32_t seq = from_uint32_be((const char *) packet + 2);
+
+    char reply[12 + 3 * MAX_TLV_ERRORS];
+    int error_count = 0;
+
+    begin_batch();
+
+    int offset = 6;
+    int record;
+    for (record = 0; offset < len; record++) {
+        int code = 0;
+        int value_len = 0;
+        if (offset + 4 > len) {
+            code = TLV_ERROR_MALFORMED;
+        } else {
+            value_len = (packet[offset + 2] << 8) | packet[offset + 3];
+            if (offset + 4 + value_len > len)
+                code = TLV_ERROR_MALFORMED;
+            else
+                code = set_binary_option(packet[offset], (char) packet[offset + 1], packet + offset + 4, value_len);
+        }
+
+        if (code && error_count < MAX_TLV_ERRORS) {
+            char *e = &reply[12 + 3 * error_count++];
+            put_be16(e, record);
+            e[2] = (char) code;
+        }
+        if (code == TLV_ERROR_MALFORMED)
+            break;
+        offset += 4 + value_len;
+    }
+
+    apply_batch();
+
+    put_be32(reply, seq);
+    put_be16(reply + 4, state.batch.applied);
+    put_be16(reply + 6, state.batch.unchanged);
+    put_be16(reply + 8, state.batch.rebuilds);
+    put_be16(reply + 10, error_count);
+    output_message(MSG_REPLY, reply, 12 + 3 * error_count);
+}
+
 static void process_stdin_header_framing()
 {
     // Each packet is length (4 bytes big endian), data
@@ -1100,13 +3412,23 @@ static void process_stdin_header_framing()
     while (state.stdin_buffer_ix > 4 &&
             (len = from_uint32_be(state.stdin_buffer)) &&
             state.stdin_buffer_ix >= 4 + len) {
+        const uint8_t *packet = (const uint8_t *) state.stdin_buffer + 4;
+        if (len >= 6 && packet[0] == MSG_MARKER && packet[1] == MSG_BINARY) {
+            process_binary_packet(packet, len);
+            state.stdin_buffer_ix -= 4 + len;
+            memmove(state.stdin_buffer, state.stdin_buffer + 4 + len, state.stdin_buffer_ix);
+            continue;
+        }
+
         // Copy over the lines to process so that they can be
         // null terminated.
         char lines[len + 1];
         memcpy(lines, state.stdin_buffer + 4, len);
         lines[len] = '\0';
 
+        begin_batch();
         parse_config_lines(lines);
+        apply_batch();
 
         // Advance to the next packet
         state.stdin_buffer_ix -= 4 + len;
@@ -1114,7 +3436,7 @@ static void process_stdin_header_framing()
     }
 
     // Check if we got a bogus length packet
-    if (len >= MAX_DATA_BUFFER_SIZE - 4 - 1)
+    if (len >= MAX_REQUEST_BUFFER_SIZE - 4 - 1)
         errx(EXIT_FAILURE, "Invalid packet size. Out of sync?");
 }
 
@@ -1144,32 +3466,125 @@ static int server_service_stdin()
     return amount_read;
 }
 
+// Sets up camera 0's main stream to play the clip on a timer. Frames go
+// through output_jpeg() like encoded ones, so everything downstream of the
+// encoder behaves the same.
+static void start_fake()
+{
+    picam_fake_open(&state.fake_clip, param_str(OPT_FAKE));
+    state.fake = true;
+
+    state.cam = &state.cameras[0];
+    state.cam->enabled = true;
+    state.cam->stream_count = 1;
+
+    struct picam_stream *stream = &state.cam->streams[0];
+    stream->encoding = MMAL_ENCODING_JPEG;
+    stream->width = state.fake_clip.width;
+    stream->height = state.fake_clip.height;
+    stream->quality = constrain(0, param_int(OPT_QUALITY), 100);
+
+    struct picam_stream *still = &state.cam->still;
+    still->still = true;
+    still->encoding = MMAL_ENCODING_JPEG;
+    still->width = state.fake_clip.width;
+    still->height = state.fake_clip.height;
+
+    state.fake_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (state.fake_timerfd < 0)
+        err(EXIT_FAILURE, "timerfd_create");
+
+    // This starts the timer
+    apply_parameters(true);
+}
+
+static void service_fake_timer()
+{
+    uint64_t ticks;
+    if (read(state.fake_timerfd, &ticks, sizeof(ticks)) < 0) {
+        if (errno == EAGAIN)
+            return;
+        err(EXIT_FAILURE, "read from timerfd broke");
+    }
+    if (state.paused)
+        return;
+
+    // Ticks missed while the main loop was busy are frames the camera
+    // would have dropped.
+    struct picam_stream *stream = &state.cameras[0].streams[0];
+    stream->frames_dropped += ticks - 1;
+
+    size_t len;
+    const char *jpeg = picam_fake_next(&state.fake_clip, &len);
+    stream->frame_pts = (int64_t) monotonic_us();
+    record_frame_size(stream, len);
+    output_jpeg(stream, jpeg, len);
+}
+
 static void server_loop()
 {
     if (isatty(STDIN_FILENO))
         errx(EXIT_FAILURE, "stdin should be a program and not a tty");
 
-    // Init hardware
-    bcm_host_init();
+    picam_writer_start(&state.stdout_writer, STDOUT_FILENO);
+    announce_options();
 
-    discover_sensors(&state.sensor_info);
-    if (state.sensor_info.num_cameras == 0)
-        errx(EXIT_FAILURE, "No imagers detected!");
+    // Create the wakeup file descriptor for getting back to the main thread
+    // from the MMAL callbacks. All cameras share it.
+    state.mmal_callback_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state.mmal_callback_eventfd < 0)
+        err(EXIT_FAILURE, "eventfd");
 
-    start_all();
+    int i;
+    if (*param_str(OPT_FAKE)) {
+        start_fake();
+    } else {
+        // Init hardware
+        bcm_host_init();
+
+        discover_sensors(&state.sensor_info);
+        if (state.sensor_info.num_cameras == 0)
+            errx(EXIT_FAILURE, "No imagers detected!");
+
+        parse_requested_cameras();
+        for (i = 0; i < MAX_CAMERAS; i++) {
+            if (!state.cameras[i].enabled)
+                continue;
+            state.cam = &state.cameras[i];
+            start_all();
+        }
+    }
+    state.cam = first_camera();
 
     // Main loop - keep going until we don't want any more JPEGs.
     state.stdin_buffer = (char*) malloc(MAX_REQUEST_BUFFER_SIZE);
 
     for (;;) {
-        struct pollfd fds[3];
+        struct pollfd fds[6 + PICAM_SOCKET_SERVER_MAX_CLIENTS];
         int fds_count = 2;
-        fds[0].fd = state.mmal_callback_pipe[0];
+        fds[0].fd = state.mmal_callback_eventfd;
         fds[0].events = POLLIN;
         fds[1].fd = STDIN_FILENO;
         fds[1].events = POLLIN;
+        int http_ix = fds_count;
+        fds_count += picam_http_server_add_pollfds(&state.http_server, &fds[http_ix]);
+        int socket_ix = fds_count;
+        fds_count += picam_socket_server_add_pollfds(&state.socket_server, &fds[socket_ix]);
+
+        int returned_ix = fds_count++;
+        fds[returned_ix].fd = state.stdout_writer.return_fd;
+        fds[returned_ix].events = POLLIN;
+
+        int fake_ix = -1;
+        if (state.fake) {
+            fake_ix = fds_count++;
+            fds[fake_ix].fd = state.fake_timerfd;
+            fds[fake_ix].events = POLLIN;
+        }
 
-        int ready = poll(fds, fds_count, 2000);
+        // No frames come while paused, so there's nothing to watch for.
+        // Resuming takes a stdin packet, which starts the timeout afresh.
+        int ready = poll(fds, fds_count, state.paused ? -1 : 2000);
         if (ready < 0) {
             if (errno != EINTR)
                 err(EXIT_FAILURE, "poll");
@@ -1177,38 +3592,74 @@ static void server_loop()
             // Time out - something is wrong that we're not getting MMAL callbacks
             errx(EXIT_FAILURE, "MMAL unresponsive. Video stuck?");
         } else {
+            // Sending frames and handling commands can close clients, which
+            // moves them around in the socket server, so their pollfds are
+            // only good until then.
+            picam_http_server_service(&state.http_server, &fds[http_ix], monotonic_us());
+            picam_socket_server_service(&state.socket_server, &fds[socket_ix]);
             if (fds[0].revents)
-                jpegencoder_buffer_callback_impl();
+                service_mmal_callbacks();
             if (fds[1].revents) {
                 if (server_service_stdin() <= 0)
                     break;
             }
+            if (fds[returned_ix].revents)
+                service_returned_frames();
+            if (fake_ix >= 0 && fds[fake_ix].revents)
+                service_fake_timer();
         }
     }
 
-    stop_all();
+    if (state.fake) {
+        close(state.fake_timerfd);
+        picam_fake_close(&state.fake_clip);
+    }
+    for (i = 0; i < MAX_CAMERAS && !state.fake; i++) {
+        if (!state.cameras[i].enabled)
+            continue;
+        state.cam = &state.cameras[i];
+        stop_all();
+    }
+    close(state.mmal_callback_eventfd);
+    picam_socket_server_close(&state.socket_server);
+    picam_http_server_close(&state.http_server);
+    picam_rtp_close(&state.rtp);
+    picam_recorder_close(&state.recorder);
+    picam_shm_ring_close(&state.shm_ring);
+    picam_writer_stop(&state.stdout_writer);
     free(state.stdin_buffer);
 }
 
 int main(int argc, char* argv[])
 {
     memset(&state, 0, sizeof(state));
-
-    // Parse commandline and config file arguments
+    int i;
+    for (i = 0; i < MAX_CAMERAS; i++)
+        state.cameras[i].num = i;
+    state.cam = &state.cameras[0];
+    picam_socket_server_init(&state.socket_server);
+    picam_http_server_init(&state.http_server);
+    picam_rtp_init(&state.rtp);
+    picam_recorder_init(&state.recorder);
+    picam_shm_ring_init(&state.shm_ring);
+    state.timings.last_report = monotonic_us();
+
+    // Start from the environment and defaults, then the commandline
+    load_parameters();
     parse_args(argc, argv);
-
-    // If anything still isn't set, then fill-in with defaults
-    fillin_defaults();
-    picam_preview_set_defaults(&state.preview);
-
-    // Allocate buffers
-    state.socket_buffer = (char *) malloc(MAX_DATA_BUFFER_SIZE);
-    if (!state.socket_buffer)
-        err(EXIT_FAILURE, "malloc");
+    for (i = 0; i < MAX_CAMERAS; i++)
+        picam_preview_set_defaults(&state.cameras[i].preview);
 
     server_loop();
 
-    free(state.socket_buffer);
+    for (i = 0; i < MAX_CAMERAS; i++) {
+        int j;
+        for (j = 0; j < MAX_STREAMS; j++)
+            free(state.cameras[i].streams[j].frame_buffer);
+        for (j = 0; j < OPT_COUNT; j++)
+            free(state.cameras[i].applied[j]);
+        free(state.cameras[i].still.frame_buffer);
+    }
 
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,104 @@
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "picam_motion.h"
+#include "picam_test.h"
+
+#define MAX_VECTORS 1024
+
+static MOTION_VECTOR_T vectors[MAX_VECTORS];
+
+static size_t clear_vectors(int width, int height)
+{
+    memset(vectors, 0, sizeof(vectors));
+    return ((width + 15) / 16 + 1) * ((height + 15) / 16) * sizeof(MOTION_VECTOR_T);
+}
+
+static void set_vector(int width, int column, int row, int x, int y, int sad)
+{
+    MOTION_VECTOR_T *mv = &vectors[row * ((width + 15) / 16 + 1) + column];
+    mv->x = x;
+    mv->y = y;
+    mv->sad = sad;
+}
+
+static void test_still_frame()
+{
+    MOTION_RESULT_T result;
+    size_t len = clear_vectors(64, 32);
+    CHECK(picam_motion_analyze(vectors, len, 64, 32, 4, &result));
+    CHECK(result.active == 0);
+    CHECK(result.total == 4 * 2);
+    CHECK(result.left == 0 && result.top == 0 && result.right == 0 && result.bottom == 0);
+    CHECK(result.grid == 0);
+}
+
+static void test_threshold_and_bounds()
+{
+    MOTION_RESULT_T result;
+    size_t len = clear_vectors(64, 32);
+
+    // 3,4 is exactly 5 long. The SAD doesn't count, and neither does the
+    // extra column at the end of each row.
+    set_vector(64, 2, 1, 3, 4, 0);
+    set_vector(64, 0, 0, 1, -1, 0xffff);
+    set_vector(64, 4, 0, 100, 100, 0);
+
+    CHECK(picam_motion_analyze(vectors, len, 64, 32, 5, &result));
+    CHECK(result.active == 1);
+    CHECK(result.left == 2 && result.right == 2 && result.top == 1 && result.bottom == 1);
+
+    // Row 1 of 2 and column 2 of 4 land in the middle of the 8x8 grid
+    CHECK(result.grid == (uint64_t) 1 << (4 * PICAM_MOTION_GRID + 4));
+
+    CHECK(picam_motion_analyze(vectors, len, 64, 32, 6, &result));
+    CHECK(result.active == 0);
+
+    // Negative vectors are just as long
+    set_vector(64, 1, 0, -3, -4, 0);
+    CHECK(picam_motion_analyze(vectors, len, 64, 32, 5, &result));
+    CHECK(result.active == 2);
+    CHECK(result.left == 1 && result.right == 2 && result.top == 0 && result.bottom == 1);
+}
+
+static void test_wide_rows()
+{
+    // Wider than the 8 macroblocks the NEON path takes at a time, with a
+    // remainder for the scalar loop.
+    MOTION_RESULT_T result;
+    size_t len = clear_vectors(320, 48);
+    set_vector(320, 0, 0, 10, 0, 0);
+    set_vector(320, 9, 1, 0, -10, 0);
+    set_vector(320, 15, 2, 127, 127, 0);
+    set_vector(320, 19, 2, -128, -128, 0);
+
+    CHECK(picam_motion_analyze(vectors, len, 320, 48, 10, &result));
+    CHECK(result.active == 4);
+    CHECK(result.total == 20 * 3);
+    CHECK(result.left == 0 && result.right == 19 && result.top == 0 && result.bottom == 2);
+
+    // A huge threshold is clamped so that the longest vector still counts
+    CHECK(picam_motion_analyze(vectors, len, 320, 48, 1000, &result));
+    CHECK(result.active == 1);
+    CHECK(result.left == 19);
+}
+
+static void test_size_mismatch()
+{
+    MOTION_RESULT_T result;
+    size_t len = clear_vectors(64, 32);
+    CHECK(!picam_motion_analyze(vectors, len - sizeof(MOTION_VECTOR_T), 64, 32, 4, &result));
+    CHECK(!picam_motion_analyze(vectors, len, 80, 32, 4, &result));
+}
+
+int main()
+{
+    test_still_frame();
+    test_threshold_and_bounds();
+    test_wide_rows();
+    test_size_mismatch();
+    return EXIT_SUCCESS;
+}
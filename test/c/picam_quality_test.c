@@ -0,0 +1,106 @@
+#include <err.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "picam_quality.h"
+#include "picam_test.h"
+
+#define FRAME_INTERVAL_US 33333
+
+// A scene whose frames are base_size bytes at quality 50 and double every
+// PICAM_QUALITY_PER_DOUBLING steps, as the controller assumes.
+static size_t frame_size(double base_size, int quality)
+{
+    return (size_t) (base_size * pow(2.0, (quality - 50) / PICAM_QUALITY_PER_DOUBLING));
+}
+
+// Runs the controller for a number of frames and returns the average size
+// of the last 30.
+static double run(QUALITY_CONTROL_T *qc, double base_size, int frames, int *quality, size_t *largest)
+{
+    double total = 0;
+    uint64_t timestamp_us = 1000000;
+    *largest = 0;
+    int i;
+    for (i = 0; i < frames; i++) {
+        size_t len = frame_size(base_size, *quality);
+        *quality = picam_quality_update(qc, len, timestamp_us);
+        timestamp_us += FRAME_INTERVAL_US;
+
+        CHECK(*quality >= qc->min_quality && *quality <= qc->max_quality);
+        if (i >= frames - 30) {
+            total += len;
+            if (len > *largest)
+                *largest = len;
+        }
+    }
+    return total / 30;
+}
+
+static void test_disabled()
+{
+    QUALITY_CONTROL_T qc = {0};
+    picam_quality_configure(&qc, 0, 0, 5, 90);
+    CHECK(!picam_quality_enabled(&qc));
+
+    picam_quality_configure(&qc, 1000000, 0, 5, 90);
+    CHECK(picam_quality_enabled(&qc));
+    CHECK(qc.quality == 90);
+}
+
+static void test_bitrate_target()
+{
+    // 30 fps at 1 Mbit/s is about 4.2 kB a frame. At the starting quality
+    // the frames are about 50 kB.
+    QUALITY_CONTROL_T qc = {0};
+    picam_quality_configure(&qc, 1000000, 0, 5, 85);
+    int quality = 85;
+    size_t largest;
+    double average = run(&qc, 5000, 300, &quality, &largest);
+
+    double budget = 1000000 / 8.0 * FRAME_INTERVAL_US / 1000000.0;
+    CHECK(fabs(log2(average / budget)) < 0.15);
+    CHECK(quality < 85);
+
+    // When the scene gets simpler, the quality comes back up to the ceiling
+    run(&qc, 100, 300, &quality, &largest);
+    CHECK(quality == 85);
+}
+
+static void test_max_frame_size()
+{
+    QUALITY_CONTROL_T qc = {0};
+    picam_quality_configure(&qc, 0, 20000, 5, 95);
+    int quality = 95;
+    size_t largest;
+    run(&qc, 8000, 200, &quality, &largest);
+    CHECK(largest <= 20000);
+    CHECK(quality > 5);
+}
+
+static void test_floor()
+{
+    // A target that can't be met leaves the quality at the floor
+    QUALITY_CONTROL_T qc = {0};
+    picam_quality_configure(&qc, 1000, 0, 20, 80);
+    int quality = 80;
+    size_t largest;
+    run(&qc, 50000, 200, &quality, &largest);
+    CHECK(quality == 20);
+
+    // Raising the floor later moves the quality with it
+    picam_quality_configure(&qc, 1000, 0, 30, 80);
+    CHECK(qc.quality == 30);
+}
+
+int main()
+{
+    test_disabled();
+    test_bitrate_target();
+    test_max_frame_size();
+    test_floor();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,267 @@
+#include <err.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "picam_rtp.h"
+#include "picam_test.h"
+
+#define WIDTH           320
+#define HEIGHT          240
+#define SCAN_LEN        6000
+#define MAX_PACKETS     256
+#define MAX_PACKET_SIZE 2048
+
+struct packet
+{
+    uint8_t data[MAX_PACKET_SIZE];
+    int len;
+};
+
+static struct packet packets[MAX_PACKETS];
+
+static void put_be16(uint8_t *p, int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static int get_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint8_t *put_segment(uint8_t *p, int marker, const uint8_t *body, int len)
+{
+    p[0] = 0xff;
+    p[1] = marker;
+    put_be16(&p[2], len + 2);
+    memcpy(&p[4], body, len);
+    return p + 4 + len;
+}
+
+// A baseline 4:2:0 JPEG with the headers the encoder writes. The scan is
+// filler, with a restart marker every restart_spacing bytes if there are
+// any, since the sender never decodes it.
+static size_t make_jpeg(uint8_t *jpeg, int restart_spacing, const uint8_t **scan)
+{
+    uint8_t *p = jpeg;
+    *p++ = 0xff;
+    *p++ = 0xd8;
+
+    uint8_t dqt[65];
+    int table;
+    for (table = 0; table < 2; table++) {
+        dqt[0] = table;
+        memset(&dqt[1], 10 + table, 64);
+        p = put_segment(p, 0xdb, dqt, sizeof(dqt));
+    }
+
+    uint8_t sof[15] = {8, HEIGHT >> 8, HEIGHT & 0xff, WIDTH >> 8, WIDTH & 0xff, 3,
+                       1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1};
+    p = put_segment(p, 0xc0, sof, sizeof(sof));
+
+    if (restart_spacing) {
+        uint8_t dri[2] = {0, 4};
+        p = put_segment(p, 0xdd, dri, sizeof(dri));
+    }
+
+    uint8_t sos[10] = {3, 1, 0, 2, 0x11, 3, 0x11, 0, 63, 0};
+    p = put_segment(p, 0xda, sos, sizeof(sos));
+
+    *scan = p;
+    int i;
+    for (i = 0; i < SCAN_LEN; i++) {
+        if (restart_spacing && i % restart_spacing == restart_spacing - 2) {
+            *p++ = 0xff;
+            *p++ = 0xd0 + (i / restart_spacing) % 8;
+            i++;
+        } else {
+            *p++ = (uint8_t) (i % 251);
+        }
+    }
+
+    *p++ = 0xff;
+    *p++ = 0xd9;
+    return p - jpeg;
+}
+
+static int open_receiver(int *port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        err(EXIT_FAILURE, "socket");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err(EXIT_FAILURE, "bind");
+
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+        err(EXIT_FAILURE, "getsockname");
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int receive_packets(int fd)
+{
+    int count = 0;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (count < MAX_PACKETS && poll(&pfd, 1, 200) > 0) {
+        packets[count].len = recv(fd, packets[count].data, MAX_PACKET_SIZE, 0);
+        if (packets[count].len < 0)
+            err(EXIT_FAILURE, "recv");
+        count++;
+    }
+    return count;
+}
+
+// Checks the RTP and RFC 2435 headers of a frame's packets and that their
+// payloads put the scan back together.
+static void check_frame(int count, int mtu, uint64_t timestamp_us, bool restarts,
+                        const uint8_t *scan, size_t scan_len)
+{
+    CHECK(count > 1);
+
+    uint8_t reassembled[SCAN_LEN];
+    size_t expected_offset = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        const uint8_t *p = packets[i].data;
+        bool last = i == count - 1;
+        CHECK(packets[i].len <= mtu);
+
+        CHECK(p[0] == 0x80);
+        CHECK(p[1] == ((last ? 0x80 : 0) | 26));
+        CHECK(get_be16(&p[2]) == ((get_be16(&packets[0].data[2]) + i) & 0xffff));
+        CHECK(get_be32(&p[4]) == (uint32_t) (timestamp_us * 9 / 100));
+        CHECK(get_be32(&p[8]) == get_be32(&packets[0].data[8]));
+
+        const uint8_t *jpeg = &p[12];
+        size_t offset = get_be32(jpeg) & 0xffffff;
+        CHECK(jpeg[0] == 0);
+        CHECK(offset == expected_offset);
+        CHECK(jpeg[4] == (restarts ? 65 : 1));
+        CHECK(jpeg[5] == 255);
+        CHECK(jpeg[6] == WIDTH / 8);
+        CHECK(jpeg[7] == HEIGHT / 8);
+
+        const uint8_t *payload = &jpeg[8];
+        if (restarts) {
+            CHECK(get_be16(payload) == 4);
+            int flags = get_be16(&payload[2]);
+            CHECK((flags & 0x8000) || i > 0);
+            CHECK((flags & 0x4000) || !last);
+            payload += 4;
+        }
+
+        // Quantization tables only come with the first packet
+        if (i == 0) {
+            CHECK(payload[0] == 0 && payload[1] == 0);
+            CHECK(get_be16(&payload[2]) == 128);
+            CHECK(payload[4] == 10 && payload[4 + 64] == 11);
+            payload += 4 + 128;
+        }
+
+        size_t payload_len = packets[i].len - (payload - p);
+        CHECK(offset + payload_len <= scan_len);
+        memcpy(&reassembled[offset], payload, payload_len);
+        expected_offset += payload_len;
+
+        // With restart markers, packets end on them unless it's the last
+        if (restarts && !last)
+            CHECK(payload[payload_len - 2] == 0xff && (payload[payload_len - 1] & 0xf8) == 0xd0);
+    }
+    CHECK(expected_offset == scan_len);
+    CHECK(memcmp(reassembled, scan, scan_len) == 0);
+}
+
+static void test_send(int restart_spacing, int fragments)
+{
+    int port;
+    int rx = open_receiver(&port);
+
+    char destination[32];
+    snprintf(destination, sizeof(destination), "127.0.0.1:%d", port);
+    RTP_SENDER_T rtp;
+    picam_rtp_init(&rtp);
+    picam_rtp_open(&rtp, destination, 1000);
+
+    static uint8_t jpeg[SCAN_LEN + 1024];
+    const uint8_t *scan;
+    size_t len = make_jpeg(jpeg, restart_spacing, &scan);
+
+    // Frames can arrive in several encoder buffers
+    struct iovec iovs[3];
+    size_t split = len / fragments;
+    int i;
+    for (i = 0; i < fragments; i++) {
+        iovs[i].iov_base = jpeg + i * split;
+        iovs[i].iov_len = i == fragments - 1 ? len - i * split : split;
+    }
+
+    uint64_t timestamp_us = 123456789;
+    picam_rtp_send(&rtp, iovs, fragments, len, timestamp_us);
+
+    int count = receive_packets(rx);
+    check_frame(count, 1000, timestamp_us, restart_spacing > 0, scan, jpeg + len - 2 - scan);
+    CHECK(rtp.packets_sent == (unsigned long) count);
+    CHECK(rtp.frames_dropped == 0);
+
+    picam_rtp_close(&rtp);
+    close(rx);
+}
+
+static void test_rejects_progressive()
+{
+    int port;
+    int rx = open_receiver(&port);
+
+    char destination[32];
+    snprintf(destination, sizeof(destination), "127.0.0.1:%d", port);
+    RTP_SENDER_T rtp;
+    picam_rtp_init(&rtp);
+    picam_rtp_open(&rtp, destination, 1000);
+
+    static uint8_t jpeg[SCAN_LEN + 1024];
+    const uint8_t *scan;
+    size_t len = make_jpeg(jpeg, 0, &scan);
+    // SOF0 comes after SOI and the two DQT segments
+    CHECK(jpeg[2 + 2 * (4 + 65) + 1] == 0xc0);
+    jpeg[2 + 2 * (4 + 65) + 1] = 0xc2;
+
+    struct iovec iov = {jpeg, len};
+    picam_rtp_send(&rtp, &iov, 1, len, 0);
+    CHECK(receive_packets(rx) == 0);
+    CHECK(rtp.frames_dropped == 1);
+
+    picam_rtp_close(&rtp);
+    close(rx);
+}
+
+int main()
+{
+    test_send(0, 1);
+    test_send(0, 3);
+    test_send(300, 1);
+    test_send(300, 2);
+    test_rejects_progressive();
+    return EXIT_SUCCESS;
+}
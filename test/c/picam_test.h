@@ -0,0 +1,12 @@
+#ifndef PICAM_TEST_H
+#define PICAM_TEST_H
+
+// Just enough to fail loudly. Each test program runs its checks from main()
+// and exits non-zero at the first one that doesn't hold.
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+            errx(EXIT_FAILURE, "%s:%d: check failed: %s", __FILE__, __LINE__, #cond); \
+    } while (0)
+
+#endif
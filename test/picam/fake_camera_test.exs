@@ -0,0 +1,63 @@
+defmodule Picam.FakeCameraTest do
+  use ExUnit.Case
+
+  # Picam talks to whichever camera is configured, so these go through the
+  # public API the same way an application would in test.
+  setup_all do
+    Application.put_env(:picam, :camera, Picam.FakeCamera)
+    {:ok, _pid} = Picam.FakeCamera.start_link()
+    on_exit(fn -> Application.delete_env(:picam, :camera) end)
+    :ok
+  end
+
+  test "capture_still returns the current image" do
+    Picam.FakeCamera.set_image("not really a jpeg")
+    assert Picam.capture_still() == "not really a jpeg"
+
+    Picam.set_size(640, 480)
+    assert Picam.capture_still() == fake_image("640_480.jpg")
+  end
+
+  test "batch applies the settings together" do
+    result =
+      Picam.batch(fn ->
+        Picam.set_size(1920, 1080)
+        Picam.set_fps(30)
+      end)
+
+    assert result == {:ok, %{applied: 2, unchanged: 0, unknown: 0, rebuilds: 0}}
+    assert Picam.capture_still() == fake_image("1920_1080.jpg")
+  end
+
+  test "subscribers get frames until they unsubscribe" do
+    Picam.FakeCamera.set_image("frame")
+    assert Picam.subscribe() == :ok
+    assert_receive {:picam_frame, {0, 0}, "frame"}, 1_000
+
+    assert Picam.unsubscribe() == :ok
+    flush_frames()
+    refute_receive {:picam_frame, _, _}, 200
+  end
+
+  test "configure applies typed settings" do
+    assert Picam.configure(size: "640,480", fps: 15.0, vstab: true) ==
+             {:ok, %{applied: 3, unchanged: 0, rebuilds: 0}}
+
+    assert Picam.capture_still() == fake_image("640_480.jpg")
+    assert Picam.configure(:fps) == {:error, :invalid_settings}
+  end
+
+  defp flush_frames() do
+    receive do
+      {:picam_frame, _, _} -> flush_frames()
+    after
+      0 -> :ok
+    end
+  end
+
+  defp fake_image(filename) do
+    :code.priv_dir(:picam)
+    |> Path.join("fake_camera_images/#{filename}")
+    |> File.read!()
+  end
+end